@@ -0,0 +1,290 @@
+// AbrpUploader over SocketUploadLink against tools/abrpstub.py, started once
+// per case with the options it exercises; time is passed in by hand.
+//
+//   abrpupload_test python3 tools/abrpstub.py
+#include <Arduino.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+#include "abrpupload.h"
+#include "uploadsocket.h"
+
+namespace {
+int failures = 0;
+
+#define CHECK(cond)                                                  \
+  do {                                                               \
+    if (!(cond)) {                                                   \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      failures++;                                                    \
+    }                                                                \
+  } while (0)
+
+const char* python = nullptr;
+const char* stubScript = nullptr;
+
+// a new record whenever soc is changed
+class FakeSource : public TlmSource {
+public:
+  int tlmJson(char* buffer, int bufferSize, uint32_t nowMs, uint32_t* sequence) const override
+  {
+    if (sequence) {
+      *sequence = seq;
+    }
+    return snprintf(buffer, bufferSize, "{\"utc\":%u,\"soc\":%d}", 1700000000u + nowMs / 1000, soc);
+  }
+  uint32_t fieldSequence() const override { return seq; }
+  void setSoc(int value)
+  {
+    soc = value;
+    seq++;
+  }
+
+private:
+  int soc = 50;
+  uint32_t seq = 1;
+};
+
+// the stub as a child process, its stdout (one line per record) on a pipe
+class Stub {
+public:
+  bool start(std::initializer_list<const char*> options)
+  {
+    m_port = freePort();
+    char port[8];
+    snprintf(port, sizeof(port), "%u", static_cast<unsigned int>(m_port));
+    int out[2];
+    if (m_port == 0 || pipe(out) != 0) {
+      return false;
+    }
+    m_pid = fork();
+    if (m_pid == 0) {
+      dup2(out[1], STDOUT_FILENO);
+      close(out[0]);
+      close(out[1]);
+      std::vector<const char*> argv = {python, stubScript, "--port", port};
+      argv.insert(argv.end(), options.begin(), options.end());
+      argv.push_back(nullptr);
+      execvp(python, const_cast<char* const*>(argv.data()));
+      _exit(127);
+    }
+    close(out[1]);
+    m_out = out[0];
+    // serving once it has said so
+    std::string line;
+    return m_pid > 0 && readLine(line) && line.find("ABRP stand-in") == 0;
+  }
+
+  void stop()
+  {
+    if (m_pid > 0) {
+      kill(m_pid, SIGTERM);
+      waitpid(m_pid, nullptr, 0);
+      m_pid = -1;
+    }
+    if (m_out >= 0) {
+      close(m_out);
+      m_out = -1;
+    }
+  }
+
+  ~Stub() { stop(); }
+
+  // "#<connection> token=<token> <record>"; false after 2 s without one
+  bool readLine(std::string& line)
+  {
+    line.clear();
+    for (;;) {
+      pollfd pfd = {m_out, POLLIN, 0};
+      char c = 0;
+      if (poll(&pfd, 1, 2000) <= 0 || read(m_out, &c, 1) != 1) {
+        return false;
+      }
+      if (c == '\n') {
+        return true;
+      }
+      line += c;
+    }
+  }
+
+  std::string url() const { return "http://127.0.0.1:" + std::to_string(m_port) + "/1/tlm/send"; }
+
+private:
+  static uint16_t freePort()
+  {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    uint16_t port = 0;
+    if (fd >= 0 && bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0 &&
+        getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) == 0) {
+      port = ntohs(addr.sin_port);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+    return port;
+  }
+
+  pid_t m_pid = -1;
+  int m_out = -1;
+  uint16_t m_port = 0;
+};
+
+void testBegin()
+{
+  AbrpUploader uploader;
+  CHECK(!uploader.begin("", "", "", 1));
+  CHECK(!uploader.begin("ftp://example.com/", "token", "", 1));
+  CHECK(!uploader.begin("http://example.com:0/", "token", "", 1));
+  CHECK(uploader.begin("", "token", "", 1));
+  CHECK(uploader.begin("http://example.com:8080", "token", "key", 1));
+}
+
+// records share one connection and are only sent when a field changed
+void testKeepAlive()
+{
+  Stub stub;
+  CHECK(stub.start({}));
+  SocketUploadLink link;
+  AbrpUploader uploader;
+  FakeSource source;
+  CHECK(uploader.begin(stub.url().c_str(), "my token", "", 1));
+  uploader.setLink(&link);
+
+  std::string line;
+  CHECK(uploader.poll(source, 0));
+  CHECK(stub.readLine(line) && line.find("#1 token=my token ") == 0 && line.find("\"soc\": 50") != std::string::npos);
+  // changed, but not due
+  source.setSoc(51);
+  CHECK(!uploader.poll(source, 500));
+  CHECK(uploader.poll(source, 1000));
+  CHECK(stub.readLine(line) && line.find("#1 ") == 0 && line.find("\"soc\": 51") != std::string::npos);
+  // due, but nothing changed
+  CHECK(!uploader.poll(source, 2000));
+  source.setSoc(52);
+  CHECK(uploader.poll(source, 2000));
+  CHECK(stub.readLine(line) && line.find("#1 ") == 0);
+
+  CHECK(uploader.stats().sent == 3);
+  CHECK(uploader.stats().failed == 0);
+  CHECK(uploader.stats().connects == 1);
+  CHECK(uploader.stats().lastStatus == 200);
+  uploader.setLink(nullptr);
+}
+
+// "Connection: close" drops the connection; the next record opens another
+void testConnectionClose()
+{
+  Stub stub;
+  CHECK(stub.start({"--close-every", "2"}));
+  SocketUploadLink link;
+  AbrpUploader uploader;
+  FakeSource source;
+  CHECK(uploader.begin(stub.url().c_str(), "token", "", 1));
+  uploader.setLink(&link);
+
+  std::string line;
+  for (uint32_t i = 0; i < 3; i++) {
+    source.setSoc(60 + i);
+    CHECK(uploader.poll(source, i * 1000));
+    CHECK(stub.readLine(line) && line.find(i < 2 ? "#1 " : "#2 ") == 0);
+  }
+  CHECK(uploader.stats().sent == 3);
+  CHECK(uploader.stats().connects == 2);
+  uploader.setLink(nullptr);
+}
+
+void testChunked()
+{
+  Stub stub;
+  CHECK(stub.start({"--chunked"}));
+  SocketUploadLink link;
+  AbrpUploader uploader;
+  FakeSource source;
+  CHECK(uploader.begin(stub.url().c_str(), "token", "", 1));
+  uploader.setLink(&link);
+
+  std::string line;
+  for (uint32_t i = 0; i < 2; i++) {
+    source.setSoc(70 + i);
+    CHECK(uploader.poll(source, i * 1000));
+    CHECK(stub.readLine(line) && line.find("#1 ") == 0);
+  }
+  CHECK(uploader.stats().sent == 2);
+  CHECK(uploader.stats().connects == 1);
+  uploader.setLink(nullptr);
+}
+
+// a refused record is retried after 2, 4, 8... intervals
+void testBackoff()
+{
+  Stub stub;
+  CHECK(stub.start({"--status", "401"}));
+  SocketUploadLink link;
+  AbrpUploader uploader;
+  FakeSource source;
+  CHECK(uploader.begin(stub.url().c_str(), "token", "", 1));
+  uploader.setLink(&link);
+
+  std::string line;
+  CHECK(!uploader.poll(source, 0));
+  CHECK(stub.readLine(line));
+  CHECK(uploader.stats().failed == 1);
+  CHECK(uploader.stats().lastStatus == 401);
+  CHECK(!uploader.poll(source, 1999));
+  CHECK(uploader.stats().failed == 1);
+  CHECK(!uploader.poll(source, 2000));
+  CHECK(stub.readLine(line));
+  CHECK(uploader.stats().failed == 2);
+  CHECK(!uploader.poll(source, 5999));
+  CHECK(uploader.stats().failed == 2);
+  CHECK(!uploader.poll(source, 6000));
+  CHECK(uploader.stats().failed == 3);
+  CHECK(uploader.stats().sent == 0);
+  uploader.setLink(nullptr);
+}
+
+// nothing listening: connect fails and counts as a failed upload
+void testNoServer()
+{
+  SocketUploadLink link;
+  AbrpUploader uploader;
+  FakeSource source;
+  CHECK(uploader.begin("http://127.0.0.1:1/1/tlm/send", "token", "", 1));
+  uploader.setLink(&link);
+  CHECK(!uploader.poll(source, 0));
+  CHECK(uploader.stats().failed == 1);
+  CHECK(uploader.stats().connects == 0);
+  uploader.setLink(nullptr);
+}
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 3) {
+    printf("usage: %s <python3> <abrpstub.py>\n", argv[0]);
+    return 2;
+  }
+  python = argv[1];
+  stubScript = argv[2];
+  testBegin();
+  testKeepAlive();
+  testConnectionClose();
+  testChunked();
+  testBackoff();
+  testNoServer();
+  if (failures) {
+    printf("%d check(s) failed\n", failures);
+    return 1;
+  }
+  printf("abrpupload: all checks passed\n");
+  return 0;
+}
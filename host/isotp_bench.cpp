@@ -0,0 +1,65 @@
+// Throughput of the ISO-TP state machine alone: a 30-byte request (FF, FC, 4 CFs)
+// answered by a 62-byte response (FF, FC, 8 CFs), through a fake link.
+#include "isotp.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace {
+class CountingLink : public IsoTpLink {
+public:
+  bool sendFrame(const UdsFrame&) override
+  {
+    frames++;
+    return true;
+  }
+  uint64_t frames = 0;
+};
+
+UdsFrame rxFrame(const uint8_t* data, uint8_t len)
+{
+  UdsFrame f;
+  f.id = 0x7EC;
+  f.len = len;
+  memcpy(f.data, data, len);
+  return f;
+}
+}
+
+int main(int argc, char** argv)
+{
+  uint32_t rounds = argc > 1 ? static_cast<uint32_t>(strtoul(argv[1], nullptr, 10)) : 1000000;
+  CountingLink link;
+  IsoTpSession session;
+  uint8_t request[30] = {0x2E, 0x01, 0x01};
+  uint8_t response[64];
+  const uint8_t fc[3] = {0x30, 0x00, 0x00};
+  const uint8_t ff[8] = {0x10, 62, 0x62, 0x01, 0x01, 0, 0, 0};
+  uint8_t cf[8] = {0};
+  uint64_t rxFrames = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  uint32_t nowUs = 0;
+  for (uint32_t r = 0; r < rounds; r++) {
+    session.start(&link, 0x7E4, false, 0x7EC, false, request, sizeof(request), response, sizeof(response),
+                  IsoTpParams(), nowUs, 100000);
+    session.onFrame(rxFrame(fc, sizeof(fc)), nowUs);
+    session.onFrame(rxFrame(ff, sizeof(ff)), nowUs);
+    rxFrames += 2;
+    for (uint8_t seq = 1; session.state() == ISOTP_RECV_CF; seq++) {
+      cf[0] = static_cast<uint8_t>(0x20 | (seq & 0x0F));
+      session.onFrame(rxFrame(cf, sizeof(cf)), nowUs);
+      rxFrames++;
+    }
+    if (session.state() != ISOTP_DONE) {
+      printf("round %u ended in state %u\n", r, session.state());
+      return 1;
+    }
+    nowUs += 10;
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  uint64_t frames = link.frames + rxFrames;
+  printf("%u transactions, %llu frames in %.3f s: %.0f ns/transaction, %.1f M frames/s\n",
+         rounds, static_cast<unsigned long long>(frames), seconds, seconds * 1e9 / rounds, frames / seconds / 1e6);
+  return 0;
+}
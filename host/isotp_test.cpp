@@ -0,0 +1,255 @@
+// IsoTpSession driven through a fake IsoTpLink, with time passed in by hand.
+#include "isotp.h"
+#include <stdio.h>
+#include <vector>
+
+namespace {
+int failures = 0;
+
+#define CHECK(cond)                                                  \
+  do {                                                               \
+    if (!(cond)) {                                                   \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      failures++;                                                    \
+    }                                                                \
+  } while (0)
+
+constexpr uint32_t kTx = 0x7E4;
+constexpr uint32_t kRx = 0x7EC;
+constexpr uint32_t kTimeoutUs = 100000;
+
+class FakeLink : public IsoTpLink {
+public:
+  bool sendFrame(const UdsFrame& frame) override
+  {
+    if (refuse > 0) {
+      refuse--;
+      return false;
+    }
+    sent.push_back(frame);
+    return true;
+  }
+  std::vector<UdsFrame> sent;
+  int refuse = 0;
+};
+
+UdsFrame frame(std::initializer_list<uint8_t> bytes)
+{
+  UdsFrame f;
+  f.id = kRx;
+  for (uint8_t b : bytes) {
+    f.data[f.len++] = b;
+  }
+  return f;
+}
+
+void testStMin()
+{
+  CHECK(isoTpEncodeStMin(0) == 0x00);
+  CHECK(isoTpEncodeStMin(100) == 0xF1);
+  CHECK(isoTpEncodeStMin(101) == 0xF2);
+  CHECK(isoTpEncodeStMin(900) == 0xF9);
+  CHECK(isoTpEncodeStMin(901) == 0x01);
+  CHECK(isoTpEncodeStMin(950) == 0x01);
+  CHECK(isoTpEncodeStMin(999) == 0x01);
+  CHECK(isoTpEncodeStMin(1000) == 0x01);
+  CHECK(isoTpEncodeStMin(1001) == 0x02);
+  CHECK(isoTpEncodeStMin(127000) == 0x7F);
+  CHECK(isoTpEncodeStMin(500000) == 0x7F);
+
+  CHECK(isoTpDecodeStMin(0x05) == 5000);
+  CHECK(isoTpDecodeStMin(0xF1) == 100);
+  CHECK(isoTpDecodeStMin(0xF9) == 900);
+  // reserved values read as the longest separation
+  CHECK(isoTpDecodeStMin(0x80) == 127000);
+  CHECK(isoTpDecodeStMin(0xFA) == 127000);
+  CHECK(isoTpDecodeStMin(0xFF) == 127000);
+
+  // an encoded STmin is never shorter than asked for, and never reserved
+  for (uint32_t us = 0; us <= 127000; us++) {
+    uint8_t code = isoTpEncodeStMin(us);
+    if (isoTpDecodeStMin(code) < us || (code > 0x7F && (code < 0xF1 || code > 0xF9))) {
+      printf("STmin %u us encodes as 0x%02X\n", us, code);
+      failures++;
+      break;
+    }
+  }
+}
+
+void testSingleFrame()
+{
+  FakeLink link;
+  IsoTpSession s;
+  uint8_t response[64];
+  const uint8_t request[] = {0x22, 0x01, 0x01};
+  CHECK(s.start(&link, kTx, false, kRx, false, request, sizeof(request), response, sizeof(response),
+                IsoTpParams(), 0, kTimeoutUs));
+  CHECK(link.sent.size() == 1);
+  CHECK(link.sent[0].id == kTx && link.sent[0].len == 4);
+  CHECK(link.sent[0].data[0] == 0x03 && link.sent[0].data[1] == 0x22 && link.sent[0].data[3] == 0x01);
+  CHECK(s.state() == ISOTP_WAIT_RX);
+  CHECK(s.requestSid() == 0x22);
+
+  // other ids and extended frames with the same id are not ours
+  UdsFrame other = frame({0x02, 0x62, 0x01});
+  other.id = 0x7ED;
+  CHECK(!s.onFrame(other, 10));
+  other.id = kRx;
+  other.extended = true;
+  CHECK(!s.onFrame(other, 10));
+
+  CHECK(s.onFrame(frame({0x04, 0x62, 0x01, 0x01, 0x55}), 20));
+  CHECK(s.state() == ISOTP_DONE);
+  CHECK(s.responseLength() == 4 && response[3] == 0x55);
+}
+
+void testMultiFrameTx()
+{
+  FakeLink link;
+  IsoTpSession s;
+  uint8_t response[64];
+  uint8_t request[30];
+  for (uint8_t i = 0; i < sizeof(request); i++) {
+    request[i] = i;
+  }
+  CHECK(s.start(&link, kTx, false, kRx, false, request, sizeof(request), response, sizeof(response),
+                IsoTpParams(), 0, kTimeoutUs));
+  CHECK(link.sent.size() == 1);
+  CHECK(link.sent[0].data[0] == 0x10 && link.sent[0].data[1] == 30 && link.sent[0].data[7] == 5);
+  CHECK(s.state() == ISOTP_WAIT_FC);
+
+  // BS 2, STmin 5 ms: the first CF goes at once, the second 5 ms later, then wait for FC
+  s.onFrame(frame({0x30, 0x02, 0x05}), 1000);
+  CHECK(link.sent.size() == 2);
+  CHECK(link.sent[1].data[0] == 0x21 && link.sent[1].data[1] == 6);
+  uint32_t waitUs = 0;
+  CHECK(s.txDueWithin(1000, 10000, waitUs) && waitUs == 5000);
+  s.poll(5999);
+  CHECK(link.sent.size() == 2);
+  s.poll(6000);
+  CHECK(link.sent.size() == 3);
+  CHECK(link.sent[2].data[0] == 0x22 && link.sent[2].data[1] == 13);
+  CHECK(s.state() == ISOTP_WAIT_FC);
+
+  // BS 0, STmin 0: the rest back to back; a full TX queue is retried on the next poll
+  link.refuse = 1;
+  s.onFrame(frame({0x30, 0x00, 0x00}), 7000);
+  CHECK(link.sent.size() == 3);
+  s.poll(7001);
+  CHECK(link.sent.size() == 5);
+  CHECK(link.sent[3].data[0] == 0x23 && link.sent[4].data[0] == 0x24);
+  CHECK(link.sent[4].len == 4 && link.sent[4].data[3] == 29);
+  CHECK(s.state() == ISOTP_WAIT_RX);
+}
+
+void testMultiFrameRx()
+{
+  FakeLink link;
+  IsoTpSession s;
+  uint8_t response[64];
+  const uint8_t request[] = {0x22, 0x01, 0x01};
+  IsoTpParams params;
+  params.blockSize = 2;
+  params.stMin = isoTpEncodeStMin(500);
+  s.start(&link, kTx, false, kRx, false, request, sizeof(request), response, sizeof(response), params, 0, kTimeoutUs);
+
+  // 20 bytes: FF with 6, then CFs of 7 and 7; BS 2 asks for a second FC after two CFs
+  s.onFrame(frame({0x10, 20, 0x62, 0x01, 0x01, 3, 4, 5}), 100);
+  CHECK(link.sent.size() == 2);
+  CHECK(link.sent[1].data[0] == 0x30 && link.sent[1].data[1] == 2 && link.sent[1].data[2] == 0xF5);
+  s.onFrame(frame({0x21, 6, 7, 8, 9, 10, 11, 12}), 200);
+  CHECK(s.state() == ISOTP_RECV_CF);
+  s.onFrame(frame({0x22, 13, 14, 15, 16, 17, 18, 19}), 300);
+  CHECK(s.state() == ISOTP_DONE);
+  CHECK(s.responseLength() == 20);
+  bool intact = true;
+  for (uint8_t i = 3; i < 20; i++) {
+    intact &= response[i] == i;
+  }
+  CHECK(intact);
+
+  // 32-bit length escape: 12-bit length 0, real length in bytes 2-5
+  link.sent.clear();
+  s.reset();
+  s.start(&link, kTx, false, kRx, false, request, sizeof(request), response, sizeof(response), IsoTpParams(), 0, kTimeoutUs);
+  s.onFrame(frame({0x10, 0x00, 0x00, 0x00, 0x00, 9, 0x62, 0x01}), 100);
+  CHECK(s.state() == ISOTP_RECV_CF);
+  s.onFrame(frame({0x21, 0x01, 1, 2, 3, 4, 5, 6}), 200);
+  CHECK(s.state() == ISOTP_DONE && s.responseLength() == 9 && response[8] == 6);
+
+  // a sequence gap fails the transfer
+  s.reset();
+  s.start(&link, kTx, false, kRx, false, request, sizeof(request), response, sizeof(response), IsoTpParams(), 0, kTimeoutUs);
+  s.onFrame(frame({0x10, 20, 0x62, 0x01, 0x01, 3, 4, 5}), 100);
+  s.onFrame(frame({0x22, 6, 7, 8, 9, 10, 11, 12}), 200);
+  CHECK(s.state() == ISOTP_FAILED);
+
+  // a response larger than the buffer fails instead of overrunning it
+  s.reset();
+  s.start(&link, kTx, false, kRx, false, request, sizeof(request), response, 16, IsoTpParams(), 0, kTimeoutUs);
+  s.onFrame(frame({0x10, 20, 0x62, 0x01, 0x01, 3, 4, 5}), 100);
+  CHECK(s.state() == ISOTP_FAILED);
+}
+
+void testFlowControlWaitAndOverflow()
+{
+  FakeLink link;
+  IsoTpSession s;
+  uint8_t response[64];
+  uint8_t request[20] = {0x2E};
+  s.start(&link, kTx, false, kRx, false, request, sizeof(request), response, sizeof(response), IsoTpParams(), 0, 1000);
+
+  // FC wait restarts the timeout
+  s.onFrame(frame({0x31, 0x00, 0x00}), 900);
+  s.poll(1500);
+  CHECK(s.state() == ISOTP_WAIT_FC);
+  s.poll(1900);
+  CHECK(s.state() == ISOTP_FAILED);
+
+  // more FC.WAIT frames in a row than maxWaitFrames give up; an FC.CTS in
+  // between starts the count again
+  IsoTpParams params;
+  params.maxWaitFrames = 2;
+  s.reset();
+  s.start(&link, kTx, false, kRx, false, request, sizeof(request), response, sizeof(response), params, 0, 1000);
+  s.onFrame(frame({0x31, 0x00, 0x00}), 100);
+  s.onFrame(frame({0x31, 0x00, 0x00}), 200);
+  CHECK(s.state() == ISOTP_WAIT_FC);
+  s.onFrame(frame({0x30, 0x01, 0x00}), 300);
+  CHECK(s.state() == ISOTP_WAIT_FC);
+  s.onFrame(frame({0x31, 0x00, 0x00}), 400);
+  s.onFrame(frame({0x31, 0x00, 0x00}), 500);
+  CHECK(s.state() == ISOTP_WAIT_FC);
+  s.onFrame(frame({0x31, 0x00, 0x00}), 600);
+  CHECK(s.state() == ISOTP_FAILED);
+
+  // FC overflow aborts at once
+  s.reset();
+  s.start(&link, kTx, false, kRx, false, request, sizeof(request), response, sizeof(response), IsoTpParams(), 0, 1000);
+  s.onFrame(frame({0x32, 0x00, 0x00}), 100);
+  CHECK(s.state() == ISOTP_FAILED);
+
+  // no reply at all
+  s.reset();
+  s.start(&link, kTx, false, kRx, false, request, 3, response, sizeof(response), IsoTpParams(), 0, 1000);
+  s.poll(999);
+  CHECK(s.state() == ISOTP_WAIT_RX);
+  s.poll(1000);
+  CHECK(s.state() == ISOTP_FAILED);
+}
+}
+
+int main()
+{
+  testStMin();
+  testSingleFrame();
+  testMultiFrameTx();
+  testMultiFrameRx();
+  testFlowControlWaitAndOverflow();
+  if (failures) {
+    printf("%d check(s) failed\n", failures);
+    return 1;
+  }
+  printf("isotp: all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+// The few Arduino calls the platform-independent modules make (uds, isotp,
+// signaldecode), for host builds. Serial writes to stdout.
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+#define DEC 10
+#define HEX 16
+
+inline uint32_t micros()
+{
+  static const auto start = std::chrono::steady_clock::now();
+  return static_cast<uint32_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+inline uint32_t millis()
+{
+  return micros() / 1000;
+}
+
+inline void delay(uint32_t ms)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+inline void delayMicroseconds(uint32_t us)
+{
+  std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+class HostSerial {
+public:
+  void print(const char* text) { fputs(text, stdout); }
+  void print(char c) { fputc(c, stdout); }
+  void print(long value, int base = DEC) { printf(base == HEX ? "%lX" : "%ld", value); }
+  void print(unsigned long value, int base = DEC) { printf(base == HEX ? "%lX" : "%lu", value); }
+  void print(int value, int base = DEC) { print(static_cast<long>(value), base); }
+  void print(unsigned int value, int base = DEC) { print(static_cast<unsigned long>(value), base); }
+  void print(double value, int digits = 2) { printf("%.*f", digits, value); }
+  template <typename T>
+  void println(T value)
+  {
+    print(value);
+    println();
+  }
+  template <typename T>
+  void println(T value, int format)
+  {
+    print(value, format);
+    println();
+  }
+  void println() { fputc('\n', stdout); }
+};
+
+inline HostSerial& hostSerial()
+{
+  static HostSerial serial;
+  return serial;
+}
+#define Serial hostSerial()
@@ -0,0 +1,203 @@
+// UdsClient end to end on the host: ReadDataByIdentifier round trips through
+// the receive thread, ISO-TP and response polling, then signal decoding of
+// every reply. By default the ECU is simulated in-process; with --can it is
+// tools/vecu.py on a SocketCAN interface:
+//
+//   vecu.py --tx 7E4 --rx 7EC --did 0101:62 --did 0105:45 vcan0
+//   uds_bench --can vcan0 2000
+#include <Arduino.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include "signaldecode.h"
+#include "uds.h"
+
+namespace {
+constexpr uint32_t kTxId = 0x7E4;
+constexpr uint32_t kRxId = 0x7EC;
+
+struct SimDid {
+  uint16_t did;
+  uint8_t length;
+};
+constexpr SimDid kDids[] = {{0x0101, 62}, {0x0105, 45}};
+
+// Answers like tools/vecu.py: RDBI replies whose data bytes count up with
+// every reply, sent as soon as the tester's flow control allows.
+class SimEcuTransport : public CanTransport {
+public:
+  bool open(const CanTransportConfig&) override { return true; }
+  void close() override {}
+
+  bool send(const UdsFrame& frame) override
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (frame.id != kTxId || frame.extended || frame.len == 0) {
+      return true;
+    }
+    uint8_t type = frame.data[0] >> 4;
+    if (type == 0 && frame.len >= 4 && frame.data[1] == 0x22) {
+      reply((frame.data[2] << 8) | frame.data[3]);
+    } else if (type == 3 && (frame.data[0] & 0x0F) == 0 && m_txOffset < m_tx.size()) {
+      uint8_t blockSize = frame.data[1];
+      for (uint8_t sent = 0; m_txOffset < m_tx.size() && (blockSize == 0 || sent < blockSize); sent++) {
+        UdsFrame cf = response();
+        cf.data[0] = static_cast<uint8_t>(0x20 | (m_txSeq++ & 0x0F));
+        size_t n = m_tx.size() - m_txOffset < 7 ? m_tx.size() - m_txOffset : 7;
+        memcpy(cf.data + 1, m_tx.data() + m_txOffset, n);
+        m_txOffset += n;
+        push(cf);
+      }
+    }
+    return true;
+  }
+
+  bool receive(UdsFrame& frame, uint32_t timeoutMs) override
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (!m_ready.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this] { return !m_rx.empty(); })) {
+      return false;
+    }
+    frame = m_rx.front();
+    m_rx.pop_front();
+    return true;
+  }
+
+  uint32_t readAlerts(uint32_t) override { return 0; }
+  bool status(CanStatus& status) override
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    status.state = CAN_STATE_RUNNING;
+    status.rxPending = static_cast<uint32_t>(m_rx.size());
+    return true;
+  }
+  bool recover() override { return true; }
+  bool restart() override { return true; }
+
+private:
+  UdsFrame response() const
+  {
+    UdsFrame frame;
+    frame.id = kRxId;
+    frame.len = 8;
+    return frame;
+  }
+
+  void push(const UdsFrame& frame)
+  {
+    m_rx.push_back(frame);
+    m_ready.notify_one();
+  }
+
+  void reply(uint16_t did)
+  {
+    m_tx.clear();
+    m_txOffset = 0;
+    for (const SimDid& d : kDids) {
+      if (d.did == did) {
+        m_tx = {0x62, static_cast<uint8_t>(did >> 8), static_cast<uint8_t>(did)};
+        for (uint8_t i = 0; i < d.length; i++) {
+          m_tx.push_back(static_cast<uint8_t>(m_counter + i));
+        }
+        m_counter++;
+      }
+    }
+    if (m_tx.empty()) {
+      m_tx = {0x7F, 0x22, 0x31};
+    }
+    UdsFrame frame = response();
+    if (m_tx.size() <= 7) {
+      frame.data[0] = static_cast<uint8_t>(m_tx.size());
+      memcpy(frame.data + 1, m_tx.data(), m_tx.size());
+      m_txOffset = m_tx.size();
+    } else {
+      frame.data[0] = static_cast<uint8_t>(0x10 | (m_tx.size() >> 8));
+      frame.data[1] = static_cast<uint8_t>(m_tx.size());
+      memcpy(frame.data + 2, m_tx.data(), 6);
+      m_txOffset = 6;
+      m_txSeq = 1;
+    }
+    push(frame);
+  }
+
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+  std::deque<UdsFrame> m_rx;
+  std::vector<uint8_t> m_tx;
+  size_t m_txOffset = 0;
+  uint8_t m_txSeq = 0;
+  uint8_t m_counter = 0;
+};
+}
+
+int main(int argc, char** argv)
+{
+  const char* interface = nullptr;
+  uint32_t rounds = 20000;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--can") == 0 && i + 1 < argc) {
+      interface = argv[++i];
+    } else {
+      rounds = static_cast<uint32_t>(strtoul(argv[i], nullptr, 10));
+    }
+  }
+
+  // the default transport reads CAN_INTERFACE when the client is constructed
+  if (interface) {
+    setenv("CAN_INTERFACE", interface, 1);
+  }
+  UdsClient uds;
+  SimEcuTransport sim;
+  if (!interface) {
+    uds.setTransport(&sim);
+  }
+  uds.addRxId(kRxId, false);
+  if (!uds.begin(500000)) {
+    printf("cannot open %s\n", interface ? interface : "the simulated ECU");
+    return 1;
+  }
+
+  // a few signals per DID, the way obd.cfg would describe them
+  DecodeOp ops[4];
+  compileByteSignal(ops[0], 3, 2, 0, 0, true, false, 0.5f, 0, 0);
+  compileByteSignal(ops[1], 5, 1, 0, 0, true, true, 1, -40, 1);
+  compileByteSignal(ops[2], 6, 2, 3, 10, false, false, 0.1f, 0, 2);
+  compileByteSignal(ops[3], 40, 4, 0, 0, true, false, 0.001f, 0, 3);
+  float values[4];
+
+  uint8_t response[256];
+  uint32_t failures = 0;
+  uint64_t decodeNs = 0;
+  uint32_t decoded = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t r = 0; r < rounds; r++) {
+    uint16_t did = kDids[r % 2].did;
+    uint8_t request[3] = {0x22, static_cast<uint8_t>(did >> 8), static_cast<uint8_t>(did)};
+    int handle = uds.submit(kTxId, false, kRxId, false, request, sizeof(request), response, sizeof(response), 200);
+    if (handle < 0) {
+      failures++;
+      continue;
+    }
+    uint16_t len = 0;
+    UdsStatus status;
+    while ((status = uds.poll(handle, &len)) == UDS_PENDING) {
+      uds.process();
+    }
+    if (status != UDS_COMPLETE || len != 3u + kDids[r % 2].length) {
+      failures++;
+      continue;
+    }
+    auto decodeStart = std::chrono::steady_clock::now();
+    decoded += __builtin_popcount(decodeProgram(ops, 4, response, len, values));
+    decodeNs += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - decodeStart).count();
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  uds.end();
+
+  printf("%u RDBI round trips in %.3f s: %.1f us each, %.0f/s; %u failed\n",
+         rounds, seconds, seconds * 1e6 / rounds, rounds / seconds, failures);
+  printf("decode: %u signals, %.0f ns per reply\n", decoded, rounds ? static_cast<double>(decodeNs) / rounds : 0.0);
+  uds.printStats();
+  return failures ? 1 : 0;
+}
@@ -8,46 +8,118 @@ Functions to link data to ABRP
 #include <SD.h>
 #include <SPIFFS.h>
 #include <time.h>
+#include "nvs.h"
+
+extern nvs_handle_t nvs;
 
 namespace {
 constexpr uint32_t kJsonFlushIntervalMs = 5000;
+constexpr uint32_t kTripDeadlineMs = 60000;
+constexpr uint32_t kTripRetryMs = 10000;
+// polls a field may miss before it counts as stale
+constexpr uint32_t kStalePolls = 3;
+constexpr uint8_t kReadDataByIdentifier = 0x22;
+constexpr uint8_t kReadDataByIdentifierResponse = 0x62;
+// NRCs that reject a multi-DID request itself rather than one of its DIDs
+constexpr uint8_t kNrcIncorrectLength = 0x13;
+constexpr uint8_t kNrcResponseTooLong = 0x14;
+constexpr uint8_t kNrcRequestOutOfRange = 0x31;
+// batching pauses this long after a batch timed out or was refused for another reason
+constexpr uint32_t kBatchRetryMs = 30000;
+// positive multi-DID replies that do not split before batching is given up
+constexpr uint8_t kBatchBadReplyLimit = 3;
+// discovery: one probe at a time, only while nothing else is due
+constexpr uint32_t kScanIntervalMs = 100;
+constexpr uint32_t kScanTimeoutMs = 100;
+// an unanswered probe is retried after a pause that doubles up to this
+constexpr uint32_t kScanMaxBackoffMs = 60000;
+constexpr uint16_t kScanSaveEvery = 32;
+// addressing probe: functional TesterPresent, which every UDS ECU answers in any session
+constexpr uint32_t kProbeTimeoutMs = 100;
+constexpr uint32_t kFunctionalTxId = 0x7DF;
+constexpr uint32_t kFunctionalTxIdExtended = 0x18DB33F1;
+constexpr uint8_t kIsoEcuCount = 8;
+// cached CAN settings are dropped if this many requests fail before any succeeds
+constexpr uint16_t kDetectResetFailures = 50;
+constexpr const char* kNvsBitrate = "canbaud";
+constexpr const char* kNvsAddressing = "canaddr";
+// sealed CAN log blocks written per poll, bounds the time spent on SD writes
+constexpr uint8_t kRecorderBlocksPerPoll = 4;
 
-struct FieldMeta {
-  AbrpField field;
-  const char* name;
-};
+// Holds the field store mutex for a scope. The main loop is the only writer,
+// so it takes the lock to write; other tasks take it to read. It also covers
+// the request groups' ids and quarantine state, which liveJson lists.
+class FieldsLock {
+public:
+  explicit FieldsLock(SemaphoreHandle_t mutex) : m_mutex(mutex) { xSemaphoreTake(m_mutex, portMAX_DELAY); }
+  ~FieldsLock() { xSemaphoreGive(m_mutex); }
+  FieldsLock(const FieldsLock&) = delete;
+  FieldsLock& operator=(const FieldsLock&) = delete;
 
-constexpr FieldMeta kFieldMeta[] = {
-  {ABRP_FIELD_UTC, "utc"},
-  {ABRP_FIELD_SOC, "soc"},
-  {ABRP_FIELD_POWER, "power"},
-  {ABRP_FIELD_SPEED, "speed"},
-  {ABRP_FIELD_LAT, "lat"},
-  {ABRP_FIELD_LON, "lon"},
-  {ABRP_FIELD_IS_CHARGING, "is_charging"},
-  {ABRP_FIELD_IS_DCFC, "is_dcfc"},
-  {ABRP_FIELD_IS_PARKED, "is_parked"},
-  {ABRP_FIELD_CAPACITY, "capacity"},
-  {ABRP_FIELD_KWH_CHARGED, "kwh_charged"},
-  {ABRP_FIELD_SOH, "soh"},
-  {ABRP_FIELD_HEADING, "heading"},
-  {ABRP_FIELD_ELEVATION, "elevation"},
-  {ABRP_FIELD_EXT_TEMP, "ext_temp"},
-  {ABRP_FIELD_BATT_TEMP, "batt_temp"},
-  {ABRP_FIELD_VOLTAGE, "voltage"},
-  {ABRP_FIELD_CURRENT, "current"},
-  {ABRP_FIELD_ODOMETER, "odometer"},
-  {ABRP_FIELD_EST_BATTERY_RANGE, "est_battery_range"},
+private:
+  SemaphoreHandle_t m_mutex;
 };
 
-const char* fieldName(AbrpField field)
+// ISO 15765-4 request ids: 0x7E0+n (11-bit) or 0x18DA(10+n)F1 (29-bit); the
+// ECU answers on 0x7E8+n or 0x18DAF1(10+n). false for ids outside that set.
+bool isoEcuIndex(uint32_t txId, bool extended, uint8_t& n)
 {
-  for (const auto& meta : kFieldMeta) {
-    if (meta.field == field) {
-      return meta.name;
+  if (!extended) {
+    if (txId < 0x7E0 || txId >= 0x7E0 + kIsoEcuCount) {
+      return false;
     }
+    n = static_cast<uint8_t>(txId - 0x7E0);
+    return true;
+  }
+  uint32_t target = (txId >> 8) & 0xFF;
+  if ((txId & 0x1FFF00FF) != 0x18DA00F1 || target < 0x10 || target >= 0x10u + kIsoEcuCount) {
+    return false;
+  }
+  n = static_cast<uint8_t>(target - 0x10);
+  return true;
+}
+
+// index of the ISO 15765-4 ECU that answers on rxId
+bool isoResponseIndex(uint32_t rxId, bool extended, uint8_t& n)
+{
+  if (!extended) {
+    return rxId >= 8 && isoEcuIndex(rxId - 8, false, n);
+  }
+  // 0x18DAF1<ecu> answers requests to 0x18DA<ecu>F1
+  return isoEcuIndex((rxId & 0x1FFF0000) | ((rxId & 0xFF) << 8) | ((rxId >> 8) & 0xFF), true, n);
+}
+
+uint32_t isoRequestId(uint8_t n, bool extended)
+{
+  return extended ? 0x18DA00F1 | ((0x10u + n) << 8) : 0x7E0u + n;
+}
+
+uint32_t isoResponseId(uint8_t n, bool extended)
+{
+  return extended ? 0x18DAF100 | (0x10u + n) : 0x7E8u + n;
+}
+
+// moves one ECU's request/response pair to the other frame format
+bool remapIsoIds(uint8_t n, bool extended, uint32_t& txId, bool& txExtended, uint32_t& rxId, bool& rxExtended)
+{
+  uint8_t index = 0;
+  if (!isoEcuIndex(txId, txExtended, index) || index != n || txExtended == extended) {
+    return false;
   }
-  return "";
+  txId = isoRequestId(n, extended);
+  rxId = isoResponseId(n, extended);
+  txExtended = extended;
+  rxExtended = extended;
+  return true;
+}
+
+// DID of a plain single-DID 0x22 request, -1 for anything else
+int32_t requestDid(const uint8_t* request, uint8_t requestLength)
+{
+  if (requestLength != 3 || request[0] != kReadDataByIdentifier) {
+    return -1;
+  }
+  return (static_cast<int32_t>(request[1]) << 8) | request[2];
 }
 
 bool appendJsonField(char* buffer, size_t bufferSize, size_t& offset, const char* key, float value, bool isInteger)
@@ -78,9 +150,29 @@ bool appendJsonField(char* buffer, size_t bufferSize, size_t& offset, const char
   return true;
 }
 
-bool isBoolField(AbrpField field)
+bool expired(uint32_t nowMs, uint32_t deadlineMs)
+{
+  return static_cast<int32_t>(nowMs - deadlineMs) >= 0;
+}
+
+uint32_t groupDeadline(const AbrpRequestGroup& group)
+{
+  return group.nextDueMs + (group.periodMs ? group.periodMs : kTripDeadlineMs);
+}
+
+// a plain single-DID 0x22 request whose reply length is known
+bool batchable(const AbrpRequestGroup& group)
+{
+  return group.requestLength == 3 && group.request[0] == kReadDataByIdentifier &&
+         group.didLength > 0 && group.failures == 0 && !group.quarantined;
+}
+
+bool sameRequest(const AbrpRequestGroup& group, const AbrpSignalConfig& signal)
 {
-  return field == ABRP_FIELD_IS_CHARGING || field == ABRP_FIELD_IS_DCFC || field == ABRP_FIELD_IS_PARKED;
+  return group.txId == signal.txId && group.txExtended == signal.txExtended &&
+         group.rxId == signal.rxId && group.rxExtended == signal.rxExtended &&
+         group.requestLength == signal.requestLength &&
+         memcmp(group.request, signal.request, signal.requestLength) == 0;
 }
 }
 
@@ -128,15 +220,352 @@ void AbrpJsonLogger::flush()
 void AbrpManager::begin(const AbrpConfig& config)
 {
   m_config = config;
-  m_lastPollMs = 0;
   m_lastLogMs = 0;
-  memset(m_valid, 0, sizeof(m_valid));
-  memset(m_values, 0, sizeof(m_values));
-  m_uds.begin();
+  m_deadlineMisses = 0;
+  m_buffers.init(UDS_RESPONSE_BUFFERS, UDS_RESPONSE_BUFFER_SIZE);
+  for (auto& inflight : m_inflight) {
+    m_buffers.release(inflight.response);
+    inflight.response = nullptr;
+    inflight.handle = -1;
+  }
+  m_buffers.release(m_scanBuffer);
+  m_scanBuffer = nullptr;
+  m_scanHandle = -1;
+  m_scanIndex = 0;
+  loadDiscovery();
+  {
+    FieldsLock lock(m_fieldsLock);
+    m_fields.clear();
+  }
+  m_lastLogSeq = 0;
+  {
+    FieldsLock lock(m_fieldsLock);
+    buildRequestPlan();
+  }
+  compileBroadcasts();
+  setFieldAges();
+  buildDerived();
+  m_anySuccess = false;
+  m_bootFailures = 0;
+  if (m_config.saveCanLog && m_recorder.init(CAN_RECORDER_BLOCKS)) {
+    m_uds.setRecorder(&m_recorder);
+  }
+  uint32_t baud = resolveBitrate();
+  startAddressing();
+  for (size_t g = 0; g < m_groupCount; g++) {
+    m_uds.addRxId(m_groups[g].rxId, m_groups[g].rxExtended);
+  }
+  for (size_t i = 0; i < m_config.scanCount; i++) {
+    m_uds.addRxId(m_config.scans[i].rxId, m_config.scans[i].rxExtended);
+  }
+  // the acceptance filter is set up in begin(), so it must pass both formats while probing
+  if (m_resolving) {
+    m_uds.listenFunctional(false);
+    m_uds.listenFunctional(true);
+  }
+  for (size_t i = 0; i < m_config.broadcastCount; i++) {
+    m_uds.addSniffId(m_config.broadcasts[i].canId, m_config.broadcasts[i].extended);
+  }
+  if (!m_resolving) {
+    configureEcus();
+  }
+  m_uds.begin(baud);
+}
+
+// Cached bitrate from an earlier boot, else a listen-only probe; 500 kbit/s
+// if the bus is silent (car asleep), which is not cached.
+uint32_t AbrpManager::resolveBitrate()
+{
+  uint32_t baud = 0;
+  if (nvs_get_u32(nvs, kNvsBitrate, &baud) == ESP_OK && baud) {
+    return baud;
+  }
+  if (m_groupCount == 0 && m_config.broadcastCount == 0 && !m_recorder.active()) {
+    return 500000;
+  }
+  baud = m_uds.detectBitrate();
+  if (!baud) {
+    Serial.println("[CAN] No traffic, assuming 500kbps");
+    return 500000;
+  }
+  if (nvs_set_u32(nvs, kNvsBitrate, baud) == ESP_OK) {
+    nvs_commit(nvs);
+  }
+  return baud;
+}
+
+void AbrpManager::configureEcus()
+{
+  for (size_t i = 0; i < m_config.ecuCount; i++) {
+    const AbrpEcuConfig& ecu = m_config.ecus[i];
+    IsoTpParams params;
+    params.blockSize = ecu.blockSize;
+    params.stMin = isoTpEncodeStMin(ecu.stMinUs);
+    params.minTxSeparationUs = ecu.txSeparationUs;
+    m_uds.setIsoTpParams(ecu.txId, params);
+    if (ecu.diagSession > 1) {
+      m_uds.setDiagnosticSession(ecu.txId, ecu.txExtended, ecu.rxId, ecu.rxExtended, ecu.diagSession);
+    }
+  }
+}
+
+// Works out per ECU whether it answers on 11-bit or 29-bit ids. Only the
+// ISO 15765-4 ECUs (0x7E0-0x7E7 and their 29-bit pairs) have a defined id in
+// the other format; anything else keeps what obd.cfg says. Formats cached in
+// NVS are applied at once, the rest are probed from pollUds().
+void AbrpManager::startAddressing()
+{
+  m_addressing = AbrpAddressing();
+  m_probes = AbrpAddressing();
+  m_probePhase = 0;
+  m_probing = false;
+  m_heard[0] = m_heard[1] = 0;
+
+  AbrpAddressing cached;
+  size_t len = sizeof(cached);
+  if (nvs_get_blob(nvs, kNvsAddressing, &cached, &len) != ESP_OK || len != sizeof(cached) ||
+      cached.count > ABRP_MAX_ECUS) {
+    cached.count = 0;
+  }
+  for (uint8_t i = 0; i < cached.count; i++) {
+    uint8_t n = 0;
+    if (isoEcuIndex(cached.txIds[i], false, n)) {
+      applyAddressing(n, cached.extended[i]);
+      m_addressing.txIds[m_addressing.count] = cached.txIds[i];
+      m_addressing.extended[m_addressing.count] = cached.extended[i];
+      m_addressing.count++;
+    }
+  }
+
+  for (size_t g = 0; g < m_groupCount + m_config.scanCount; g++) {
+    uint32_t txId = g < m_groupCount ? m_groups[g].txId : m_config.scans[g - m_groupCount].txId;
+    bool extended = g < m_groupCount ? m_groups[g].txExtended : m_config.scans[g - m_groupCount].txExtended;
+    uint8_t n = 0;
+    if (!isoEcuIndex(txId, extended, n)) {
+      continue;
+    }
+    bool known = false;
+    for (uint8_t i = 0; i < m_addressing.count && !known; i++) {
+      known = m_addressing.txIds[i] == isoRequestId(n, false);
+    }
+    for (uint8_t i = 0; i < m_probes.count && !known; i++) {
+      uint8_t probed = 0;
+      known = isoEcuIndex(m_probes.txIds[i], m_probes.extended[i], probed) && probed == n;
+    }
+    if (!known && m_probes.count < ABRP_MAX_ECUS) {
+      m_probes.txIds[m_probes.count] = txId;
+      m_probes.extended[m_probes.count] = extended;
+      m_probes.count++;
+    }
+  }
+  m_resolving = m_probes.count > 0;
+}
+
+// Two functional TesterPresent requests through the bus arbiter, on 11-bit
+// then on 29-bit ids: every ISO 15765-4 ECU that is awake answers on the
+// format it uses. Regular requests and discovery wait until both have run.
+void AbrpManager::runAddressing()
+{
+  if (m_probing) {
+    uint8_t count = 0;
+    if (m_uds.pollFunctional(&count) == UDS_PENDING) {
+      return;
+    }
+    m_probing = false;
+    if (m_bus) {
+      m_bus->release(CAN_CLIENT_UDS);
+    }
+    bool extended = m_probePhase == 1;
+    for (uint8_t r = 0; r < count; r++) {
+      uint8_t n = 0;
+      // a negative response still proves the ECU is listening on this format
+      if (m_probeReplies[r].complete && isoResponseIndex(m_probeReplies[r].rxId, extended, n)) {
+        m_heard[extended ? 1 : 0] |= static_cast<uint8_t>(1u << n);
+      }
+    }
+    m_probePhase++;
+  }
+
+  if (m_probePhase >= 2) {
+    finishAddressing();
+    return;
+  }
+  if (m_bus && !m_bus->request(CAN_CLIENT_UDS, 0)) {
+    return;
+  }
+  for (uint8_t r = 0; r < UDS_MAX_RESPONDERS; r++) {
+    m_probeReplies[r].data = m_probeData[r];
+    m_probeReplies[r].capacity = sizeof(m_probeData[r]);
+  }
+  bool extended = m_probePhase == 1;
+  uint8_t request[2] = {0x3E, 0x00};
+  m_probing = m_uds.submitFunctional(extended ? kFunctionalTxIdExtended : kFunctionalTxId, extended,
+                                     request, sizeof(request), m_probeReplies, UDS_MAX_RESPONDERS, kProbeTimeoutMs);
+  if (!m_probing && m_bus) {
+    m_bus->release(CAN_CLIENT_UDS);
+  }
+}
+
+// An ECU heard on both formats keeps the configured one; one heard on
+// neither keeps it too and is probed again next boot.
+void AbrpManager::finishAddressing()
+{
+  bool answered = false;
+  for (uint8_t i = 0; i < m_probes.count; i++) {
+    uint8_t n = 0;
+    isoEcuIndex(m_probes.txIds[i], m_probes.extended[i], n);
+    bool configured = m_probes.extended[i];
+    bool onConfigured = m_heard[configured ? 1 : 0] & (1u << n);
+    bool onOther = m_heard[configured ? 0 : 1] & (1u << n);
+    if (!onConfigured && !onOther) {
+      continue;
+    }
+    bool extended = onConfigured ? configured : !configured;
+    if (m_addressing.count < ABRP_MAX_ECUS) {
+      m_addressing.txIds[m_addressing.count] = isoRequestId(n, false);
+      m_addressing.extended[m_addressing.count] = extended;
+      m_addressing.count++;
+    }
+    applyAddressing(n, extended);
+    answered = true;
+    Serial.print("[CAN] ECU ");
+    Serial.print(isoRequestId(n, extended), HEX);
+    Serial.println(extended ? " uses 29-bit ids" : " uses 11-bit ids");
+  }
+
+  m_resolving = false;
+  configureEcus();
+  startTrip();
+  // nothing answered (ignition off): keep the configured formats and try again next boot
+  if (answered && nvs_set_blob(nvs, kNvsAddressing, &m_addressing, sizeof(m_addressing)) == ESP_OK) {
+    nvs_commit(nvs);
+  }
+}
+
+void AbrpManager::applyAddressing(uint8_t n, bool extended)
+{
+  {
+    FieldsLock lock(m_fieldsLock);
+    for (size_t g = 0; g < m_groupCount; g++) {
+      AbrpRequestGroup& group = m_groups[g];
+      remapIsoIds(n, extended, group.txId, group.txExtended, group.rxId, group.rxExtended);
+    }
+  }
+  for (size_t i = 0; i < m_config.ecuCount; i++) {
+    AbrpEcuConfig& ecu = m_config.ecus[i];
+    uint32_t oldTxId = ecu.txId;
+    if (!remapIsoIds(n, extended, ecu.txId, ecu.txExtended, ecu.rxId, ecu.rxExtended)) {
+      continue;
+    }
+    for (size_t b = 0; b < m_batchCount; b++) {
+      if (m_batch[b].txId == oldTxId) {
+        m_batch[b].txId = ecu.txId;
+      }
+    }
+  }
+  for (size_t i = 0; i < m_config.scanCount; i++) {
+    AbrpScanConfig& scan = m_config.scans[i];
+    remapIsoIds(n, extended, scan.txId, scan.txExtended, scan.rxId, scan.rxExtended);
+  }
+}
+
+void AbrpManager::startTrip()
+{
+  uint32_t now = millis();
+  for (size_t g = 0; g < m_groupCount; g++) {
+    m_groups[g].tripDone = false;
+    m_groups[g].nextDueMs = now;
+  }
+}
+
+void AbrpManager::buildRequestPlan()
+{
+  uint32_t defaultPeriodMs = static_cast<uint32_t>(m_config.sendIntervalSec) * 1000;
+  if (defaultPeriodMs == 0) {
+    defaultPeriodMs = 1000;
+  }
+
+  m_groupCount = 0;
+  size_t skipped = 0;
+  for (size_t i = 0; i < m_config.signalCount; i++) {
+    const AbrpSignalConfig& signal = m_config.signals[i];
+    if (signal.requestLength == 0 || signal.length == 0) {
+      continue;
+    }
+    uint16_t didLength = 0;
+    if (didUnsupported(signal, didLength)) {
+      skipped++;
+      continue;
+    }
+
+    AbrpRequestGroup* group = nullptr;
+    for (size_t g = 0; g < m_groupCount; g++) {
+      if (sameRequest(m_groups[g], signal)) {
+        group = &m_groups[g];
+        break;
+      }
+    }
+    if (!group) {
+      if (m_groupCount >= ABRP_MAX_REQUESTS) {
+        continue;
+      }
+      group = &m_groups[m_groupCount++];
+      *group = {};
+      group->txId = signal.txId;
+      group->rxId = signal.rxId;
+      group->txExtended = signal.txExtended;
+      group->rxExtended = signal.rxExtended;
+      memcpy(group->request, signal.request, signal.requestLength);
+      group->requestLength = signal.requestLength;
+      group->periodMs = signal.oncePerTrip ? 0 : UINT32_MAX;
+      group->priority = signal.priority;
+      group->didLength = didLength;
+    }
+    group->signals[group->signalCount++] = static_cast<uint8_t>(i);
+
+    if (!signal.oncePerTrip) {
+      uint32_t periodMs = signal.periodMs ? signal.periodMs : defaultPeriodMs;
+      if (group->periodMs == 0 || periodMs < group->periodMs) {
+        group->periodMs = periodMs;
+      }
+    }
+    if (signal.priority > group->priority) {
+      group->priority = signal.priority;
+    }
+  }
+  compileSignals();
+  startTrip();
+
+  m_batchCount = 0;
+  for (size_t i = 0; i < m_config.ecuCount && m_batchCount < ABRP_MAX_ECUS; i++) {
+    const AbrpEcuConfig& ecu = m_config.ecus[i];
+    if (ecu.maxDids < 2) {
+      continue;
+    }
+    AbrpEcuBatch& batch = m_batch[m_batchCount++];
+    batch = {};
+    batch.txId = ecu.txId;
+    batch.maxDids = ecu.maxDids > ABRP_MAX_BATCH_DIDS ? ABRP_MAX_BATCH_DIDS : ecu.maxDids;
+  }
+
+  Serial.print("[ABRP] ");
+  Serial.print(m_config.signalCount);
+  Serial.print(" signals in ");
+  Serial.print(m_groupCount);
+  Serial.print(" requests");
+  if (skipped) {
+    Serial.print(", ");
+    Serial.print(skipped);
+    Serial.print(" not supported by the vehicle");
+  }
+  Serial.println();
 }
 
 void AbrpManager::setStorageReady(uint32_t fileId)
 {
+  if (m_recorder.active()) {
+    m_recorder.open(fileId);
+  }
   if (!m_config.saveJsonLog) {
     return;
   }
@@ -176,157 +605,818 @@ void AbrpManager::updateUtc()
 
 void AbrpManager::pollUds(uint32_t nowMs)
 {
-  if (!m_enabled || m_config.signalCount == 0) {
+  if (!m_enabled) {
     return;
   }
 
-  uint32_t intervalMs = static_cast<uint32_t>(m_config.sendIntervalSec) * 1000;
-  if (intervalMs == 0) {
-    intervalMs = 1000;
+  processBroadcasts();
+  m_recorder.flush(kRecorderBlocksPerPoll);
+  // also rolls the bus statistics, so it runs for broadcast-only configs too
+  if (m_uds.started()) {
+    m_uds.process();
   }
-  if (nowMs - m_lastPollMs < intervalMs) {
-    return;
+  if (m_groupCount > 0 || m_config.scanCount > 0) {
+    if (m_resolving) {
+      runAddressing();
+    } else {
+      collectResponses();
+      scheduleRequests(nowMs);
+      runDiscovery(nowMs);
+    }
   }
-  m_lastPollMs = nowMs;
+  // derived fields follow every source: UDS replies, broadcasts and GPS
+  FieldsLock lock(m_fieldsLock);
+  m_derive.evaluate(m_fields, millis());
+}
 
-  for (size_t i = 0; i < m_config.signalCount; i++) {
-    float value = 0.0f;
-    if (decodeSignal(m_config.signals[i], value)) {
-      setField(m_config.signals[i].field, value);
+bool AbrpManager::collectResponses()
+{
+  bool updated = false;
+  for (auto& slot : m_inflight) {
+    if (slot.handle < 0) {
+      continue;
     }
+    uint16_t responseLen = 0;
+    uint8_t nrc = 0;
+    UdsStatus status = m_uds.poll(slot.handle, &responseLen, &nrc);
+    if (status == UDS_PENDING) {
+      continue;
+    }
+    if (status == UDS_FAILED && (m_uds.busOff() || m_uds.busOffCount() != slot.busOffCount)) {
+      // cut short by a bus-off: not the request's fault, retry as soon as the bus is back
+      for (uint8_t i = 0; i < slot.groupCount; i++) {
+        m_groups[slot.groups[i]].inflight = false;
+        m_groups[slot.groups[i]].nextDueMs = millis();
+      }
+    } else if (slot.groupCount == 1) {
+      completeSingle(m_groups[slot.groups[0]], status, slot.response, responseLen);
+    } else {
+      completeBatch(slot, status, nrc, slot.response, responseLen);
+    }
+    updated = updated || status == UDS_COMPLETE;
+    if (m_bus) {
+      m_bus->release(CAN_CLIENT_UDS);
+    }
+    m_buffers.release(slot.response);
+    slot.response = nullptr;
+    slot.handle = -1;
   }
+  return updated;
+}
 
-  applyDerivedValues();
+void AbrpManager::completeSingle(AbrpRequestGroup& group, UdsStatus status,
+                                 const uint8_t* response, uint16_t responseLen)
+{
+  group.inflight = false;
+  if (status == UDS_COMPLETE) {
+    uint16_t payloadStart = 0;
+    if (responseLen >= 3 && response[0] == kReadDataByIdentifierResponse) {
+      payloadStart = 3;
+      if (group.requestLength == 3 && group.request[0] == kReadDataByIdentifier &&
+          response[1] == group.request[1] && response[2] == group.request[2]) {
+        group.didLength = responseLen - 3;
+      }
+    }
+    decodeGroup(group, response + payloadStart, responseLen - payloadStart);
+    if (group.periodMs == 0) {
+      group.tripDone = true;
+    }
+  }
+  recordResult(group, status == UDS_COMPLETE, millis());
 }
 
-void AbrpManager::logJson(uint32_t nowMs)
+// A multi-DID reply is 0x62 followed by <DID><data> for each requested DID in
+// order; data lengths come from earlier single-DID replies. The whole reply is
+// checked before anything is decoded.
+bool AbrpManager::splitBatch(const AbrpInflight& slot, const uint8_t* response, uint16_t responseLen)
 {
-  if (!m_enabled || !m_config.saveJsonLog || !m_logger.isOpen()) {
+  if (responseLen < 1 || response[0] != kReadDataByIdentifierResponse) {
+    return false;
+  }
+  uint16_t pos = 1;
+  for (uint8_t i = 0; i < slot.groupCount; i++) {
+    const AbrpRequestGroup& group = m_groups[slot.groups[i]];
+    if (pos + 2 + group.didLength > responseLen ||
+        response[pos] != group.request[1] || response[pos + 1] != group.request[2]) {
+      return false;
+    }
+    pos += 2 + group.didLength;
+  }
+  if (pos != responseLen) {
+    return false;
+  }
+
+  pos = 1;
+  for (uint8_t i = 0; i < slot.groupCount; i++) {
+    const AbrpRequestGroup& group = m_groups[slot.groups[i]];
+    decodeGroup(group, response + pos + 2, group.didLength);
+    pos += 2 + group.didLength;
+  }
+  return true;
+}
+
+// A batch that fails for any reason sends its members back to single-DID
+// requests, which carry the failure accounting. Only a negative response to
+// the multi-DID request marks the ECU as not supporting it; after a timeout
+// or any other NRC batching resumes after kBatchRetryMs. A positive reply that
+// does not split means a learned length is wrong, so members relearn theirs.
+void AbrpManager::completeBatch(const AbrpInflight& slot, UdsStatus status, uint8_t nrc,
+                                const uint8_t* response, uint16_t responseLen)
+{
+  uint32_t now = millis();
+  bool ok = status == UDS_COMPLETE && splitBatch(slot, response, responseLen);
+  bool malformed = status == UDS_COMPLETE && !ok;
+  AbrpRequestGroup& first = m_groups[slot.groups[0]];
+  AbrpEcuBatch* batch = batchFor(first.txId);
+  if (batch) {
+    AbrpBatchSupport support = batch->support;
+    if (ok) {
+      support = ABRP_BATCH_SUPPORTED;
+      batch->badReplies = 0;
+    } else if (status == UDS_NEGATIVE && (nrc == kNrcIncorrectLength || nrc == kNrcResponseTooLong ||
+                                          nrc == kNrcRequestOutOfRange)) {
+      support = ABRP_BATCH_UNSUPPORTED;
+    } else if (malformed && ++batch->badReplies >= kBatchBadReplyLimit) {
+      support = ABRP_BATCH_UNSUPPORTED;
+    } else if (!malformed) {
+      batch->retryMs = now + kBatchRetryMs;
+    }
+    if (support != batch->support) {
+      batch->support = support;
+      Serial.print("[ABRP] ECU ");
+      Serial.print(first.txId, HEX);
+      Serial.println(support == ABRP_BATCH_SUPPORTED ? " accepts multi-DID requests" : " rejects multi-DID requests");
+    }
+  }
+
+  for (uint8_t i = 0; i < slot.groupCount; i++) {
+    AbrpRequestGroup& group = m_groups[slot.groups[i]];
+    group.inflight = false;
+    if (ok) {
+      if (group.periodMs == 0) {
+        group.tripDone = true;
+      }
+      recordResult(group, true, now);
+    } else {
+      if (malformed) {
+        group.didLength = 0;
+      }
+      group.tripDone = false;
+      group.nextDueMs = now;
+    }
+  }
+}
+
+AbrpEcuBatch* AbrpManager::batchFor(uint32_t txId)
+{
+  for (size_t i = 0; i < m_batchCount; i++) {
+    if (m_batch[i].txId == txId) {
+      return &m_batch[i];
+    }
+  }
+  return nullptr;
+}
+
+void AbrpManager::recordResult(AbrpRequestGroup& group, bool success, uint32_t nowMs)
+{
+  // liveJson lists quarantined requests from the web server task
+  FieldsLock lock(m_fieldsLock);
+  if (success) {
+    if (group.quarantined) {
+      Serial.print("[ABRP] Request ");
+      Serial.print(group.txId, HEX);
+      Serial.println(" recovered");
+    }
+    group.failures = 0;
+    group.quarantined = false;
+    m_anySuccess = true;
     return;
   }
 
-  if (nowMs - m_lastLogMs < 1000) {
+  if (!m_anySuccess && ++m_bootFailures == kDetectResetFailures) {
+    // wrong bitrate or addressing cached, or a different car: detect again next boot
+    Serial.println("[CAN] No ECU answers, clearing cached bus settings");
+    nvs_erase_key(nvs, kNvsBitrate);
+    nvs_erase_key(nvs, kNvsAddressing);
+    nvs_commit(nvs);
+  }
+
+  if (group.failures < UINT16_MAX) {
+    group.failures++;
+  }
+  if (group.failures >= ABRP_QUARANTINE_FAILURES) {
+    if (!group.quarantined) {
+      Serial.print("[ABRP] Request ");
+      Serial.print(group.txId, HEX);
+      Serial.println(" quarantined");
+    }
+    group.quarantined = true;
+    group.nextDueMs = nowMs + ABRP_REPROBE_INTERVAL;
     return;
   }
-  m_lastLogMs = nowMs;
 
-  char line[512] = {0};
-  size_t offset = 0;
-  line[offset++] = '{';
+  uint32_t basePeriodMs = group.periodMs ? group.periodMs : kTripRetryMs;
+  uint32_t backoffMs = basePeriodMs << group.failures;
+  if (backoffMs > ABRP_MAX_BACKOFF || (backoffMs >> group.failures) != basePeriodMs) {
+    backoffMs = ABRP_MAX_BACKOFF;
+  }
+  group.nextDueMs = nowMs + backoffMs;
+}
 
-  for (uint8_t field = 0; field < ABRP_FIELD_COUNT; field++) {
-    AbrpField f = static_cast<AbrpField>(field);
-    if (!isFieldValid(f)) {
+// Earliest deadline first among groups that are due and whose ECU is idle;
+// priority breaks ties.
+AbrpRequestGroup* AbrpManager::nextDueGroup(uint32_t nowMs)
+{
+  AbrpRequestGroup* best = nullptr;
+  for (size_t g = 0; g < m_groupCount; g++) {
+    AbrpRequestGroup& group = m_groups[g];
+    if (group.inflight || group.tripDone || !expired(nowMs, group.nextDueMs)) {
       continue;
     }
-    const char* name = fieldName(f);
-    if (!name || !*name) {
+    if (m_uds.busy(group.txId, group.rxId)) {
       continue;
     }
-    if (!appendJsonField(line, sizeof(line), offset, name, getField(f), isBoolField(f) || f == ABRP_FIELD_UTC)) {
-      break;
+    if (!best) {
+      best = &group;
+      continue;
+    }
+    int32_t diff = static_cast<int32_t>(groupDeadline(group) - groupDeadline(*best));
+    if (diff < 0 || (diff == 0 && group.priority > best->priority)) {
+      best = &group;
     }
   }
+  return best;
+}
 
-  if (offset < sizeof(line) - 2) {
-    line[offset++] = '}';
-    line[offset] = 0;
-    m_logger.writeLine(line);
+void AbrpManager::scheduleRequests(uint32_t nowMs)
+{
+  if (m_uds.busOff()) {
+    return;
   }
+  for (auto& slot : m_inflight) {
+    if (slot.handle >= 0) {
+      continue;
+    }
+    AbrpRequestGroup* group = nextDueGroup(nowMs);
+    if (!group) {
+      return;
+    }
+    uint8_t* response = m_buffers.acquire();
+    if (!response) {
+      return;
+    }
+    if (m_bus && !m_bus->request(CAN_CLIENT_UDS, group->priority)) {
+      m_buffers.release(response);
+      return;
+    }
 
-  static uint32_t lastFlush = 0;
-  if (nowMs - lastFlush > kJsonFlushIntervalMs) {
-    m_logger.flush();
-    lastFlush = nowMs;
+    slot.groups[0] = static_cast<uint8_t>(group - m_groups);
+    slot.groupCount = 1;
+    addBatchMembers(slot, nowMs);
+
+    const uint8_t* request = group->request;
+    uint8_t requestLength = group->requestLength;
+    uint8_t batchRequest[1 + 2 * ABRP_MAX_BATCH_DIDS];
+    if (slot.groupCount > 1) {
+      batchRequest[0] = kReadDataByIdentifier;
+      requestLength = 1;
+      for (uint8_t i = 0; i < slot.groupCount; i++) {
+        batchRequest[requestLength++] = m_groups[slot.groups[i]].request[1];
+        batchRequest[requestLength++] = m_groups[slot.groups[i]].request[2];
+      }
+      request = batchRequest;
+    }
+    for (uint8_t i = 0; i < slot.groupCount; i++) {
+      advanceSchedule(m_groups[slot.groups[i]], nowMs);
+    }
+
+    slot.handle = m_uds.submit(group->txId, group->txExtended,
+                               group->rxId, group->rxExtended,
+                               request, requestLength,
+                               response, m_buffers.bufferSize());
+    if (slot.handle >= 0) {
+      slot.response = response;
+      slot.busOffCount = m_uds.busOffCount();
+      for (uint8_t i = 0; i < slot.groupCount; i++) {
+        m_groups[slot.groups[i]].inflight = true;
+      }
+    } else {
+      m_buffers.release(response);
+      if (m_bus) {
+        m_bus->release(CAN_CLIENT_UDS);
+      }
+    }
   }
 }
 
-void AbrpManager::applyDerivedValues()
+void AbrpManager::advanceSchedule(AbrpRequestGroup& group, uint32_t nowMs)
 {
-  if (!isFieldValid(ABRP_FIELD_POWER) && isFieldValid(ABRP_FIELD_VOLTAGE) && isFieldValid(ABRP_FIELD_CURRENT)) {
-    float power = getField(ABRP_FIELD_VOLTAGE) * getField(ABRP_FIELD_CURRENT) / 1000.0f;
-    setField(ABRP_FIELD_POWER, power);
+  if (group.periodMs == 0) {
+    group.nextDueMs = nowMs + kTripRetryMs;
+    return;
   }
+  if (!group.failures && expired(nowMs, group.nextDueMs) && nowMs - group.nextDueMs >= group.periodMs) {
+    group.misses++;
+    m_deadlineMisses++;
+  }
+  group.nextDueMs += group.periodMs;
+  if (expired(nowMs, group.nextDueMs)) {
+    group.nextDueMs = nowMs + group.periodMs;
+  }
+}
 
-  if (!isFieldValid(ABRP_FIELD_IS_CHARGING) && isFieldValid(ABRP_FIELD_POWER)) {
-    setField(ABRP_FIELD_IS_CHARGING, getField(ABRP_FIELD_POWER) < 0.0f ? 1.0f : 0.0f);
+// Adds other DIDs on the same ECU that are due, or due within half their
+// period, to the request in slot, up to the ECU's configured maximum.
+void AbrpManager::addBatchMembers(AbrpInflight& slot, uint32_t nowMs)
+{
+  const AbrpRequestGroup& lead = m_groups[slot.groups[0]];
+  AbrpEcuBatch* batch = batchFor(lead.txId);
+  if (!batch || batch->support == ABRP_BATCH_UNSUPPORTED || !expired(nowMs, batch->retryMs) || !batchable(lead)) {
+    return;
   }
 
-  if (!isFieldValid(ABRP_FIELD_IS_DCFC) && isFieldValid(ABRP_FIELD_POWER)) {
-    float power = getField(ABRP_FIELD_POWER);
-    setField(ABRP_FIELD_IS_DCFC, power < -20.0f ? 1.0f : 0.0f);
+  uint32_t replyLength = 1 + 2 + lead.didLength;
+  for (size_t g = 0; g < m_groupCount && slot.groupCount < batch->maxDids; g++) {
+    const AbrpRequestGroup& group = m_groups[g];
+    if (&group == &lead || group.inflight || group.tripDone || !batchable(group) ||
+        group.txId != lead.txId || group.rxId != lead.rxId || group.rxExtended != lead.rxExtended) {
+      continue;
+    }
+    if (!expired(nowMs + group.periodMs / 2, group.nextDueMs)) {
+      continue;
+    }
+    if (replyLength + 2 + group.didLength > m_buffers.bufferSize()) {
+      continue;
+    }
+    replyLength += 2 + group.didLength;
+    slot.groups[slot.groupCount++] = static_cast<uint8_t>(g);
   }
+}
 
-  if (!isFieldValid(ABRP_FIELD_IS_PARKED) && isFieldValid(ABRP_FIELD_SPEED)) {
-    float speed = getField(ABRP_FIELD_SPEED);
-    setField(ABRP_FIELD_IS_PARKED, speed < 1.0f ? 1.0f : 0.0f);
+// Restores scan progress per ECU; a stored map whose range no longer matches
+// obd.cfg starts over.
+void AbrpManager::loadDiscovery()
+{
+  for (size_t i = 0; i < m_config.scanCount; i++) {
+    const AbrpScanConfig& scan = m_config.scans[i];
+    AbrpDiscovery& discovery = m_discovery[i];
+    char key[16];
+    snprintf(key, sizeof(key), "scan%lX", static_cast<unsigned long>(scan.txId));
+    size_t len = sizeof(discovery);
+    if (nvs_get_blob(nvs, key, &discovery, &len) != ESP_OK || len != sizeof(discovery) ||
+        discovery.txId != scan.txId || discovery.firstDid != scan.firstDid ||
+        discovery.lastDid != scan.lastDid || discovery.count > ABRP_MAX_DISCOVERED_DIDS) {
+      discovery = {};
+      discovery.txId = scan.txId;
+      discovery.firstDid = scan.firstDid;
+      discovery.lastDid = scan.lastDid;
+      discovery.nextDid = scan.firstDid;
+    }
   }
 }
 
-bool AbrpManager::decodeSignal(const AbrpSignalConfig& signal, float& outValue)
+void AbrpManager::saveDiscovery(const AbrpDiscovery& discovery)
 {
-  if (signal.requestLength == 0 || signal.length == 0) {
-    return false;
+  char key[16];
+  snprintf(key, sizeof(key), "scan%lX", static_cast<unsigned long>(discovery.txId));
+  if (nvs_set_blob(nvs, key, &discovery, sizeof(discovery)) == ESP_OK) {
+    nvs_commit(nvs);
   }
+}
 
-  uint8_t response[64] = {0};
-  uint16_t responseLen = sizeof(response);
-  if (!m_uds.request(signal.txId, signal.txExtended,
-                     signal.rxId, signal.rxExtended,
-                     signal.request, signal.requestLength,
-                     response, &responseLen)) {
+// A signal is unsupported if its DID has been scanned and was refused.
+bool AbrpManager::didUnsupported(const AbrpSignalConfig& signal, uint16_t& didLength) const
+{
+  int32_t did = requestDid(signal.request, signal.requestLength);
+  if (did < 0) {
     return false;
   }
+  for (size_t i = 0; i < m_config.scanCount; i++) {
+    const AbrpDiscovery& discovery = m_discovery[i];
+    if (discovery.txId != signal.txId || did < discovery.firstDid || static_cast<uint32_t>(did) >= discovery.nextDid) {
+      continue;
+    }
+    for (uint16_t d = 0; d < discovery.count; d++) {
+      if (discovery.dids[d].did == did) {
+        didLength = discovery.dids[d].length;
+        return false;
+      }
+    }
+    // the list may have filled up before the scan reached this DID
+    return discovery.count < ABRP_MAX_DISCOVERED_DIDS;
+  }
+  return false;
+}
 
-  uint16_t payloadStart = 0;
-  if (responseLen >= 3 && response[0] == 0x62) {
-    payloadStart = 3;
+bool AbrpManager::parkedOrCharging() const
+{
+  if (isFieldValid(ABRP_FIELD_IS_CHARGING) && getField(ABRP_FIELD_IS_CHARGING) > 0.5f) {
+    return true;
   }
+  return isFieldValid(ABRP_FIELD_SPEED) && getField(ABRP_FIELD_SPEED) < 1.0f;
+}
 
-  uint16_t start = payloadStart + signal.startByte;
-  if (start + signal.length > responseLen) {
-    return false;
+// Walks the configured DID ranges one request at a time while the car is
+// parked or charging and no regular request is due. Parked also covers the
+// ignition being off, so an ECU that does not answer is asked again later
+// rather than taken as not supporting the DID.
+void AbrpManager::runDiscovery(uint32_t nowMs)
+{
+  if (m_scanHandle >= 0) {
+    uint16_t responseLen = 0;
+    uint8_t nrc = 0;
+    UdsStatus status = m_uds.poll(m_scanHandle, &responseLen, &nrc);
+    if (status == UDS_PENDING) {
+      return;
+    }
+    finishScanRequest(status, nrc, responseLen);
+    if (m_bus) {
+      m_bus->release(CAN_CLIENT_UDS);
+    }
   }
 
-  uint32_t raw = 0;
-  for (uint8_t i = 0; i < signal.length; i++) {
-    raw = (raw << 8) | response[start + i];
+  while (m_scanIndex < m_config.scanCount &&
+         m_discovery[m_scanIndex].nextDid > m_discovery[m_scanIndex].lastDid) {
+    m_scanIndex++;
+  }
+  if (m_scanIndex >= m_config.scanCount || !expired(nowMs, m_nextScanMs) || !parkedOrCharging()) {
+    return;
+  }
+  const AbrpScanConfig& scan = m_config.scans[m_scanIndex];
+  if (nextDueGroup(nowMs) || m_uds.busy(scan.txId, scan.rxId)) {
+    return;
+  }
+  m_scanBuffer = m_buffers.acquire();
+  if (!m_scanBuffer) {
+    return;
+  }
+  if (m_bus && !m_bus->request(CAN_CLIENT_UDS, 0)) {
+    m_buffers.release(m_scanBuffer);
+    m_scanBuffer = nullptr;
+    return;
   }
 
-  if (signal.bit >= 0 && signal.bit < 32) {
-    raw = (raw >> signal.bit) & 0x1;
+  uint16_t did = static_cast<uint16_t>(m_discovery[m_scanIndex].nextDid);
+  uint8_t request[3] = {kReadDataByIdentifier, static_cast<uint8_t>(did >> 8), static_cast<uint8_t>(did & 0xFF)};
+  m_nextScanMs = nowMs + kScanIntervalMs;
+  m_scanHandle = m_uds.submit(scan.txId, scan.txExtended, scan.rxId, scan.rxExtended,
+                              request, sizeof(request), m_scanBuffer, m_buffers.bufferSize(), kScanTimeoutMs);
+  if (m_scanHandle < 0) {
+    m_buffers.release(m_scanBuffer);
+    m_scanBuffer = nullptr;
+    if (m_bus) {
+      m_bus->release(CAN_CLIENT_UDS);
+    }
   }
+}
 
-  outValue = static_cast<float>(raw) * signal.scale + signal.offset;
-  return true;
+void AbrpManager::finishScanRequest(UdsStatus status, uint8_t nrc, uint16_t responseLen)
+{
+  AbrpDiscovery& discovery = m_discovery[m_scanIndex];
+  uint16_t did = static_cast<uint16_t>(discovery.nextDid);
+  bool positive = status == UDS_COMPLETE && responseLen >= 3 && m_scanBuffer[0] == kReadDataByIdentifierResponse &&
+                  m_scanBuffer[1] == (did >> 8) && m_scanBuffer[2] == (did & 0xFF);
+  m_buffers.release(m_scanBuffer);
+  m_scanBuffer = nullptr;
+  m_scanHandle = -1;
+
+  if (status == UDS_FAILED || (status == UDS_COMPLETE && !positive)) {
+    // asleep, busy or a stray reply: ask for the same DID again later
+    m_scanBackoffMs = m_scanBackoffMs ? m_scanBackoffMs * 2 : kScanIntervalMs * 2;
+    if (m_scanBackoffMs > kScanMaxBackoffMs) {
+      m_scanBackoffMs = kScanMaxBackoffMs;
+    }
+    m_nextScanMs = millis() + m_scanBackoffMs;
+    return;
+  }
+  m_scanBackoffMs = 0;
+  // any NRC other than requestOutOfRange means the DID exists but cannot be
+  // read right now; listed without a length so the signal keeps it
+  if ((positive || nrc != kNrcRequestOutOfRange) && discovery.count < ABRP_MAX_DISCOVERED_DIDS) {
+    discovery.dids[discovery.count].did = did;
+    discovery.dids[discovery.count].length = positive ? responseLen - 3 : 0;
+    discovery.count++;
+  }
+
+  // a full list cannot tell refused DIDs apart any more
+  if (discovery.count >= ABRP_MAX_DISCOVERED_DIDS) {
+    discovery.nextDid = static_cast<uint32_t>(discovery.lastDid) + 1;
+  } else {
+    discovery.nextDid++;
+  }
+  bool finished = discovery.nextDid > discovery.lastDid;
+  if (finished || (discovery.nextDid - discovery.firstDid) % kScanSaveEvery == 0) {
+    saveDiscovery(discovery);
+  }
+  if (finished) {
+    Serial.print("[ABRP] DID scan on ");
+    Serial.print(discovery.txId, HEX);
+    Serial.print(" done, ");
+    Serial.print(discovery.count);
+    Serial.println(" DIDs answered");
+  }
 }
 
-void AbrpManager::setField(AbrpField field, float value)
+void AbrpManager::printStats()
 {
-  if (field >= ABRP_FIELD_COUNT) {
+  m_uds.printStats();
+  m_recorder.printStats();
+  if (m_bus) {
+    m_bus->printStats();
+  }
+  if (m_deadlineMisses == 0) {
     return;
   }
-  m_values[field] = value;
-  m_valid[field] = true;
+  const AbrpRequestGroup* worst = nullptr;
+  for (size_t g = 0; g < m_groupCount; g++) {
+    if (!worst || m_groups[g].misses > worst->misses) {
+      worst = &m_groups[g];
+    }
+  }
+  Serial.print("[ABRP] Deadline misses:");
+  Serial.print(m_deadlineMisses);
+  if (worst && worst->misses) {
+    Serial.print(" worst:");
+    Serial.print(worst->txId, HEX);
+    Serial.print('/');
+    for (uint8_t i = 0; i < worst->requestLength; i++) {
+      if (worst->request[i] < 0x10) Serial.print('0');
+      Serial.print(worst->request[i], HEX);
+    }
+    Serial.print(" x");
+    Serial.print(worst->misses);
+  }
+  Serial.println();
 }
 
-bool AbrpManager::isFieldValid(AbrpField field) const
+int AbrpManager::liveJson(char* buffer, int bufferSize, uint32_t sinceSeq) const
 {
-  if (field >= ABRP_FIELD_COUNT) {
-    return false;
+  // called from the web server task while the main loop updates fields
+  FieldsLock lock(m_fieldsLock);
+  int n = snprintf(buffer, bufferSize, "\"abrp\":{\"seq\":%u", (unsigned int)m_fields.sequence());
+  for (uint8_t field = 0; field < m_config.fields.count() && n < bufferSize; field++) {
+    if (!isFieldValid(field) || !m_fields.changedSince(field, sinceSeq)) {
+      continue;
+    }
+    const char* name = m_config.fields.name(field);
+    if (m_config.fields.isInteger(field)) {
+      n += snprintf(buffer + n, bufferSize - n, ",\"%s\":%d", name, static_cast<int>(getField(field)));
+    } else {
+      n += snprintf(buffer + n, bufferSize - n, ",\"%s\":%.3f", name, getField(field));
+    }
+  }
+  if (n < bufferSize) {
+    n += snprintf(buffer + n, bufferSize - n, ",\"quarantined\":[");
+  }
+  bool first = true;
+  for (size_t g = 0; g < m_groupCount && n < bufferSize; g++) {
+    const AbrpRequestGroup& group = m_groups[g];
+    if (!group.quarantined) {
+      continue;
+    }
+    n += snprintf(buffer + n, bufferSize - n, "%s{\"ecu\":\"%X\",\"req\":\"", first ? "" : ",", (unsigned int)group.txId);
+    for (uint8_t i = 0; i < group.requestLength && n < bufferSize; i++) {
+      n += snprintf(buffer + n, bufferSize - n, "%02X", group.request[i]);
+    }
+    if (n < bufferSize) {
+      n += snprintf(buffer + n, bufferSize - n, "\",\"failures\":%u}", group.failures);
+    }
+    first = false;
+  }
+  if (n < bufferSize) {
+    n += snprintf(buffer + n, bufferSize - n, "]}");
+  }
+  return n < bufferSize ? n : bufferSize - 1;
+}
+
+// Lays the signals of each request group out as one contiguous decode program.
+void AbrpManager::compileSignals()
+{
+  m_opCount = 0;
+  for (size_t g = 0; g < m_groupCount; g++) {
+    AbrpRequestGroup& group = m_groups[g];
+    group.opStart = m_opCount;
+    for (uint8_t i = 0; i < group.signalCount; i++) {
+      const AbrpSignalConfig& signal = m_config.signals[group.signals[i]];
+      uint8_t bit = signal.bit >= 0 ? static_cast<uint8_t>(signal.bit) : 0;
+      uint8_t width = signal.bit >= 0 ? (signal.bitWidth ? signal.bitWidth : 1) : 0;
+      if (!compileByteSignal(m_ops[m_opCount], signal.startByte, signal.length, bit, width,
+                             !signal.littleEndian, signal.isSigned, signal.scale, signal.offset, signal.field)) {
+        Serial.print("[ABRP] Bad layout for ");
+        Serial.println(signal.name);
+        continue;
+      }
+      m_opCount++;
+    }
+    group.opCount = static_cast<uint8_t>(m_opCount - group.opStart);
+  }
+}
+
+void AbrpManager::compileBroadcasts()
+{
+  m_frameCount = 0;
+  uint8_t opCount = 0;
+  // group by CAN id so each frame runs one program
+  for (size_t i = 0; i < m_config.broadcastCount; i++) {
+    const AbrpBroadcastConfig& first = m_config.broadcasts[i];
+    bool seen = false;
+    for (uint8_t f = 0; f < m_frameCount && !seen; f++) {
+      seen = m_frames[f].canId == first.canId && m_frames[f].extended == first.extended;
+    }
+    if (seen) {
+      continue;
+    }
+    AbrpFrameProgram& frame = m_frames[m_frameCount++];
+    frame = {};
+    frame.canId = first.canId;
+    frame.extended = first.extended;
+    frame.opStart = opCount;
+    for (size_t j = i; j < m_config.broadcastCount; j++) {
+      const AbrpBroadcastConfig& signal = m_config.broadcasts[j];
+      if (signal.canId != first.canId || signal.extended != first.extended) {
+        continue;
+      }
+      if (!compileDbcSignal(m_broadcastOps[opCount], signal.startBit, signal.bitLength, signal.bigEndian,
+                            signal.isSigned, signal.scale, signal.offset, signal.field)) {
+        Serial.print("[ABRP] Bad layout for ");
+        Serial.println(signal.name);
+        continue;
+      }
+      opCount++;
+    }
+    frame.opCount = static_cast<uint8_t>(opCount - frame.opStart);
+  }
+}
+
+void AbrpManager::applyProgram(const DecodeOp* ops, uint8_t count, const uint8_t* data, uint16_t len)
+{
+  float values[ABRP_MAX_SIGNALS];
+  uint32_t decoded = decodeProgram(ops, count, data, len, values);
+  for (uint8_t i = 0; i < count; i++) {
+    if (decoded & (1UL << i)) {
+      setField(ops[i].target, values[i]);
+    }
   }
-  return m_valid[field];
 }
 
-float AbrpManager::getField(AbrpField field) const
+void AbrpManager::processBroadcasts()
 {
-  if (field >= ABRP_FIELD_COUNT) {
-    return 0.0f;
+  if (m_frameCount == 0) {
+    return;
+  }
+
+  UdsFrame frame;
+  while (m_uds.readSniffed(frame)) {
+    for (uint8_t i = 0; i < m_frameCount; i++) {
+      const AbrpFrameProgram& program = m_frames[i];
+      if (program.canId == frame.id && program.extended == frame.extended) {
+        applyProgram(m_broadcastOps + program.opStart, program.opCount, frame.data, frame.len);
+        break;
+      }
+    }
   }
-  return m_values[field];
 }
 
-const char* AbrpManager::fieldName(AbrpField field) const
+// payload is the response data after the service id and DID echo
+void AbrpManager::decodeGroup(const AbrpRequestGroup& group, const uint8_t* payload, uint16_t payloadLen)
+{
+  applyProgram(m_ops + group.opStart, group.opCount, payload, payloadLen);
+}
+
+uint32_t AbrpManager::fieldSequence() const
+{
+  FieldsLock lock(m_fieldsLock);
+  return m_fields.sequence();
+}
+
+int AbrpManager::tlmJson(char* buffer, int bufferSize, uint32_t nowMs, uint32_t* sequence) const
+{
+  // called from the upload task while the main loop updates fields
+  FieldsLock lock(m_fieldsLock);
+  if (sequence) {
+    *sequence = m_fields.sequence();
+  }
+  // ABRP rejects a record without these two
+  if (bufferSize < 3 || !m_fields.valid(ABRP_FIELD_UTC, nowMs) || !m_fields.valid(ABRP_FIELD_SOC, nowMs)) {
+    return 0;
+  }
+  size_t size = static_cast<size_t>(bufferSize);
+  size_t offset = 0;
+  buffer[offset++] = '{';
+  // custom fields are not part of the tlm schema and stay local
+  for (uint8_t field = 0; field < ABRP_FIELD_COUNT; field++) {
+    if (!m_fields.valid(field, nowMs)) {
+      continue;
+    }
+    if (!appendJsonField(buffer, size, offset, m_config.fields.name(field), m_fields.value(field),
+                         m_config.fields.isInteger(field))) {
+      return 0;
+    }
+  }
+  if (offset + 2 > size) {
+    return 0;
+  }
+  buffer[offset++] = '}';
+  buffer[offset] = 0;
+  return static_cast<int>(offset);
+}
+
+void AbrpManager::logJson(uint32_t nowMs)
+{
+  if (!m_enabled || !m_config.saveJsonLog || !m_logger.isOpen()) {
+    return;
+  }
+
+  if (nowMs - m_lastLogMs < 1000) {
+    return;
+  }
+  m_lastLogMs = nowMs;
+  // nothing changed since the last line
+  if (m_fields.sequence() == m_lastLogSeq) {
+    return;
+  }
+  m_lastLogSeq = m_fields.sequence();
+
+  char line[768] = {0};
+  size_t offset = 0;
+  line[offset++] = '{';
+
+  for (uint8_t field = 0; field < m_config.fields.count(); field++) {
+    if (!isFieldValid(field)) {
+      continue;
+    }
+    if (!appendJsonField(line, sizeof(line), offset, m_config.fields.name(field), getField(field),
+                         m_config.fields.isInteger(field))) {
+      break;
+    }
+  }
+
+  if (offset < sizeof(line) - 2) {
+    line[offset++] = '}';
+    line[offset] = 0;
+    m_logger.writeLine(line);
+  }
+
+  static uint32_t lastFlush = 0;
+  if (nowMs - lastFlush > kJsonFlushIntervalMs) {
+    m_logger.flush();
+    lastFlush = nowMs;
+  }
+}
+
+void AbrpManager::buildDerived()
+{
+  bool measured[ABRP_MAX_FIELDS] = {false};
+  for (size_t i = 0; i < m_config.signalCount; i++) {
+    measured[m_config.signals[i].field] = true;
+  }
+  for (size_t i = 0; i < m_config.broadcastCount; i++) {
+    measured[m_config.broadcasts[i].field] = true;
+  }
+  for (AbrpField field : {ABRP_FIELD_UTC, ABRP_FIELD_LAT, ABRP_FIELD_LON, ABRP_FIELD_SPEED,
+                          ABRP_FIELD_HEADING, ABRP_FIELD_ELEVATION}) {
+    measured[field] = true;
+  }
+  uint8_t dropped = m_derive.build(m_config.derived, static_cast<uint8_t>(m_config.derivedCount), measured);
+  if (dropped) {
+    Serial.print("[ABRP] Derived fields with circular inputs ignored: ");
+    Serial.println(dropped);
+  }
+}
+
+// A polled field goes stale after missing a few polls in a row, never sooner
+// than ABRP_FIELD_MAX_AGE; once-per-trip fields stay valid for the whole trip.
+void AbrpManager::setFieldAges()
+{
+  FieldsLock lock(m_fieldsLock);
+  for (uint8_t field = 0; field < m_config.fields.count(); field++) {
+    m_fields.setMaxAge(field, ABRP_FIELD_MAX_AGE);
+  }
+  for (size_t g = 0; g < m_groupCount; g++) {
+    const AbrpRequestGroup& group = m_groups[g];
+    for (uint8_t i = 0; i < group.signalCount; i++) {
+      const AbrpSignalConfig& signal = m_config.signals[group.signals[i]];
+      if (signal.oncePerTrip) {
+        m_fields.setMaxAge(signal.field, 0);
+      } else if (group.periodMs * kStalePolls > ABRP_FIELD_MAX_AGE) {
+        m_fields.setMaxAge(signal.field, group.periodMs * kStalePolls);
+      }
+    }
+  }
+}
+
+void AbrpManager::setField(uint8_t field, float value)
+{
+  FieldsLock lock(m_fieldsLock);
+  m_fields.set(field, value, millis());
+}
+
+bool AbrpManager::isFieldValid(uint8_t field) const
+{
+  return m_fields.valid(field, millis());
+}
+
+float AbrpManager::getField(uint8_t field) const
 {
-  return ::fieldName(field);
+  return m_fields.value(field);
 }
@@ -4,36 +4,24 @@
 #include <FS.h>
 #include <FreematicsPlus.h>
 #include "uds.h"
+#include "canbus.h"
+#include "canrecorder.h"
+#include "signaldecode.h"
+#include "fieldstore.h"
+#include "derive.h"
+#include "fieldregistry.h"
+#include "tlmsource.h"
 
 constexpr size_t ABRP_MAX_SIGNALS = 32;
 constexpr size_t ABRP_MAX_REQUEST_BYTES = 24;
-
-enum AbrpField : uint8_t {
-  ABRP_FIELD_UTC = 0,
-  ABRP_FIELD_SOC,
-  ABRP_FIELD_POWER,
-  ABRP_FIELD_SPEED,
-  ABRP_FIELD_LAT,
-  ABRP_FIELD_LON,
-  ABRP_FIELD_IS_CHARGING,
-  ABRP_FIELD_IS_DCFC,
-  ABRP_FIELD_IS_PARKED,
-  ABRP_FIELD_CAPACITY,
-  ABRP_FIELD_KWH_CHARGED,
-  ABRP_FIELD_SOH,
-  ABRP_FIELD_HEADING,
-  ABRP_FIELD_ELEVATION,
-  ABRP_FIELD_EXT_TEMP,
-  ABRP_FIELD_BATT_TEMP,
-  ABRP_FIELD_VOLTAGE,
-  ABRP_FIELD_CURRENT,
-  ABRP_FIELD_ODOMETER,
-  ABRP_FIELD_EST_BATTERY_RANGE,
-  ABRP_FIELD_COUNT
-};
+constexpr size_t ABRP_MAX_REQUESTS = ABRP_MAX_SIGNALS;
+constexpr size_t ABRP_MAX_BROADCASTS = 16;
+constexpr size_t ABRP_MAX_ECUS = 8;
+constexpr uint8_t ABRP_MAX_BATCH_DIDS = 8;
+constexpr size_t ABRP_MAX_DISCOVERED_DIDS = 64;
 
 struct AbrpSignalConfig {
-  AbrpField field = ABRP_FIELD_COUNT;
+  uint8_t field = ABRP_NO_FIELD;  // AbrpField or a custom field
   char name[24] = {0};
   char unit[8] = {0};
   uint32_t txId = 0;
@@ -43,18 +31,171 @@ struct AbrpSignalConfig {
   uint8_t request[ABRP_MAX_REQUEST_BYTES] = {0};
   uint8_t requestLength = 0;
   uint8_t startByte = 0;
-  uint8_t length = 0;
-  int8_t bit = -1;
+  uint8_t length = 0;          // bytes forming the raw integer, at most 8
+  int8_t bit = -1;             // LSB of the field inside the raw integer, -1 = whole integer
+  uint8_t bitWidth = 0;        // field width when bit is set, 0 = a single bit
+  bool littleEndian = false;
+  bool isSigned = false;
+  float scale = 1.0f;
+  float offset = 0.0f;
+  uint32_t periodMs = 0;       // 0 = ABRP-send-data-interval
+  bool oncePerTrip = false;
+  uint8_t priority = 0;        // higher wins when deadlines tie
+};
+
+// Per-ECU transport settings from OBD-ECU-<name> lines.
+struct AbrpEcuConfig {
+  char name[16] = {0};
+  uint32_t txId = 0;
+  uint32_t rxId = 0;
+  bool txExtended = false;
+  bool rxExtended = false;
+  uint8_t blockSize = 0;          // BS we advertise when the ECU sends to us
+  uint32_t stMinUs = 0;           // STmin we advertise when the ECU sends to us
+  uint32_t txSeparationUs = 0;    // minimum gap between our consecutive frames
+  uint8_t diagSession = 0;        // DiagnosticSessionControl type to hold open, 0 = default session
+  uint8_t maxDids = 1;            // DIDs per ReadDataByIdentifier request, 1 = no batching
+};
+
+// DID range to probe on one ECU from an OBD-SCAN line.
+struct AbrpScanConfig {
+  uint32_t txId = 0;
+  uint32_t rxId = 0;
+  bool txExtended = false;
+  bool rxExtended = false;
+  uint16_t firstDid = 0;
+  uint16_t lastDid = 0;
+};
+
+struct AbrpDidInfo {
+  uint16_t did = 0;
+  uint16_t length = 0;   // data bytes after the DID echo
+};
+
+// Scan progress and the DIDs that answered, stored as one NVS blob per ECU.
+// DIDs in [firstDid, nextDid) that are not listed were refused with
+// requestOutOfRange; nextDid only moves on once the ECU has answered.
+struct AbrpDiscovery {
+  uint32_t txId = 0;
+  uint16_t firstDid = 0;
+  uint16_t lastDid = 0;
+  uint32_t nextDid = 0;
+  uint16_t count = 0;
+  AbrpDidInfo dids[ABRP_MAX_DISCOVERED_DIDS];
+};
+
+// Frame format each ISO 15765-4 ECU answered on, keyed by its 11-bit request
+// id (0x7E0-0x7E7) and cached in NVS together with the bitrate. ECUs that
+// stayed silent are not listed.
+struct AbrpAddressing {
+  uint8_t count = 0;
+  uint32_t txIds[ABRP_MAX_ECUS] = {0};
+  bool extended[ABRP_MAX_ECUS] = {false};
+};
+
+// A field decoded passively from a frame the vehicle broadcasts on its own.
+// Bit numbering follows DBC: bit n is bit n%8 (LSB = 0) of byte n/8; startBit is
+// the LSB for little-endian signals and the MSB for big-endian ones.
+struct AbrpBroadcastConfig {
+  uint8_t field = ABRP_NO_FIELD;  // AbrpField or a custom field
+  char name[24] = {0};
+  char unit[8] = {0};
+  uint32_t canId = 0;
+  bool extended = false;
+  uint8_t startBit = 0;
+  uint8_t bitLength = 0;
+  bool bigEndian = false;
+  bool isSigned = false;
   float scale = 1.0f;
   float offset = 0.0f;
 };
 
+// One unique UDS request per poll cycle, shared by every signal decoded from its response.
+struct AbrpRequestGroup {
+  uint32_t txId = 0;
+  uint32_t rxId = 0;
+  bool txExtended = false;
+  bool rxExtended = false;
+  uint8_t request[ABRP_MAX_REQUEST_BYTES] = {0};
+  uint8_t requestLength = 0;
+  uint8_t signalCount = 0;
+  uint8_t signals[ABRP_MAX_SIGNALS] = {0};
+
+  // scheduling: fastest period and highest priority of the member signals
+  uint32_t periodMs = 0;       // 0 = once per trip
+  uint8_t priority = 0;
+  uint32_t nextDueMs = 0;
+  uint32_t misses = 0;
+  bool inflight = false;
+  bool tripDone = false;
+
+  // failure tracking: exponential backoff, then quarantine with periodic re-probe
+  uint16_t failures = 0;
+  bool quarantined = false;
+
+  // data bytes after the DID echo, learned from single-DID 0x22 replies;
+  // only groups with a known length can be batched
+  uint16_t didLength = 0;
+
+  // compiled decode program of the member signals: m_ops[opStart, opStart + opCount)
+  uint8_t opStart = 0;
+  uint8_t opCount = 0;
+};
+
+// Broadcast signals sharing a CAN id, decoded together from each frame:
+// m_broadcastOps[opStart, opStart + opCount).
+struct AbrpFrameProgram {
+  uint32_t canId = 0;
+  bool extended = false;
+  uint8_t opStart = 0;
+  uint8_t opCount = 0;
+};
+
+enum AbrpBatchSupport : uint8_t {
+  ABRP_BATCH_UNKNOWN = 0,
+  ABRP_BATCH_SUPPORTED,
+  ABRP_BATCH_UNSUPPORTED
+};
+
+// Whether an ECU accepts several DIDs in one ReadDataByIdentifier request;
+// probed with the first batch sent to it. Only a negative response settles it
+// as unsupported; a timeout pauses batching until retryMs.
+struct AbrpEcuBatch {
+  uint32_t txId = 0;
+  uint8_t maxDids = 1;
+  AbrpBatchSupport support = ABRP_BATCH_UNKNOWN;
+  uint8_t badReplies = 0;  // positive replies that could not be split
+  uint32_t retryMs = 0;
+};
+
+// Request groups currently in flight on one UdsClient session; more than one
+// when their DIDs were combined into a single 0x22 request.
+struct AbrpInflight {
+  int handle = -1;
+  uint8_t groups[ABRP_MAX_BATCH_DIDS] = {0};
+  uint8_t groupCount = 0;
+  uint8_t* response = nullptr;  // borrowed from the response buffer pool
+  uint32_t busOffCount = 0;     // UdsClient::busOffCount() at submit
+};
+
 struct AbrpConfig {
   bool saveJsonLog = true;
+  bool saveCanLog = false;
   uint16_t sendIntervalSec = 1;
   char userToken[96] = {0};
+  char apiKey[48] = {0};
+  char serverUrl[96] = {0};    // empty = ABRP_SERVER_URL
   size_t signalCount = 0;
   AbrpSignalConfig signals[ABRP_MAX_SIGNALS];
+  size_t broadcastCount = 0;
+  AbrpBroadcastConfig broadcasts[ABRP_MAX_BROADCASTS];
+  size_t ecuCount = 0;
+  AbrpEcuConfig ecus[ABRP_MAX_ECUS];
+  size_t scanCount = 0;
+  AbrpScanConfig scans[ABRP_MAX_ECUS];
+  size_t derivedCount = 0;
+  DeriveFormula derived[DERIVE_MAX_RULES];
+  FieldRegistry fields;
 };
 
 class AbrpJsonLogger {
@@ -69,31 +210,112 @@ private:
   File m_file;
 };
 
-class AbrpManager {
+class AbrpManager : public TlmSource {
 public:
   void begin(const AbrpConfig& config);
   void setStorageReady(uint32_t fileId);
   void updateGps(const GPS_DATA* gps);
   void updateUtc();
   void pollUds(uint32_t nowMs);
+  void startTrip();
   void logJson(uint32_t nowMs);
   void setEnabled(bool enabled) { m_enabled = enabled; }
+  // UDS requests are only started once the arbiter grants the bus
+  void setBusArbiter(CanBusArbiter* bus) { m_bus = bus; }
+  bool needsService() const
+  {
+    return m_groupCount > 0 || m_config.broadcastCount > 0 || m_config.scanCount > 0 || m_recorder.active();
+  }
+  void printStats();
+  // fresh fields changed after sinceSeq (0 = all), plus the current sequence;
+  // safe to call from other tasks
+  int liveJson(char* buffer, int bufferSize, uint32_t sinceSeq = 0) const;
+  // ABRP tlm object of the fresh built-in fields; 0 until utc and soc are known.
+  // *sequence gets the field store sequence the record was built from. Safe to
+  // call from other tasks.
+  int tlmJson(char* buffer, int bufferSize, uint32_t nowMs, uint32_t* sequence = nullptr) const override;
+  // sequence of the latest field change; safe to call from other tasks
+  uint32_t fieldSequence() const override;
+  UdsClient& uds() { return m_uds; }
 
 private:
-  void applyDerivedValues();
-  bool decodeSignal(const AbrpSignalConfig& signal, float& outValue);
-  void setField(AbrpField field, float value);
-  bool isFieldValid(AbrpField field) const;
-  float getField(AbrpField field) const;
-  const char* fieldName(AbrpField field) const;
+  void buildRequestPlan();
+  void setFieldAges();
+  void compileSignals();
+  void compileBroadcasts();
+  void applyProgram(const DecodeOp* ops, uint8_t count, const uint8_t* data, uint16_t len);
+  bool collectResponses();
+  void scheduleRequests(uint32_t nowMs);
+  AbrpRequestGroup* nextDueGroup(uint32_t nowMs);
+  void advanceSchedule(AbrpRequestGroup& group, uint32_t nowMs);
+  void addBatchMembers(AbrpInflight& slot, uint32_t nowMs);
+  bool splitBatch(const AbrpInflight& slot, const uint8_t* response, uint16_t responseLen);
+  void completeSingle(AbrpRequestGroup& group, UdsStatus status, const uint8_t* response, uint16_t responseLen);
+  void completeBatch(const AbrpInflight& slot, UdsStatus status, uint8_t nrc,
+                     const uint8_t* response, uint16_t responseLen);
+  AbrpEcuBatch* batchFor(uint32_t txId);
+  void recordResult(AbrpRequestGroup& group, bool success, uint32_t nowMs);
+  uint32_t resolveBitrate();
+  void configureEcus();
+  void startAddressing();
+  void runAddressing();
+  void finishAddressing();
+  void applyAddressing(uint8_t n, bool extended);
+  void loadDiscovery();
+  void saveDiscovery(const AbrpDiscovery& discovery);
+  void runDiscovery(uint32_t nowMs);
+  void finishScanRequest(UdsStatus status, uint8_t nrc, uint16_t responseLen);
+  bool didUnsupported(const AbrpSignalConfig& signal, uint16_t& didLength) const;
+  bool parkedOrCharging() const;
+  void processBroadcasts();
+  void decodeGroup(const AbrpRequestGroup& group, const uint8_t* payload, uint16_t payloadLen);
+  void buildDerived();
+  void setField(uint8_t field, float value);
+  bool isFieldValid(uint8_t field) const;
+  float getField(uint8_t field) const;
 
   bool m_enabled = true;
   AbrpConfig m_config = {};
+  AbrpRequestGroup m_groups[ABRP_MAX_REQUESTS];
+  size_t m_groupCount = 0;
+  DecodeOp m_ops[ABRP_MAX_SIGNALS];
+  uint8_t m_opCount = 0;
+  DecodeOp m_broadcastOps[ABRP_MAX_BROADCASTS];
+  AbrpFrameProgram m_frames[ABRP_MAX_BROADCASTS];
+  uint8_t m_frameCount = 0;
+  AbrpEcuBatch m_batch[ABRP_MAX_ECUS];
+  size_t m_batchCount = 0;
+  uint32_t m_deadlineMisses = 0;
+  AbrpDiscovery m_discovery[ABRP_MAX_ECUS];
+  uint8_t m_scanIndex = 0;
+  int m_scanHandle = -1;
+  uint8_t* m_scanBuffer = nullptr;
+  uint32_t m_nextScanMs = 0;
+  uint32_t m_scanBackoffMs = 0;
+  AbrpAddressing m_addressing;
+  AbrpAddressing m_probes;  // configured ids of the ECUs the probes look for
+  uint8_t m_probePhase = 0;    // 0: 11-bit functional request, 1: 29-bit, 2: done
+  bool m_probing = false;
+  uint8_t m_heard[2] = {0, 0};  // bit n: ISO ECU n answered on 11-bit / 29-bit ids
+  UdsResponse m_probeReplies[UDS_MAX_RESPONDERS];
+  uint8_t m_probeData[UDS_MAX_RESPONDERS][8];
+  bool m_resolving = false;
+  bool m_anySuccess = false;
+  uint16_t m_bootFailures = 0;
+  AbrpInflight m_inflight[UDS_MAX_SESSIONS];
+  UdsBufferPool m_buffers;
   UdsClient m_uds;
+  CanBusArbiter* m_bus = nullptr;
   AbrpJsonLogger m_logger;
-  uint32_t m_lastPollMs = 0;
+  CanRecorder m_recorder;
   uint32_t m_lastLogMs = 0;
 
-  bool m_valid[ABRP_FIELD_COUNT] = {false};
-  float m_values[ABRP_FIELD_COUNT] = {0.0f};
+  // m_fields, and the ids and quarantine state of m_groups, are written by
+  // the main loop and read by the web server and upload tasks; writes and
+  // those reads hold m_fieldsLock
+  StaticSemaphore_t m_fieldsLockBuffer;
+  SemaphoreHandle_t m_fieldsLock = xSemaphoreCreateMutexStatic(&m_fieldsLockBuffer);
+  FieldStore<ABRP_MAX_FIELDS> m_fields;
+  DeriveEngine<ABRP_MAX_FIELDS> m_derive;
+  uint32_t m_lastLogSeq = 0;
 };
@@ -12,6 +12,19 @@ namespace {
 constexpr const char* kConfigPaths[] = {"/config/config.cfg", "/config.cfg"};
 constexpr const char* kObdPaths[] = {"/config/obd.cfg", "/obd.cfg"};
 
+struct DefaultDerived {
+  const char* field;
+  const char* formula;
+};
+
+// used when obd.cfg has no OBD-DERIVE lines
+constexpr DefaultDerived kDefaultDerived[] = {
+  {"power", "voltage * current / 1000"},
+  {"is_charging", "power < 0"},
+  {"is_dcfc", "power < -20"},
+  {"is_parked", "speed < 1"},
+};
+
 bool openConfigFile(const char* const paths[], size_t pathCount, File& file)
 {
 #if STORAGE == STORAGE_SPIFFS
@@ -44,6 +57,18 @@ void trim(String& value)
   value.trim();
 }
 
+// drops a trailing ";comment" (a ';' at line start or after whitespace)
+void stripComment(String& line)
+{
+  for (int i = 0; i < line.length(); i++) {
+    if (line[i] == ';' && (i == 0 || line[i - 1] == ' ' || line[i - 1] == '\t')) {
+      line.remove(i);
+      break;
+    }
+  }
+  line.trim();
+}
+
 bool parseBool(const String& value)
 {
   return value.equalsIgnoreCase("on") || value.equalsIgnoreCase("true") || value.equalsIgnoreCase("1");
@@ -92,47 +117,9 @@ uint8_t parseHexBytes(const String& hexString, uint8_t* out, size_t outSize)
   return count;
 }
 
-AbrpField fieldFromName(const String& name)
-{
-  if (name == "utc") return ABRP_FIELD_UTC;
-  if (name == "soc") return ABRP_FIELD_SOC;
-  if (name == "power") return ABRP_FIELD_POWER;
-  if (name == "speed") return ABRP_FIELD_SPEED;
-  if (name == "lat") return ABRP_FIELD_LAT;
-  if (name == "lon") return ABRP_FIELD_LON;
-  if (name == "is_charging") return ABRP_FIELD_IS_CHARGING;
-  if (name == "is_dcfc") return ABRP_FIELD_IS_DCFC;
-  if (name == "is_parked") return ABRP_FIELD_IS_PARKED;
-  if (name == "capacity") return ABRP_FIELD_CAPACITY;
-  if (name == "kwh_charged") return ABRP_FIELD_KWH_CHARGED;
-  if (name == "soh") return ABRP_FIELD_SOH;
-  if (name == "heading") return ABRP_FIELD_HEADING;
-  if (name == "elevation") return ABRP_FIELD_ELEVATION;
-  if (name == "ext_temp") return ABRP_FIELD_EXT_TEMP;
-  if (name == "batt_temp") return ABRP_FIELD_BATT_TEMP;
-  if (name == "voltage") return ABRP_FIELD_VOLTAGE;
-  if (name == "current") return ABRP_FIELD_CURRENT;
-  if (name == "odometer") return ABRP_FIELD_ODOMETER;
-  if (name == "est_battery_range") return ABRP_FIELD_EST_BATTERY_RANGE;
-  return ABRP_FIELD_COUNT;
-}
-
-void parseAbrpSignal(const String& key, const String& value, AbrpConfig& config)
+// value of an OBD-ABRP-<field> or OBD-OPT-<name> line; the caller resolves the field
+bool parseAbrpSignal(const String& name, const String& value, AbrpSignalConfig& signal)
 {
-  if (config.signalCount >= ABRP_MAX_SIGNALS) {
-    return;
-  }
-
-  String name = key.substring(String("OBD-ABRP-").length());
-  name.trim();
-
-  AbrpField field = fieldFromName(name);
-  if (field == ABRP_FIELD_COUNT) {
-    return;
-  }
-
-  AbrpSignalConfig signal = {};
-  signal.field = field;
   name.toCharArray(signal.name, sizeof(signal.name));
 
   int start = 0;
@@ -172,7 +159,9 @@ void parseAbrpSignal(const String& key, const String& value, AbrpConfig& config)
           length = token.toInt();
           break;
         case 7:
-          bit = token.toInt();
+          if (token.length()) {
+            bit = token.toInt();
+          }
           break;
         case 8:
           scale = token.toFloat();
@@ -180,6 +169,25 @@ void parseAbrpSignal(const String& key, const String& value, AbrpConfig& config)
         case 9:
           offset = token.toFloat();
           break;
+        case 10:
+          if (token.equalsIgnoreCase("trip")) {
+            signal.oncePerTrip = true;
+          } else if (token.length()) {
+            signal.periodMs = static_cast<uint32_t>(token.toFloat() * 1000);
+          }
+          break;
+        case 11:
+          signal.priority = static_cast<uint8_t>(constrain(token.toInt(), 0, 255));
+          break;
+        case 12:
+          signal.bitWidth = static_cast<uint8_t>(constrain(token.toInt(), 0, 64));
+          break;
+        case 13:
+          signal.littleEndian = token.equalsIgnoreCase("LE") || token.equalsIgnoreCase("intel");
+          break;
+        case 14:
+          signal.isSigned = token.equalsIgnoreCase("s") || token.equalsIgnoreCase("signed");
+          break;
         default:
           break;
       }
@@ -196,6 +204,9 @@ void parseAbrpSignal(const String& key, const String& value, AbrpConfig& config)
     }
   }
 
+  if (length > 8 || bit > 63) {
+    return false;
+  }
   if (start > 0) {
     signal.startByte = static_cast<uint8_t>(start - 1);
   }
@@ -204,20 +215,229 @@ void parseAbrpSignal(const String& key, const String& value, AbrpConfig& config)
   signal.scale = scale == 0.0f ? 1.0f : scale;
   signal.offset = offset;
 
-  if (signal.requestLength == 0 || signal.txId == 0 || signal.rxId == 0) {
+  return signal.requestLength > 0 && signal.txId != 0 && signal.rxId != 0;
+}
+
+// OBD-ABRP lines set a built-in field, OBD-OPT lines register a custom one
+void addSignal(const String& name, const String& value, bool custom, AbrpConfig& config)
+{
+  if (config.signalCount >= ABRP_MAX_SIGNALS) {
+    return;
+  }
+  AbrpSignalConfig signal = {};
+  if (!parseAbrpSignal(name, value, signal)) {
+    return;
+  }
+  signal.field = custom ? config.fields.add(name.c_str()) : config.fields.find(name.c_str());
+  if (signal.field == ABRP_NO_FIELD) {
+    Serial.print("[CFG] Unknown or invalid field ");
+    Serial.println(name);
     return;
   }
-
   config.signals[config.signalCount++] = signal;
 }
 
+void parseBroadcastSignal(const String& key, const String& value, AbrpConfig& config)
+{
+  if (config.broadcastCount >= ABRP_MAX_BROADCASTS) {
+    return;
+  }
+
+  String name = key.substring(String("OBD-BCAST-").length());
+  name.trim();
+
+  uint8_t field = config.fields.find(name.c_str());
+  if (field == ABRP_NO_FIELD) {
+    return;
+  }
+
+  AbrpBroadcastConfig signal = {};
+  signal.field = field;
+  name.toCharArray(signal.name, sizeof(signal.name));
+
+  int startBit = 0;
+  int bitLength = 0;
+  float scale = 1.0f;
+
+  int tokenIndex = 0;
+  int last = 0;
+  String token;
+  for (int i = 0; i <= value.length(); i++) {
+    if (i == value.length() || value[i] == ',') {
+      token = value.substring(last, i);
+      trim(token);
+      switch (tokenIndex) {
+        case 0:
+          token.toCharArray(signal.unit, sizeof(signal.unit));
+          break;
+        case 1:
+          parseCanId(token, signal.canId, signal.extended);
+          break;
+        case 2:
+          startBit = token.toInt();
+          break;
+        case 3:
+          bitLength = token.toInt();
+          break;
+        case 4:
+          signal.bigEndian = token.equalsIgnoreCase("BE") || token.equalsIgnoreCase("motorola");
+          break;
+        case 5:
+          signal.isSigned = token.equalsIgnoreCase("s") || token.equalsIgnoreCase("signed");
+          break;
+        case 6:
+          scale = token.toFloat();
+          break;
+        case 7:
+          signal.offset = token.toFloat();
+          break;
+        default:
+          break;
+      }
+      tokenIndex++;
+      last = i + 1;
+    }
+  }
+
+  if (signal.canId == 0 || startBit < 0 || startBit > 63 || bitLength <= 0 || bitLength > 64) {
+    return;
+  }
+  signal.startBit = static_cast<uint8_t>(startBit);
+  signal.bitLength = static_cast<uint8_t>(bitLength);
+  signal.scale = scale == 0.0f ? 1.0f : scale;
+
+  config.broadcasts[config.broadcastCount++] = signal;
+}
+
+void parseEcu(const String& key, const String& value, AbrpConfig& config)
+{
+  if (config.ecuCount >= ABRP_MAX_ECUS) {
+    return;
+  }
+
+  AbrpEcuConfig ecu = {};
+  String name = key.substring(String("OBD-ECU-").length());
+  name.trim();
+  name.toCharArray(ecu.name, sizeof(ecu.name));
+
+  int tokenIndex = 0;
+  int last = 0;
+  String token;
+  for (int i = 0; i <= value.length(); i++) {
+    if (i == value.length() || value[i] == ',') {
+      token = value.substring(last, i);
+      trim(token);
+      switch (tokenIndex) {
+        case 0:
+          parseCanId(token, ecu.txId, ecu.txExtended);
+          break;
+        case 1:
+          parseCanId(token, ecu.rxId, ecu.rxExtended);
+          break;
+        case 2:
+          ecu.blockSize = static_cast<uint8_t>(constrain(token.toInt(), 0, 255));
+          break;
+        case 3:
+          ecu.stMinUs = static_cast<uint32_t>(constrain(token.toInt(), 0, 127000));
+          break;
+        case 4:
+          ecu.txSeparationUs = static_cast<uint32_t>(constrain(token.toInt(), 0, 127000));
+          break;
+        case 5:
+          ecu.diagSession = static_cast<uint8_t>(strtoul(token.c_str(), nullptr, 16));
+          break;
+        case 6:
+          ecu.maxDids = static_cast<uint8_t>(constrain(token.toInt(), 1, ABRP_MAX_BATCH_DIDS));
+          break;
+        default:
+          break;
+      }
+      tokenIndex++;
+      last = i + 1;
+    }
+  }
+
+  if (ecu.txId == 0 || ecu.rxId == 0) {
+    return;
+  }
+  config.ecus[config.ecuCount++] = ecu;
+}
+
+bool lookupField(void* context, const char* name, uint8_t& field)
+{
+  field = static_cast<FieldRegistry*>(context)->find(name);
+  return field != ABRP_NO_FIELD;
+}
+
+// OBD-DERIVE-<field>=<formula>; a new name becomes a custom field
+bool addDerived(const String& name, const char* formula, AbrpConfig& config)
+{
+  if (config.derivedCount >= DERIVE_MAX_RULES) {
+    return false;
+  }
+  uint8_t target = config.fields.add(name.c_str());
+  if (target == ABRP_NO_FIELD) {
+    return false;
+  }
+  DeriveFormula& derived = config.derived[config.derivedCount];
+  derived.target = target;
+  if (!compileFormula(formula, lookupField, &config.fields, derived)) {
+    Serial.print("[CFG] Bad formula for ");
+    Serial.println(name);
+    return false;
+  }
+  config.derivedCount++;
+  return true;
+}
+
+void parseScan(const String& value, AbrpConfig& config)
+{
+  if (config.scanCount >= ABRP_MAX_ECUS) {
+    return;
+  }
+
+  AbrpScanConfig scan = {};
+  int tokenIndex = 0;
+  int last = 0;
+  String token;
+  for (int i = 0; i <= value.length(); i++) {
+    if (i == value.length() || value[i] == ',') {
+      token = value.substring(last, i);
+      trim(token);
+      switch (tokenIndex) {
+        case 0:
+          parseCanId(token, scan.txId, scan.txExtended);
+          break;
+        case 1:
+          parseCanId(token, scan.rxId, scan.rxExtended);
+          break;
+        case 2:
+          scan.firstDid = static_cast<uint16_t>(strtoul(token.c_str(), nullptr, 16));
+          break;
+        case 3:
+          scan.lastDid = static_cast<uint16_t>(strtoul(token.c_str(), nullptr, 16));
+          break;
+        default:
+          break;
+      }
+      tokenIndex++;
+      last = i + 1;
+    }
+  }
+
+  if (scan.txId == 0 || scan.rxId == 0 || scan.lastDid < scan.firstDid) {
+    return;
+  }
+  config.scans[config.scanCount++] = scan;
+}
+
 void parseConfigFile(File& file, AbrpConfig& config)
 {
   String section;
   while (file.available()) {
     String line = file.readStringUntil('\n');
-    line.trim();
-    if (line.isEmpty() || line.startsWith(";") || line.startsWith("#")) {
+    stripComment(line);
+    if (line.isEmpty() || line.startsWith("#")) {
       continue;
     }
     if (line.startsWith("[")) {
@@ -240,11 +460,17 @@ void parseConfigFile(File& file, AbrpConfig& config)
 
     if (section.equalsIgnoreCase("common") && key.equalsIgnoreCase("save-json-log")) {
       config.saveJsonLog = parseBool(value);
+    } else if (section.equalsIgnoreCase("common") && key.equalsIgnoreCase("save-can-log")) {
+      config.saveCanLog = parseBool(value);
     } else if (section.equalsIgnoreCase("ABRP")) {
       if (key.equalsIgnoreCase("ABRP-user-token")) {
         value.toCharArray(config.userToken, sizeof(config.userToken));
       } else if (key.equalsIgnoreCase("ABRP-send-data-interval")) {
         config.sendIntervalSec = static_cast<uint16_t>(value.toInt());
+      } else if (key.equalsIgnoreCase("ABRP-api-key")) {
+        value.toCharArray(config.apiKey, sizeof(config.apiKey));
+      } else if (key.equalsIgnoreCase("ABRP-server")) {
+        value.toCharArray(config.serverUrl, sizeof(config.serverUrl));
       }
     }
   }
@@ -253,10 +479,13 @@ void parseConfigFile(File& file, AbrpConfig& config)
 void parseObdFile(File& file, AbrpConfig& config)
 {
   String section;
+  String derivedNames[DERIVE_MAX_RULES];
+  String derivedFormulas[DERIVE_MAX_RULES];
+  uint8_t derivedLines = 0;
   while (file.available()) {
     String line = file.readStringUntil('\n');
-    line.trim();
-    if (line.isEmpty() || line.startsWith(";") || line.startsWith("#")) {
+    stripComment(line);
+    if (line.isEmpty() || line.startsWith("#")) {
       continue;
     }
     if (line.startsWith("[")) {
@@ -268,7 +497,8 @@ void parseObdFile(File& file, AbrpConfig& config)
       continue;
     }
 
-    if (!section.equalsIgnoreCase("ABRP")) {
+    bool optional = section.equalsIgnoreCase("OPTIONAL");
+    if (!optional && !section.equalsIgnoreCase("ABRP")) {
       continue;
     }
 
@@ -281,10 +511,36 @@ void parseObdFile(File& file, AbrpConfig& config)
     key.trim();
     value.trim();
 
-    if (key.startsWith("OBD-ABRP-")) {
-      parseAbrpSignal(key, value, config);
+    if (optional) {
+      if (key.startsWith("OBD-OPT-")) {
+        String name = key.substring(String("OBD-OPT-").length());
+        name.trim();
+        name.toLowerCase();
+        addSignal(name, value, true, config);
+      }
+    } else if (key.startsWith("OBD-ABRP-")) {
+      String name = key.substring(String("OBD-ABRP-").length());
+      name.trim();
+      addSignal(name, value, false, config);
+    } else if (key.startsWith("OBD-BCAST-")) {
+      parseBroadcastSignal(key, value, config);
+    } else if (key.startsWith("OBD-ECU-")) {
+      parseEcu(key, value, config);
+    } else if (key.startsWith("OBD-SCAN")) {
+      parseScan(value, config);
+    } else if (key.startsWith("OBD-DERIVE-") && derivedLines < DERIVE_MAX_RULES) {
+      // compiled once the whole file is read, so formulas can use [OPTIONAL] fields
+      derivedNames[derivedLines] = key.substring(String("OBD-DERIVE-").length());
+      derivedFormulas[derivedLines++] = value;
     }
   }
+
+  for (uint8_t i = 0; i < derivedLines; i++) {
+    // same normalization as OBD-OPT names, so both spellings reach one field
+    derivedNames[i].trim();
+    derivedNames[i].toLowerCase();
+    addDerived(derivedNames[i], derivedFormulas[i].c_str(), config);
+  }
 }
 } // namespace
 
@@ -305,5 +561,11 @@ bool loadAbrpConfig(AbrpConfig& config)
     file.close();
   }
 
+  if (config.derivedCount == 0) {
+    for (const auto& rule : kDefaultDerived) {
+      addDerived(rule.field, rule.formula, config);
+    }
+  }
+
   return true;
 }
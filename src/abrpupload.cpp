@@ -0,0 +1,376 @@
+#include "abrpupload.h"
+#include "uploadconfig.h"
+#include <Arduino.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+namespace {
+constexpr uint8_t kMaxBackoffShift = 6;
+
+bool parseServerUrl(const char* url, AbrpServer& server)
+{
+  const char* p = url;
+  if (strncmp(p, "https://", 8) == 0) {
+    server.tls = true;
+    server.port = 443;
+    p += 8;
+  } else if (strncmp(p, "http://", 7) == 0) {
+    server.tls = false;
+    server.port = 80;
+    p += 7;
+  } else {
+    return false;
+  }
+  size_t hostLen = strcspn(p, ":/");
+  if (hostLen == 0 || hostLen >= sizeof(server.host)) {
+    return false;
+  }
+  memcpy(server.host, p, hostLen);
+  server.host[hostLen] = 0;
+  p += hostLen;
+  if (*p == ':') {
+    char* end = nullptr;
+    unsigned long port = strtoul(p + 1, &end, 10);
+    if (port == 0 || port > 65535) {
+      return false;
+    }
+    server.port = static_cast<uint16_t>(port);
+    p = end;
+  }
+  if (*p == 0) {
+    p = "/";
+  }
+  if (*p != '/' || strlen(p) >= sizeof(server.path)) {
+    return false;
+  }
+  strcpy(server.path, p);
+  return true;
+}
+
+// application/x-www-form-urlencoded value; -1 if it does not fit
+int urlEncode(const char* in, char* out, size_t size)
+{
+  static const char kHex[] = "0123456789ABCDEF";
+  size_t n = 0;
+  for (; *in; in++) {
+    unsigned char c = static_cast<unsigned char>(*in);
+    if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+      if (n + 1 >= size) {
+        return -1;
+      }
+      out[n++] = static_cast<char>(c);
+    } else {
+      if (n + 3 >= size) {
+        return -1;
+      }
+      out[n++] = '%';
+      out[n++] = kHex[c >> 4];
+      out[n++] = kHex[c & 0x0F];
+    }
+  }
+  out[n] = 0;
+  return static_cast<int>(n);
+}
+
+bool headerIs(const char* line, const char* name)
+{
+  return strncasecmp(line, name, strlen(name)) == 0;
+}
+
+bool containsIgnoreCase(const char* text, const char* word)
+{
+  size_t len = strlen(word);
+  for (; *text; text++) {
+    if (strncasecmp(text, word, len) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+}
+
+bool AbrpUploader::begin(const char* serverUrl, const char* userToken, const char* apiKey, uint16_t sendIntervalSec)
+{
+  m_enabled = false;
+  m_stats = AbrpUploadStats();
+  m_sentAny = false;
+  m_failures = 0;
+  m_intervalMs = (sendIntervalSec ? sendIntervalSec : 1) * 1000UL;
+  if (!userToken[0]) {
+    return false;
+  }
+  m_server = AbrpServer();
+  if (!parseServerUrl(serverUrl[0] ? serverUrl : ABRP_SERVER_URL, m_server)) {
+    Serial.print("[ABRP] Bad ABRP-server ");
+    Serial.println(serverUrl);
+    return false;
+  }
+
+  char token[128];
+  char key[96];
+  if (urlEncode(userToken, token, sizeof(token)) < 0 ||
+      urlEncode(apiKey, key, sizeof(key)) < 0) {
+    return false;
+  }
+  if (key[0]) {
+    snprintf(m_query, sizeof(m_query), "token=%s&api_key=%s", token, key);
+  } else {
+    snprintf(m_query, sizeof(m_query), "token=%s", token);
+  }
+  m_enabled = true;
+  return true;
+}
+
+void AbrpUploader::setLink(UploadLink* link)
+{
+  if (link == m_link) {
+    return;
+  }
+  if (m_link) {
+    m_link->close();
+  }
+  m_link = link;
+}
+
+bool AbrpUploader::poll(const TlmSource& source, uint32_t nowMs)
+{
+  if (!m_enabled || !m_link || static_cast<int32_t>(nowMs - m_nextMs) < 0) {
+    return false;
+  }
+  if (m_sentAny && source.fieldSequence() == m_sentSeq) {
+    return false;
+  }
+  // the record and its sequence come from the same locked view of the fields
+  uint32_t seq = 0;
+  if (source.tlmJson(m_json, sizeof(m_json), nowMs, &seq) <= 0) {
+    return false;
+  }
+  memcpy(m_body, "tlm=", 4);
+  int encoded = urlEncode(m_json, m_body + 4, sizeof(m_body) - 4);
+  if (encoded < 0) {
+    return false;
+  }
+
+  if (!post(4 + static_cast<size_t>(encoded))) {
+    m_stats.failed++;
+    if (m_failures < UINT16_MAX) {
+      m_failures++;
+    }
+    uint8_t shift = m_failures < kMaxBackoffShift ? static_cast<uint8_t>(m_failures) : kMaxBackoffShift;
+    uint32_t backoff = m_intervalMs << shift;
+    m_nextMs = nowMs + (backoff < ABRP_UPLOAD_MAX_BACKOFF ? backoff : ABRP_UPLOAD_MAX_BACKOFF);
+    return false;
+  }
+  m_failures = 0;
+  m_sentSeq = seq;
+  m_sentAny = true;
+  m_stats.sent++;
+  m_nextMs = nowMs + m_intervalMs;
+  return true;
+}
+
+bool AbrpUploader::post(size_t bodyLen)
+{
+  int headerLen = snprintf(m_request, sizeof(m_request),
+                           "POST %s?%s HTTP/1.1\r\n"
+                           "Host: %s\r\n"
+                           "Connection: keep-alive\r\n"
+                           "Content-Type: application/x-www-form-urlencoded\r\n"
+                           "Content-Length: %u\r\n"
+                           "\r\n",
+                           m_server.path, m_query, m_server.host, static_cast<unsigned int>(bodyLen));
+  if (headerLen < 0 || static_cast<size_t>(headerLen) + bodyLen > sizeof(m_request)) {
+    return false;
+  }
+  // header and body in one write, so a record is one TLS record on the wire
+  memcpy(m_request + headerLen, m_body, bodyLen);
+  size_t requestLen = static_cast<size_t>(headerLen) + bodyLen;
+
+  bool reused = m_link->connected();
+  for (uint8_t attempt = 0; attempt < 2; attempt++) {
+    if (!m_link->connected()) {
+      reused = false;
+      if (!m_link->connect(m_server.host, m_server.port, m_server.tls, ABRP_UPLOAD_TIMEOUT)) {
+        Serial.print("[ABRP] Unable to connect to ");
+        Serial.println(m_server.host);
+        return false;
+      }
+      m_stats.connects++;
+    }
+    bool keepAlive = false;
+    if (exchange(requestLen, keepAlive)) {
+      if (!keepAlive) {
+        m_link->close();
+      }
+      if (m_stats.lastStatus / 100 != 2) {
+        Serial.print("[ABRP] HTTP ");
+        Serial.print(m_stats.lastStatus);
+        Serial.print(' ');
+        Serial.println(m_reply);
+        return false;
+      }
+      return true;
+    }
+    m_link->close();
+    // only a kept-alive connection the server closed while idle is worth a second try
+    if (!reused) {
+      break;
+    }
+  }
+  return false;
+}
+
+bool AbrpUploader::exchange(size_t requestLen, bool& keepAlive)
+{
+  uint32_t startMs = millis();
+  if (!m_link->write(reinterpret_cast<const uint8_t*>(m_request), requestLen)) {
+    return false;
+  }
+  m_rxLen = 0;
+  m_rxPos = 0;
+  m_deadlineMs = startMs + ABRP_UPLOAD_TIMEOUT;
+  if (!readResponse(keepAlive)) {
+    return false;
+  }
+  m_stats.lastLatencyMs = millis() - startMs;
+  return true;
+}
+
+bool AbrpUploader::readResponse(bool& keepAlive)
+{
+  char line[128];
+  if (readLine(line, sizeof(line)) < 0 || strncmp(line, "HTTP/1.", 7) != 0) {
+    return false;
+  }
+  // HTTP/1.1 keeps the connection unless told otherwise, HTTP/1.0 only if asked to
+  keepAlive = line[7] == '1';
+  const char* code = strchr(line, ' ');
+  m_stats.lastStatus = code ? static_cast<uint16_t>(atoi(code + 1)) : 0;
+
+  long contentLength = -1;
+  bool chunked = false;
+  for (;;) {
+    int len = readLine(line, sizeof(line));
+    if (len < 0) {
+      return false;
+    }
+    if (len == 0) {
+      break;
+    }
+    if (headerIs(line, "Content-Length:")) {
+      contentLength = atol(line + 15);
+    } else if (headerIs(line, "Transfer-Encoding:")) {
+      chunked = strstr(line, "chunked") != nullptr;
+    } else if (headerIs(line, "Connection:")) {
+      if (containsIgnoreCase(line, "close")) {
+        keepAlive = false;
+      } else if (containsIgnoreCase(line, "keep-alive")) {
+        keepAlive = true;
+      }
+    }
+  }
+
+  m_reply[0] = 0;
+  if (chunked) {
+    for (;;) {
+      if (readLine(line, sizeof(line)) < 0) {
+        return false;
+      }
+      uint32_t size = strtoul(line, nullptr, 16);
+      if (size == 0) {
+        // trailer fields up to the empty line
+        int len = 0;
+        while ((len = readLine(line, sizeof(line))) > 0) {
+        }
+        return len == 0;
+      }
+      if (!skipBody(size) || readLine(line, sizeof(line)) < 0) {
+        return false;
+      }
+    }
+  }
+  if (contentLength >= 0) {
+    return skipBody(static_cast<uint32_t>(contentLength));
+  }
+  // no length: the body runs until the server closes the connection
+  keepAlive = false;
+  uint8_t c = 0;
+  while (readByte(c)) {
+  }
+  return true;
+}
+
+bool AbrpUploader::readByte(uint8_t& c)
+{
+  if (m_rxPos >= m_rxLen) {
+    int32_t remaining = static_cast<int32_t>(m_deadlineMs - millis());
+    if (remaining <= 0) {
+      return false;
+    }
+    int n = m_link->read(m_rx, sizeof(m_rx), static_cast<uint32_t>(remaining));
+    if (n <= 0) {
+      return false;
+    }
+    m_rxLen = static_cast<uint16_t>(n);
+    m_rxPos = 0;
+  }
+  c = m_rx[m_rxPos++];
+  return true;
+}
+
+// one line without its CRLF, cut to size; -1 on timeout or close
+int AbrpUploader::readLine(char* line, size_t size)
+{
+  size_t n = 0;
+  uint8_t c = 0;
+  for (;;) {
+    if (!readByte(c)) {
+      return -1;
+    }
+    if (c == '\n') {
+      break;
+    }
+    if (c != '\r' && n + 1 < size) {
+      line[n++] = static_cast<char>(c);
+    }
+  }
+  line[n] = 0;
+  return static_cast<int>(n);
+}
+
+// consumes body bytes, keeping the first ones for the log
+bool AbrpUploader::skipBody(uint32_t count)
+{
+  size_t kept = strlen(m_reply);
+  uint8_t c = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    if (!readByte(c)) {
+      return false;
+    }
+    if (kept + 1 < sizeof(m_reply) && c >= ' ') {
+      m_reply[kept++] = static_cast<char>(c);
+      m_reply[kept] = 0;
+    }
+  }
+  return true;
+}
+
+void AbrpUploader::printStats()
+{
+  if (!m_enabled) {
+    return;
+  }
+  Serial.print("[ABRP] sent:");
+  Serial.print(m_stats.sent);
+  Serial.print(" failed:");
+  Serial.print(m_stats.failed);
+  Serial.print(" connects:");
+  Serial.print(m_stats.connects);
+  Serial.print(" status:");
+  Serial.print(m_stats.lastStatus);
+  Serial.print(" latency:");
+  Serial.print(m_stats.lastLatencyMs);
+  Serial.println("ms");
+}
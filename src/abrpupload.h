@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+#include "tlmsource.h"
+#include "uploadlink.h"
+
+// ABRP-server split into its parts, e.g. https://api.iternio.com/1/tlm/send
+struct AbrpServer {
+  char host[64] = {0};
+  uint16_t port = 443;
+  bool tls = true;
+  char path[64] = {0};
+};
+
+struct AbrpUploadStats {
+  uint32_t sent = 0;
+  uint32_t failed = 0;
+  uint32_t connects = 0;       // connections opened; every other upload reuses one
+  uint16_t lastStatus = 0;     // HTTP status of the last reply
+  uint32_t lastLatencyMs = 0;  // from writing the request to the end of the reply
+};
+
+// Posts tlm records to the ABRP telemetry API at ABRP-send-data-interval over
+// one keep-alive HTTP/1.1 connection. It runs in the telemetry task, which
+// hands over the link it currently has up; a record is only sent when a field
+// changed since the last accepted one, and failures back off exponentially.
+class AbrpUploader {
+public:
+  // false without a user token or with an unusable server URL (empty = ABRP_SERVER_URL)
+  bool begin(const char* serverUrl, const char* userToken, const char* apiKey, uint16_t sendIntervalSec);
+  // nullptr while the network is down; a different link drops the connection
+  void setLink(UploadLink* link);
+  // true if a record was sent and accepted
+  bool poll(const TlmSource& source, uint32_t nowMs);
+  const AbrpUploadStats& stats() const { return m_stats; }
+  void printStats();
+
+private:
+  bool post(size_t bodyLen);
+  bool exchange(size_t requestLen, bool& keepAlive);
+  bool readResponse(bool& keepAlive);
+  bool readByte(uint8_t& c);
+  int readLine(char* line, size_t size);
+  bool skipBody(uint32_t count);
+
+  bool m_enabled = false;
+  AbrpServer m_server;
+  char m_query[240] = {0};     // token and api_key, already URL encoded
+  uint32_t m_intervalMs = 1000;
+  UploadLink* m_link = nullptr;
+  uint32_t m_nextMs = 0;
+  uint32_t m_sentSeq = 0;
+  bool m_sentAny = false;
+  uint16_t m_failures = 0;
+  AbrpUploadStats m_stats;
+
+  // receive buffer of the reply being parsed
+  uint8_t m_rx[256];
+  uint16_t m_rxLen = 0;
+  uint16_t m_rxPos = 0;
+  uint32_t m_deadlineMs = 0;
+  char m_reply[96] = {0};      // start of the reply body, printed when a record is refused
+
+  char m_json[640];
+  char m_body[1024];
+  char m_request[1536];
+};
@@ -0,0 +1,123 @@
+#include "canbus.h"
+
+namespace {
+// a waiting client gains one priority step per aging interval
+constexpr uint32_t kAgingUs = 50000;
+// a client counts as waiting only while it keeps asking
+constexpr uint32_t kWaitStaleUs = 20000;
+
+const char* const kClientNames[CAN_CLIENT_COUNT] = {"OBD", "UDS"};
+}
+
+uint16_t CanBusArbiter::effectivePriority(const Client& client, uint8_t priority, uint32_t nowUs) const
+{
+  uint32_t aged = client.waiting ? (nowUs - client.waitSinceUs) / kAgingUs : 0;
+  return static_cast<uint16_t>(priority + (aged > 255 ? 255 : aged));
+}
+
+bool CanBusArbiter::waitingNow(const Client& client, uint32_t nowUs) const
+{
+  return client.waiting && nowUs - client.lastAskUs < kWaitStaleUs;
+}
+
+bool CanBusArbiter::request(CanClient client, uint8_t priority)
+{
+  uint32_t now = micros();
+  Client& self = m_clients[client];
+  uint16_t mine = effectivePriority(self, priority, now);
+
+  bool blocked = false;
+  for (uint8_t i = 0; i < CAN_CLIENT_COUNT && !blocked; i++) {
+    if (i == client) {
+      continue;
+    }
+    const Client& other = m_clients[i];
+    if (other.holders > 0) {
+      blocked = true;
+    } else if (waitingNow(other, now)) {
+      uint16_t theirs = effectivePriority(other, other.waitPriority, now);
+      // equal priority goes to whoever has waited longer
+      blocked = theirs > mine ||
+                (theirs == mine && (!self.waiting || static_cast<int32_t>(other.waitSinceUs - self.waitSinceUs) < 0));
+    }
+  }
+
+  if (blocked) {
+    if (!self.waiting) {
+      self.waiting = true;
+      self.waitSinceUs = now;
+      self.waitPriority = priority;
+    } else if (priority > self.waitPriority) {
+      self.waitPriority = priority;
+    }
+    self.lastAskUs = now;
+    self.refused++;
+    return false;
+  }
+
+  if (self.waiting) {
+    self.waitedUs += now - self.waitSinceUs;
+    self.waiting = false;
+  }
+  if (self.holders++ == 0) {
+    self.heldSinceUs = now;
+  }
+  if (m_holders++ == 0) {
+    m_busySinceUs = now;
+  }
+  self.transactions++;
+  return true;
+}
+
+void CanBusArbiter::release(CanClient client)
+{
+  Client& self = m_clients[client];
+  if (self.holders == 0) {
+    return;
+  }
+  uint32_t now = micros();
+  if (--self.holders == 0) {
+    self.heldUs += now - self.heldSinceUs;
+  }
+  if (--m_holders == 0) {
+    m_busyUs += now - m_busySinceUs;
+  }
+}
+
+void CanBusArbiter::printStats()
+{
+  uint32_t now = micros();
+  uint32_t window = now - m_windowStartUs;
+  if (window == 0) {
+    return;
+  }
+  // close the running intervals so long transactions are counted in this window
+  uint32_t busyUs = m_busyUs + (m_holders ? now - m_busySinceUs : 0);
+
+  Serial.print("[BUS]");
+  for (uint8_t i = 0; i < CAN_CLIENT_COUNT; i++) {
+    Client& c = m_clients[i];
+    uint32_t heldUs = c.heldUs + (c.holders ? now - c.heldSinceUs : 0);
+    Serial.print(' ');
+    Serial.print(kClientNames[i]);
+    Serial.print(':');
+    Serial.print(c.transactions);
+    Serial.print(" held:");
+    Serial.print(static_cast<uint32_t>(static_cast<uint64_t>(heldUs) * 100 / window));
+    Serial.print("% wait:");
+    Serial.print(c.transactions ? c.waitedUs / c.transactions / 1000 : 0);
+    Serial.print("ms refused:");
+    Serial.print(c.refused);
+    c.transactions = 0;
+    c.refused = 0;
+    c.heldUs = 0;
+    c.waitedUs = 0;
+    c.heldSinceUs = now;
+  }
+  Serial.print(" busy:");
+  Serial.print(static_cast<uint32_t>(static_cast<uint64_t>(busyUs) * 100 / window));
+  Serial.println('%');
+  m_busyUs = 0;
+  m_busySinceUs = now;
+  m_windowStartUs = now;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <Arduino.h>
+
+enum CanClient : uint8_t {
+  CAN_CLIENT_OBD = 0,   // COBD mode-01 PIDs through the co-processor
+  CAN_CLIENT_UDS,       // UdsClient transactions on the ESP32 TWAI
+  CAN_CLIENT_COUNT
+};
+
+// Single point of access to the vehicle bus for both CAN stacks. Every
+// transaction asks for the bus first and releases it when done. UDS
+// transactions to different ECUs can overlap each other but never a COBD
+// request, which is functionally addressed and keeps every ECU busy.
+// A client that has to wait is served before a lower priority one. Waiting
+// raises its priority over time, so neither client starves.
+class CanBusArbiter {
+public:
+  bool request(CanClient client, uint8_t priority);
+  void release(CanClient client);
+  bool held(CanClient client) const { return m_clients[client].holders > 0; }
+  void printStats();
+
+private:
+  struct Client {
+    uint8_t holders = 0;
+    bool waiting = false;
+    uint8_t waitPriority = 0;
+    uint32_t waitSinceUs = 0;
+    uint32_t lastAskUs = 0;
+    uint32_t heldSinceUs = 0;
+    // stats since the last printStats()
+    uint32_t transactions = 0;
+    uint32_t refused = 0;
+    uint32_t heldUs = 0;
+    uint32_t waitedUs = 0;
+  };
+
+  uint16_t effectivePriority(const Client& client, uint8_t priority, uint32_t nowUs) const;
+  bool waitingNow(const Client& client, uint32_t nowUs) const;
+
+  Client m_clients[CAN_CLIENT_COUNT];
+  uint8_t m_holders = 0;
+  uint32_t m_busySinceUs = 0;
+  uint32_t m_busyUs = 0;
+  uint32_t m_windowStartUs = 0;
+};
@@ -0,0 +1,149 @@
+#include "canrecorder.h"
+#include "config.h"
+#include <SD.h>
+#include <SPIFFS.h>
+#include <esp_timer.h>
+#include "esp_heap_caps.h"
+
+namespace {
+// a partly filled block is sealed after this long so quiet periods still reach the card
+constexpr uint64_t kSealAgeUs = 1000000;
+constexpr uint32_t kMaxOffsetUs = 0x0FFFFFFF;
+}
+
+bool CanRecorder::init(uint16_t blockCount)
+{
+  if (m_blocks) {
+    return true;
+  }
+  size_t bytes = static_cast<size_t>(blockCount) * sizeof(CanLogBlock);
+  // PSRAM where the board has it
+  m_blocks = static_cast<CanLogBlock*>(heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM));
+  if (!m_blocks) {
+    m_blocks = static_cast<CanLogBlock*>(malloc(bytes));
+  }
+  if (!m_blocks) {
+    Serial.println("[CANLOG] OUT OF RAM");
+    return false;
+  }
+  m_blockCount = blockCount;
+  return true;
+}
+
+bool CanRecorder::open(uint32_t fileId)
+{
+#if STORAGE == STORAGE_NONE
+  (void)fileId;
+  return false;
+#else
+  close();
+  char path[32] = {0};
+#if STORAGE == STORAGE_SPIFFS
+  snprintf(path, sizeof(path), "/CAN-%u.bin", fileId);
+  m_file = SPIFFS.open(path, FILE_APPEND);
+#else
+  snprintf(path, sizeof(path), "/DATA/CAN-%u.bin", fileId);
+  m_file = SD.open(path, FILE_APPEND);
+#endif
+  if (m_file) {
+    Serial.print("[CANLOG] Recording to ");
+    Serial.println(path);
+  }
+  return m_file;
+#endif
+}
+
+void CanRecorder::close()
+{
+  if (m_file) {
+    flush(UINT8_MAX);
+    m_file.close();
+  }
+}
+
+void CanRecorder::seal()
+{
+  m_fill = 0;
+  m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void CanRecorder::record(const UdsFrame& frame)
+{
+  if (!m_blocks) {
+    return;
+  }
+  uint64_t now = esp_timer_get_time();
+  uint32_t head = m_head.load(std::memory_order_relaxed);
+  CanLogBlock* block = &m_blocks[head % m_blockCount];
+  if (m_fill > 0 && now - block->header.baseUs > kMaxOffsetUs) {
+    seal();
+    head++;
+    block = &m_blocks[head % m_blockCount];
+  }
+  if (m_fill == 0) {
+    if (head - m_tail.load(std::memory_order_acquire) >= m_blockCount) {
+      m_dropped++;
+      return;
+    }
+    block->header.magic = CAN_LOG_MAGIC;
+    block->header.version = CAN_LOG_VERSION;
+    block->header.baseUs = now;
+  }
+
+  CanLogRecord& record = block->records[m_fill];
+  uint8_t dlc = frame.len > 8 ? 8 : frame.len;
+  record.offset = static_cast<uint32_t>(now - block->header.baseUs) | (static_cast<uint32_t>(dlc) << 28);
+  record.id = (frame.id & 0x1FFFFFFF) | (frame.extended ? 0x80000000 : 0);
+  memcpy(record.data, frame.data, 8);
+  block->header.count = ++m_fill;
+  m_frames++;
+  if (m_fill == CAN_RECORDS_PER_BLOCK) {
+    seal();
+  }
+}
+
+void CanRecorder::tick()
+{
+  if (m_blocks && m_fill > 0) {
+    const CanLogBlock& block = m_blocks[m_head.load(std::memory_order_relaxed) % m_blockCount];
+    if (static_cast<uint64_t>(esp_timer_get_time()) - block.header.baseUs >= kSealAgeUs) {
+      seal();
+    }
+  }
+}
+
+void CanRecorder::flush(uint8_t maxBlocks)
+{
+  if (!m_blocks) {
+    return;
+  }
+  uint32_t tail = m_tail.load(std::memory_order_relaxed);
+  uint32_t head = m_head.load(std::memory_order_acquire);
+  for (uint8_t i = 0; i < maxBlocks && tail != head; i++, tail++) {
+    // without a file the blocks are discarded so the ring never stalls
+    if (m_file) {
+      const uint8_t* data = reinterpret_cast<const uint8_t*>(&m_blocks[tail % m_blockCount]);
+      if (m_file.write(data, sizeof(CanLogBlock)) == sizeof(CanLogBlock)) {
+        m_blocksWritten++;
+      } else {
+        m_writeErrors++;
+      }
+    }
+    m_tail.store(tail + 1, std::memory_order_release);
+  }
+}
+
+void CanRecorder::printStats()
+{
+  if (!m_blocks) {
+    return;
+  }
+  Serial.print("[CANLOG] frames:");
+  Serial.print(m_frames);
+  Serial.print(" dropped:");
+  Serial.print(m_dropped);
+  Serial.print(" blocks:");
+  Serial.print(m_blocksWritten);
+  Serial.print(" errors:");
+  Serial.println(m_writeErrors);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+#include <atomic>
+#include "cantransport.h"
+
+// On-disk format, little endian, written in whole 4 KB blocks so the SD card
+// only ever sees aligned full-block writes. Each block starts with a header
+// and holds up to CAN_RECORDS_PER_BLOCK frames; records past count are
+// unused. tools/canlog.py converts a recording to candump or ASC text.
+constexpr uint32_t CAN_LOG_MAGIC = 0x524E4143;  // "CANR"
+constexpr uint16_t CAN_LOG_VERSION = 1;
+constexpr uint16_t CAN_LOG_BLOCK_SIZE = 4096;
+
+struct CanLogHeader {
+  uint32_t magic;
+  uint16_t count;
+  uint16_t version;
+  uint64_t baseUs;      // esp_timer time of the first frame in the block
+};
+
+struct CanLogRecord {
+  uint32_t offset;      // bits 0-27: us after baseUs, bits 28-31: DLC
+  uint32_t id;          // bits 0-28: CAN id, bit 31: extended
+  uint8_t data[8];
+};
+
+constexpr uint16_t CAN_RECORDS_PER_BLOCK = (CAN_LOG_BLOCK_SIZE - sizeof(CanLogHeader)) / sizeof(CanLogRecord);
+
+struct CanLogBlock {
+  CanLogHeader header;
+  CanLogRecord records[CAN_RECORDS_PER_BLOCK];
+};
+
+static_assert(sizeof(CanLogBlock) == CAN_LOG_BLOCK_SIZE, "CAN log blocks must fill a 4 KB block exactly");
+
+// Ring of log blocks: the CAN receive task fills and seals blocks, the main
+// loop writes sealed blocks straight from the ring to the file. Frames are
+// dropped (and counted) only when every block is waiting to be written.
+class CanRecorder : public CanFrameSink {
+public:
+  bool init(uint16_t blockCount);
+  bool open(uint32_t fileId);
+  void close();
+  bool active() const { return m_blocks != nullptr; }
+
+  // receive task side
+  void record(const UdsFrame& frame) override;
+  void tick() override;
+
+  // main loop side: writes at most maxBlocks sealed blocks
+  void flush(uint8_t maxBlocks);
+  void printStats();
+
+private:
+  void seal();
+
+  CanLogBlock* m_blocks = nullptr;
+  uint16_t m_blockCount = 0;
+  std::atomic<uint32_t> m_head{0};  // block being filled
+  std::atomic<uint32_t> m_tail{0};  // next block to write
+  uint16_t m_fill = 0;
+  File m_file;
+  uint32_t m_frames = 0;
+  uint32_t m_dropped = 0;
+  uint32_t m_blocksWritten = 0;
+  uint32_t m_writeErrors = 0;
+};
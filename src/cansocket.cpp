@@ -0,0 +1,214 @@
+#include "cansocket.h"
+
+#if defined(__linux__) && !defined(ESP_PLATFORM)
+
+#include <linux/can.h>
+#include <linux/can/error.h>
+#include <linux/can/raw.h>
+#include <net/if.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+constexpr can_err_mask_t kErrorMask = CAN_ERR_BUSOFF | CAN_ERR_RESTARTED | CAN_ERR_CRTL | CAN_ERR_LOSTARB |
+                                      CAN_ERR_PROT | CAN_ERR_ACK;
+constexpr uint8_t kMaxKernelFilters = 64;
+
+bool waitReadable(int fd, uint32_t timeoutMs)
+{
+  pollfd pfd = {fd, POLLIN, 0};
+  return ::poll(&pfd, 1, static_cast<int>(timeoutMs)) > 0 && (pfd.revents & POLLIN);
+}
+}
+
+int SocketCanTransport::openSocket(int ifIndex)
+{
+  int fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if (fd < 0) {
+    return -1;
+  }
+  sockaddr_can addr = {};
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifIndex;
+  if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool SocketCanTransport::open(const CanTransportConfig& config)
+{
+  if (m_socket >= 0) {
+    return true;
+  }
+  int ifIndex = if_nametoindex(m_interface);
+  if (ifIndex == 0) {
+    return false;
+  }
+  m_socket = openSocket(ifIndex);
+  m_errorSocket = openSocket(ifIndex);
+  if (m_socket < 0 || m_errorSocket < 0) {
+    close();
+    return false;
+  }
+
+  // the kernel filters exactly, so unlike the TWAI mask nothing extra gets through
+  if (config.filterCount > 0) {
+    can_filter filters[kMaxKernelFilters];
+    uint8_t count = config.filterCount > kMaxKernelFilters ? kMaxKernelFilters : config.filterCount;
+    for (uint8_t i = 0; i < count; i++) {
+      const CanId& id = config.filterIds[i];
+      filters[i].can_id = id.extended ? (id.id | CAN_EFF_FLAG) : id.id;
+      filters[i].can_mask = id.extended ? (CAN_EFF_MASK | CAN_EFF_FLAG) : (CAN_SFF_MASK | CAN_EFF_FLAG);
+    }
+    setsockopt(m_socket, SOL_CAN_RAW, CAN_RAW_FILTER, filters, count * sizeof(can_filter));
+  }
+  // each frame carries the socket's drop counter
+  int one = 1;
+  setsockopt(m_socket, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+  m_dropped = 0;
+  // error socket: error frames only
+  setsockopt(m_errorSocket, SOL_CAN_RAW, CAN_RAW_FILTER, nullptr, 0);
+  can_err_mask_t mask = kErrorMask;
+  setsockopt(m_errorSocket, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &mask, sizeof(mask));
+  m_state = CAN_STATE_RUNNING;
+  return true;
+}
+
+void SocketCanTransport::close()
+{
+  if (m_socket >= 0) {
+    ::close(m_socket);
+  }
+  if (m_errorSocket >= 0) {
+    ::close(m_errorSocket);
+  }
+  m_socket = -1;
+  m_errorSocket = -1;
+  m_state = CAN_STATE_STOPPED;
+}
+
+bool SocketCanTransport::send(const UdsFrame& frame)
+{
+  if (m_socket < 0 || frame.len > 8) {
+    return false;
+  }
+  can_frame msg = {};
+  msg.can_id = frame.extended ? (frame.id | CAN_EFF_FLAG) : frame.id;
+  msg.can_dlc = frame.len;
+  memcpy(msg.data, frame.data, frame.len);
+  return ::send(m_socket, &msg, sizeof(msg), MSG_DONTWAIT) == sizeof(msg);
+}
+
+bool SocketCanTransport::receive(UdsFrame& frame, uint32_t timeoutMs)
+{
+  if (m_socket < 0 || !waitReadable(m_socket, timeoutMs)) {
+    return false;
+  }
+  can_frame msg = {};
+  iovec iov = {&msg, sizeof(msg)};
+  char control[CMSG_SPACE(sizeof(uint32_t))];
+  msghdr header = {};
+  header.msg_iov = &iov;
+  header.msg_iovlen = 1;
+  header.msg_control = control;
+  header.msg_controllen = sizeof(control);
+  if (::recvmsg(m_socket, &header, MSG_DONTWAIT) != sizeof(msg)) {
+    return false;
+  }
+  for (cmsghdr* c = CMSG_FIRSTHDR(&header); c; c = CMSG_NXTHDR(&header, c)) {
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL) {
+      memcpy(&m_dropped, CMSG_DATA(c), sizeof(m_dropped));
+    }
+  }
+  if (msg.can_id & CAN_RTR_FLAG) {
+    return false;
+  }
+  frame.extended = (msg.can_id & CAN_EFF_FLAG) != 0;
+  frame.id = msg.can_id & (frame.extended ? CAN_EFF_MASK : CAN_SFF_MASK);
+  frame.len = msg.can_dlc > 8 ? 8 : msg.can_dlc;
+  memcpy(frame.data, msg.data, frame.len);
+  return true;
+}
+
+uint32_t SocketCanTransport::readAlerts(uint32_t waitMs)
+{
+  uint32_t alerts = 0;
+  if (m_errorSocket < 0 || !waitReadable(m_errorSocket, waitMs)) {
+    return 0;
+  }
+  can_frame msg = {};
+  while (::recv(m_errorSocket, &msg, sizeof(msg), MSG_DONTWAIT) == sizeof(msg)) {
+    if (!(msg.can_id & CAN_ERR_FLAG)) {
+      continue;
+    }
+    if (msg.can_id & CAN_ERR_BUSOFF) {
+      alerts |= CAN_ALERT_BUS_OFF;
+      m_state = CAN_STATE_BUS_OFF;
+    }
+    if (msg.can_id & CAN_ERR_RESTARTED) {
+      alerts |= CAN_ALERT_RECOVERED;
+      m_state = CAN_STATE_STOPPED;
+    }
+    if (msg.can_id & CAN_ERR_LOSTARB) {
+      alerts |= CAN_ALERT_ARB_LOST;
+    }
+    if (msg.can_id & (CAN_ERR_PROT | CAN_ERR_ACK)) {
+      alerts |= CAN_ALERT_BUS_ERROR;
+    }
+    if (msg.can_id & CAN_ERR_CRTL) {
+      if (msg.data[1] & (CAN_ERR_CRTL_RX_PASSIVE | CAN_ERR_CRTL_TX_PASSIVE)) {
+        alerts |= CAN_ALERT_ERROR_PASSIVE;
+      }
+      if (msg.data[1] & CAN_ERR_CRTL_RX_OVERFLOW) {
+        alerts |= CAN_ALERT_RX_QUEUE_FULL;
+      }
+    }
+  }
+  return alerts;
+}
+
+bool SocketCanTransport::status(CanStatus& status)
+{
+  if (m_socket < 0) {
+    return false;
+  }
+  // FIONREAD on a raw CAN socket is the size of the next frame, not the queue depth
+  status.state = m_state;
+  status.rxPending = 0;
+  status.rxMissed = m_dropped;
+  return true;
+}
+
+bool SocketCanTransport::recover()
+{
+  // the kernel restarts the controller after restart-ms; its RESTARTED error
+  // frame may already have been read together with the bus-off
+  if (m_state == CAN_STATE_BUS_OFF) {
+    m_state = CAN_STATE_RECOVERING;
+  }
+  return true;
+}
+
+bool SocketCanTransport::restart()
+{
+  if (m_socket < 0) {
+    return false;
+  }
+  m_state = CAN_STATE_RUNNING;
+  return true;
+}
+
+// CAN_INTERFACE picks the interface, vcan0 by default
+CanTransport* defaultCanTransport()
+{
+  const char* interface = getenv("CAN_INTERFACE");
+  static SocketCanTransport socketCan(interface && *interface ? interface : "vcan0");
+  return &socketCan;
+}
+
+#endif
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "cantransport.h"
+
+#if defined(__linux__) && !defined(ESP_PLATFORM)
+
+// Linux SocketCAN interface for host builds, e.g. a vcan0 with a simulated
+// ECU (tools/vecu.py). The bitrate belongs to the interface (ip link set ...
+// bitrate) and listen-only is not available, so both settings are ignored.
+// Error frames arrive on a second socket so alerts can be read without
+// consuming data frames; bus-off recovery is left to the kernel (restart-ms).
+// A raw socket cannot report how many frames are queued, so status() gives
+// rxPending 0 and counts frames the socket dropped in rxMissed instead.
+class SocketCanTransport : public CanTransport {
+public:
+  explicit SocketCanTransport(const char* interface) : m_interface(interface) {}
+  bool open(const CanTransportConfig& config) override;
+  void close() override;
+  bool send(const UdsFrame& frame) override;
+  bool receive(UdsFrame& frame, uint32_t timeoutMs) override;
+  uint32_t readAlerts(uint32_t waitMs) override;
+  bool status(CanStatus& status) override;
+  bool recover() override;
+  bool restart() override;
+
+private:
+  int openSocket(int ifIndex);
+
+  const char* m_interface;
+  int m_socket = -1;
+  int m_errorSocket = -1;
+  CanState m_state = CAN_STATE_STOPPED;
+  uint32_t m_dropped = 0;  // SO_RXQ_OVFL counter of the data socket
+};
+
+#endif
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+#include "isotp.h"
+
+struct CanId {
+  CanId() {}
+  CanId(uint32_t canId, bool isExtended) : id(canId), extended(isExtended) {}
+  uint32_t id = 0;
+  bool extended = false;
+};
+
+// alert bits returned by CanTransport::readAlerts()
+enum CanAlert : uint32_t {
+  CAN_ALERT_BUS_OFF = 1 << 0,
+  CAN_ALERT_RECOVERED = 1 << 1,
+  CAN_ALERT_ERROR_PASSIVE = 1 << 2,
+  CAN_ALERT_BUS_ERROR = 1 << 3,
+  CAN_ALERT_ARB_LOST = 1 << 4,
+  CAN_ALERT_RX_QUEUE_FULL = 1 << 5
+};
+
+enum CanState : uint8_t {
+  CAN_STATE_STOPPED = 0,  // not started, or recovered from bus-off and waiting for restart()
+  CAN_STATE_RUNNING,
+  CAN_STATE_BUS_OFF,
+  CAN_STATE_RECOVERING
+};
+
+struct CanStatus {
+  CanState state = CAN_STATE_STOPPED;
+  uint32_t rxPending = 0;  // frames waiting in the receive queue
+  uint32_t rxMissed = 0;   // frames lost by the controller or driver
+};
+
+struct CanTransportConfig {
+  uint32_t baud = 500000;
+  bool listenOnly = false;
+  uint16_t rxQueueLen = 64;
+  // acceptance filter; an empty list accepts every frame
+  const CanId* filterIds = nullptr;
+  uint8_t filterCount = 0;
+};
+
+// Raw frame access to one CAN controller. UdsClient only talks to the bus
+// through this, so the same ISO-TP and UDS code runs on the ESP32 TWAI and on
+// a Linux SocketCAN interface (a vcan0 with a simulated ECU on a workstation).
+// receive() and readAlerts() are called from the receive task only.
+class CanTransport {
+public:
+  virtual ~CanTransport() {}
+  virtual bool open(const CanTransportConfig& config) = 0;
+  virtual void close() = 0;
+  // never blocks; false if the frame could not be queued
+  virtual bool send(const UdsFrame& frame) = 0;
+  virtual bool receive(UdsFrame& frame, uint32_t timeoutMs) = 0;
+  // CAN_ALERT_* bits raised since the last call, waiting up to waitMs for one
+  virtual uint32_t readAlerts(uint32_t waitMs) = 0;
+  virtual bool status(CanStatus& status) = 0;
+  // start bus-off recovery, then restart() once the state is back to STOPPED
+  virtual bool recover() = 0;
+  virtual bool restart() = 0;
+};
+
+// Sees every frame UdsClient receives, on the receive task (CanRecorder).
+class CanFrameSink {
+public:
+  virtual ~CanFrameSink() {}
+  virtual void record(const UdsFrame& frame) = 0;
+  // once per receive task pass, frame or not
+  virtual void tick() = 0;
+};
+
+// the platform's own controller: TWAI on the ESP32, SocketCAN on Linux
+CanTransport* defaultCanTransport();
@@ -0,0 +1,211 @@
+#include "cantwai.h"
+
+#ifdef ESP_PLATFORM
+
+#include <Arduino.h>
+#include "config.h"
+#include "driver/twai.h"
+
+namespace {
+constexpr uint32_t kAlerts = TWAI_ALERT_BUS_OFF | TWAI_ALERT_BUS_RECOVERED | TWAI_ALERT_ERR_PASS |
+                             TWAI_ALERT_BUS_ERROR | TWAI_ALERT_ARB_LOST | TWAI_ALERT_RX_QUEUE_FULL;
+
+twai_timing_config_t timingFor(uint32_t baud)
+{
+  if (baud == 250000) {
+    return TWAI_TIMING_CONFIG_250KBITS();
+  }
+  if (baud == 1000000) {
+    return TWAI_TIMING_CONFIG_1MBITS();
+  }
+  return TWAI_TIMING_CONFIG_500KBITS();
+}
+
+// Acceptance code/mask for the SJA1000-style TWAI filter (mask bit 1 = don't care).
+// Single filter mode covers one frame format exactly; a mix of standard and
+// extended ids needs dual filter mode, which only sees ID[28:13] of extended
+// frames and lets some extra frames through.
+twai_filter_config_t computeFilter(const CanId* ids, uint8_t count)
+{
+  twai_filter_config_t filter = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+  if (count == 0) {
+    return filter;
+  }
+
+  bool haveStd = false;
+  bool haveExt = false;
+  uint32_t stdCode = 0;
+  uint32_t stdDiff = 0;
+  uint32_t extCode = 0;
+  uint32_t extDiff = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    if (ids[i].extended) {
+      if (!haveExt) {
+        extCode = ids[i].id;
+        haveExt = true;
+      }
+      extDiff |= ids[i].id ^ extCode;
+    } else {
+      if (!haveStd) {
+        stdCode = ids[i].id;
+        haveStd = true;
+      }
+      stdDiff |= ids[i].id ^ stdCode;
+    }
+  }
+  stdCode &= ~stdDiff & 0x7FF;
+  extCode &= ~extDiff & 0x1FFFFFFF;
+
+  if (!haveExt) {
+    filter.single_filter = true;
+    filter.acceptance_code = stdCode << 21;
+    filter.acceptance_mask = (stdDiff << 21) | 0x1FFFFF;
+  } else if (!haveStd) {
+    filter.single_filter = true;
+    filter.acceptance_code = extCode << 3;
+    filter.acceptance_mask = (extDiff << 3) | 0x7;
+  } else {
+    filter.single_filter = false;
+    uint32_t code1 = stdCode << 5;
+    uint32_t mask1 = ((stdDiff << 5) | 0x1F) & 0xFFFF;
+    uint32_t code2 = (extCode >> 13) & 0xFFFF;
+    // ACR3/AMR3[3:0] double as data byte 1 (low nibble) for filter 1 on standard
+    // frames, so they must be don't-care; filter 2 then ignores extended id bits 16..13
+    uint32_t mask2 = ((extDiff >> 13) | 0xF) & 0xFFFF;
+    filter.acceptance_code = (code1 << 16) | code2;
+    filter.acceptance_mask = (mask1 << 16) | mask2;
+  }
+  return filter;
+}
+}
+
+bool TwaiTransport::open(const CanTransportConfig& config)
+{
+  if (m_open) {
+    return true;
+  }
+  twai_general_config_t g_config = TWAI_GENERAL_CONFIG_DEFAULT(
+      CAN_TX_PIN, CAN_RX_PIN, config.listenOnly ? TWAI_MODE_LISTEN_ONLY : TWAI_MODE_NORMAL);
+  g_config.alerts_enabled = kAlerts;
+  g_config.rx_queue_len = config.rxQueueLen;
+  twai_timing_config_t t_config = timingFor(config.baud);
+  twai_filter_config_t f_config = computeFilter(config.filterIds, config.filterCount);
+
+  if (twai_driver_install(&g_config, &t_config, &f_config) != ESP_OK) {
+    return false;
+  }
+  if (twai_start() != ESP_OK) {
+    twai_driver_uninstall();
+    return false;
+  }
+  m_open = true;
+  return true;
+}
+
+void TwaiTransport::close()
+{
+  if (!m_open) {
+    return;
+  }
+  twai_stop();
+  twai_driver_uninstall();
+  m_open = false;
+}
+
+bool TwaiTransport::send(const UdsFrame& frame)
+{
+  twai_message_t msg = {};
+  msg.identifier = frame.id;
+  msg.extd = frame.extended ? 1 : 0;
+  msg.data_length_code = frame.len;
+  if (frame.len > 0) {
+    memcpy(msg.data, frame.data, frame.len);
+  }
+  return twai_transmit(&msg, 0) == ESP_OK;
+}
+
+bool TwaiTransport::receive(UdsFrame& frame, uint32_t timeoutMs)
+{
+  twai_message_t msg = {};
+  if (twai_receive(&msg, pdMS_TO_TICKS(timeoutMs)) != ESP_OK) {
+    return false;
+  }
+  frame.id = msg.identifier;
+  frame.extended = msg.extd != 0;
+  frame.len = msg.data_length_code;
+  if (frame.len > 0) {
+    memcpy(frame.data, msg.data, frame.len);
+  }
+  return true;
+}
+
+uint32_t TwaiTransport::readAlerts(uint32_t waitMs)
+{
+  uint32_t alerts = 0;
+  if (twai_read_alerts(&alerts, pdMS_TO_TICKS(waitMs)) != ESP_OK) {
+    return 0;
+  }
+  uint32_t result = 0;
+  if (alerts & TWAI_ALERT_BUS_OFF) {
+    result |= CAN_ALERT_BUS_OFF;
+  }
+  if (alerts & TWAI_ALERT_BUS_RECOVERED) {
+    result |= CAN_ALERT_RECOVERED;
+  }
+  if (alerts & TWAI_ALERT_ERR_PASS) {
+    result |= CAN_ALERT_ERROR_PASSIVE;
+  }
+  if (alerts & TWAI_ALERT_BUS_ERROR) {
+    result |= CAN_ALERT_BUS_ERROR;
+  }
+  if (alerts & TWAI_ALERT_ARB_LOST) {
+    result |= CAN_ALERT_ARB_LOST;
+  }
+  if (alerts & TWAI_ALERT_RX_QUEUE_FULL) {
+    result |= CAN_ALERT_RX_QUEUE_FULL;
+  }
+  return result;
+}
+
+bool TwaiTransport::status(CanStatus& status)
+{
+  twai_status_info_t info = {};
+  if (!m_open || twai_get_status_info(&info) != ESP_OK) {
+    return false;
+  }
+  switch (info.state) {
+    case TWAI_STATE_RUNNING:
+      status.state = CAN_STATE_RUNNING;
+      break;
+    case TWAI_STATE_BUS_OFF:
+      status.state = CAN_STATE_BUS_OFF;
+      break;
+    case TWAI_STATE_RECOVERING:
+      status.state = CAN_STATE_RECOVERING;
+      break;
+    default:
+      status.state = CAN_STATE_STOPPED;
+      break;
+  }
+  status.rxPending = info.msgs_to_rx;
+  status.rxMissed = info.rx_missed_count + info.rx_overrun_count;
+  return true;
+}
+
+bool TwaiTransport::recover()
+{
+  return twai_initiate_recovery() == ESP_OK;
+}
+
+bool TwaiTransport::restart()
+{
+  return twai_start() == ESP_OK;
+}
+
+CanTransport* defaultCanTransport()
+{
+  static TwaiTransport twai;
+  return &twai;
+}
+
+#endif
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "cantransport.h"
+
+#ifdef ESP_PLATFORM
+
+// ESP32 TWAI driver. The acceptance filter is programmed from the configured
+// ids as tightly as the SJA1000-style code/mask allows.
+class TwaiTransport : public CanTransport {
+public:
+  bool open(const CanTransportConfig& config) override;
+  void close() override;
+  bool send(const UdsFrame& frame) override;
+  bool receive(UdsFrame& frame, uint32_t timeoutMs) override;
+  uint32_t readAlerts(uint32_t waitMs) override;
+  bool status(CanStatus& status) override;
+  bool recover() override;
+  bool restart() override;
+
+private:
+  bool m_open = false;
+};
+
+#endif
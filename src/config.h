@@ -2,6 +2,8 @@
 #define CONFIG_H_INCLUDED
 
 #include "driver/gpio.h"
+#include "udsconfig.h"
+#include "uploadconfig.h"
 
 #ifdef CONFIG_ENABLE_OBD
 #define ENABLE_OBD CONFIG_ENABLE_OBD
@@ -45,11 +47,17 @@
 #define BUFFER_SLOTS 1024 /* max number of buffer slots */
 #define BUFFER_LENGTH 384 /* bytes per slot */
 #define SERIALIZE_BUFFER_SIZE 4096 /* bytes */
+#define UDS_RESPONSE_BUFFERS 8 /* pooled UDS response buffers */
+#define UDS_RESPONSE_BUFFER_SIZE 4096 /* bytes per UDS response */
+#define CAN_RECORDER_BLOCKS 64 /* 4KB blocks buffered for the CAN recorder */
 #define HAS_LARGE_RAM 1
 #else
 #define BUFFER_SLOTS 32 /* max number of buffer slots */
 #define BUFFER_LENGTH 256 /* bytes per slot */
 #define SERIALIZE_BUFFER_SIZE 1024 /* bytes */
+#define UDS_RESPONSE_BUFFERS 4 /* pooled UDS response buffers */
+#define UDS_RESPONSE_BUFFER_SIZE 512 /* bytes per UDS response */
+#define CAN_RECORDER_BLOCKS 4 /* 4KB blocks buffered for the CAN recorder */
 #define HAS_LARGE_RAM 0
 #endif
 
@@ -90,6 +98,24 @@
 #ifndef CAN_RX_PIN
 #define CAN_RX_PIN GPIO_NUM_4
 #endif
+// consecutive UDS failures before a request is quarantined
+#define ABRP_QUARANTINE_FAILURES 5
+// longest backoff between retries of a failing UDS request
+#define ABRP_MAX_BACKOFF 30000 /* ms */
+// how often a quarantined UDS request is re-probed
+#define ABRP_REPROBE_INTERVAL 120000 /* ms */
+// max wait between servicing in-flight UDS transactions and sniffed frames from the main loop
+#define ABRP_SERVICE_INTERVAL 2 /* ms */
+// a field not refreshed for this long is left out of logs and uploads (polled fields allow 3 missed polls)
+#define ABRP_FIELD_MAX_AGE 10000 /* ms */
+// PEM root certificate(s) the ABRP server is verified against; abrpca.h ships the major public roots
+// #define ABRP_SERVER_CA "-----BEGIN CERTIFICATE-----\n..."
+// accept any TLS certificate from the ABRP server (only for testing against a local stand-in)
+// #define ABRP_TLS_INSECURE
+// bus priority of COBD PID polls against OBD-ABRP request priorities (0-255)
+#define OBD_BUS_PRIORITY 100
+// longest wait for the bus before a PID poll cycle is skipped
+#define OBD_BUS_WAIT 200 /* ms */
 
 /**************************************
 * Networking configurations
@@ -52,6 +52,7 @@ HttpParam httpParam;
 
 int handlerLiveData(UrlHandlerParam* param);
 int handlerControl(UrlHandlerParam* param);
+int canStatsJson(char* buf, int bufsize);
 
 uint16_t hex2uint16(const char *p);
 
@@ -84,6 +85,11 @@ int handlerInfo(UrlHandlerParam* param)
         SD.totalBytes(), SD.usedBytes());
 #endif
 
+    if (bytes < bufsize - 8) {
+        bytes += snprintf(buf + bytes, bufsize - bytes, ",\n\"can\":");
+        bytes += canStatsJson(buf + bytes, bufsize - bytes - 1);
+    }
+
     if (bytes < bufsize - 1) buf[bytes++] = '}';
 
     param->contentLength = bytes;
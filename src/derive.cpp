@@ -0,0 +1,200 @@
+#include "derive.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace {
+constexpr uint8_t kMaxNameLength = 24;
+
+uint8_t precedence(DeriveOpCode code)
+{
+  switch (code) {
+    case DERIVE_LT:
+    case DERIVE_GT:
+      return 1;
+    case DERIVE_ADD:
+    case DERIVE_SUB:
+      return 2;
+    case DERIVE_MUL:
+    case DERIVE_DIV:
+      return 3;
+    case DERIVE_NEG:
+      return 4;
+    default:
+      return 0;
+  }
+}
+
+bool binaryOp(char c, DeriveOpCode& code)
+{
+  switch (c) {
+    case '+': code = DERIVE_ADD; return true;
+    case '-': code = DERIVE_SUB; return true;
+    case '*': code = DERIVE_MUL; return true;
+    case '/': code = DERIVE_DIV; return true;
+    case '<': code = DERIVE_LT; return true;
+    case '>': code = DERIVE_GT; return true;
+    default: return false;
+  }
+}
+
+// Postfix output with a running stack depth, so an unbalanced formula is
+// caught while compiling rather than when it runs.
+struct Emitter {
+  DeriveFormula& out;
+  int depth;
+
+  bool emit(const DeriveOp& op)
+  {
+    if (out.opCount >= DERIVE_MAX_OPS) {
+      return false;
+    }
+    if (op.code == DERIVE_CONST || op.code == DERIVE_FIELD || op.code == DERIVE_RATE) {
+      depth++;
+    } else if (op.code != DERIVE_NEG) {
+      depth--;
+    }
+    if (depth < 1) {
+      return false;
+    }
+    out.ops[out.opCount++] = op;
+    return true;
+  }
+};
+
+const char* skipSpaces(const char* p)
+{
+  while (*p == ' ' || *p == '\t') {
+    p++;
+  }
+  return p;
+}
+
+const char* readName(const char* p, char* name)
+{
+  uint8_t len = 0;
+  while ((isalnum(static_cast<unsigned char>(*p)) || *p == '_') && len < kMaxNameLength - 1) {
+    name[len++] = *p++;
+  }
+  name[len] = 0;
+  return len ? p : nullptr;
+}
+}
+
+bool compileFormula(const char* text, DeriveLookup lookup, void* context, DeriveFormula& out)
+{
+  uint8_t target = out.target;
+  out = DeriveFormula();
+  out.target = target;
+  Emitter emitter{out, 0};
+
+  // operator stack of the shunting-yard algorithm; '(' is kept as DERIVE_CONST
+  DeriveOpCode ops[DERIVE_MAX_OPS];
+  uint8_t opDepth = 0;
+  bool expectOperand = true;
+  const char* p = skipSpaces(text);
+
+  while (*p) {
+    if (expectOperand) {
+      DeriveOp op;
+      char name[kMaxNameLength];
+      if (*p == '(') {
+        if (opDepth >= DERIVE_MAX_OPS) {
+          return false;
+        }
+        ops[opDepth++] = DERIVE_CONST;
+        p = skipSpaces(p + 1);
+        continue;
+      }
+      if (*p == '-') {
+        if (opDepth >= DERIVE_MAX_OPS) {
+          return false;
+        }
+        ops[opDepth++] = DERIVE_NEG;
+        p = skipSpaces(p + 1);
+        continue;
+      }
+      if (isdigit(static_cast<unsigned char>(*p)) || *p == '.') {
+        char* end = nullptr;
+        op.code = DERIVE_CONST;
+        op.value = strtof(p, &end);
+        p = end;
+      } else {
+        p = readName(p, name);
+        if (!p) {
+          return false;
+        }
+        op.code = DERIVE_FIELD;
+        if (strcmp(name, "rate") == 0) {
+          p = skipSpaces(p);
+          if (*p != '(') {
+            return false;
+          }
+          p = readName(skipSpaces(p + 1), name);
+          if (!p) {
+            return false;
+          }
+          p = skipSpaces(p);
+          if (*p != ')') {
+            return false;
+          }
+          p++;
+          op.code = DERIVE_RATE;
+        }
+        if (!lookup(context, name, op.field)) {
+          return false;
+        }
+      }
+      if (!emitter.emit(op)) {
+        return false;
+      }
+      expectOperand = false;
+    } else if (*p == ')') {
+      while (opDepth > 0 && ops[opDepth - 1] != DERIVE_CONST) {
+        DeriveOp op;
+        op.code = ops[--opDepth];
+        if (!emitter.emit(op)) {
+          return false;
+        }
+      }
+      if (opDepth == 0) {
+        return false;
+      }
+      opDepth--;
+      p++;
+    } else {
+      DeriveOpCode code;
+      if (!binaryOp(*p, code)) {
+        return false;
+      }
+      // left associative; unary minus binds tighter than anything binary
+      while (opDepth > 0 && ops[opDepth - 1] != DERIVE_CONST &&
+             precedence(ops[opDepth - 1]) >= precedence(code)) {
+        DeriveOp op;
+        op.code = ops[--opDepth];
+        if (!emitter.emit(op)) {
+          return false;
+        }
+      }
+      if (opDepth >= DERIVE_MAX_OPS) {
+        return false;
+      }
+      ops[opDepth++] = code;
+      expectOperand = true;
+      p++;
+    }
+    p = skipSpaces(p);
+  }
+
+  if (expectOperand) {
+    return false;
+  }
+  while (opDepth > 0) {
+    DeriveOp op;
+    op.code = ops[--opDepth];
+    if (op.code == DERIVE_CONST || !emitter.emit(op)) {
+      return false;
+    }
+  }
+  return emitter.depth == 1;
+}
@@ -0,0 +1,262 @@
+#pragma once
+
+#include <stdint.h>
+#include "fieldstore.h"
+
+constexpr uint8_t DERIVE_MAX_OPS = 16;
+constexpr uint8_t DERIVE_MAX_INPUTS = 6;
+constexpr uint8_t DERIVE_MAX_RATES = 2;
+constexpr uint8_t DERIVE_MAX_RULES = 12;
+constexpr uint8_t DERIVE_NO_FIELD = 0xFF;
+
+enum DeriveOpCode : uint8_t {
+  DERIVE_CONST = 0,
+  DERIVE_FIELD,
+  DERIVE_RATE,   // change of a field per second between its last two samples
+  DERIVE_ADD,
+  DERIVE_SUB,
+  DERIVE_MUL,
+  DERIVE_DIV,
+  DERIVE_LT,
+  DERIVE_GT,
+  DERIVE_NEG
+};
+
+struct DeriveOp {
+  DeriveOpCode code = DERIVE_CONST;
+  uint8_t field = 0;
+  float value = 0.0f;
+};
+
+// One formula in postfix form, e.g. "voltage * current / 1000" becomes
+// voltage current * 1000 /.
+struct DeriveFormula {
+  uint8_t target = DERIVE_NO_FIELD;
+  DeriveOp ops[DERIVE_MAX_OPS];
+  uint8_t opCount = 0;
+};
+
+// maps a field name to its index; false if unknown
+typedef bool (*DeriveLookup)(void* context, const char* name, uint8_t& field);
+
+// Infix formula with numbers, field names, + - * /, < and > (1 or 0),
+// unary minus, parentheses and rate(<field>). False on a syntax error, an
+// unknown field or a formula that does not fit DERIVE_MAX_OPS.
+bool compileFormula(const char* text, DeriveLookup lookup, void* context, DeriveFormula& out);
+
+// Derived fields as a dependency graph over a FieldStore. Rules run in
+// dependency order, and a rule is only evaluated when the change sequence of
+// one of its inputs has moved since its last run. Otherwise the previous
+// result is just refreshed, so a derived field stays fresh exactly as long
+// as its inputs do. A rule never overrides a fresh value from the vehicle
+// for a field that is also measured.
+template <uint8_t N>
+class DeriveEngine {
+public:
+  // measured[field]: the field also has a measured source. Returns the
+  // number of rules dropped because they form a dependency cycle.
+  uint8_t build(const DeriveFormula* formulas, uint8_t count, const bool* measured)
+  {
+    m_ruleCount = 0;
+    m_evaluations = 0;
+    if (count > DERIVE_MAX_RULES) {
+      count = DERIVE_MAX_RULES;
+    }
+    // Kahn's algorithm: place a rule once no unplaced rule produces one of its inputs
+    bool placed[DERIVE_MAX_RULES] = {false};
+    bool progress = true;
+    while (progress) {
+      progress = false;
+      for (uint8_t i = 0; i < count; i++) {
+        if (placed[i] || formulas[i].target >= N) {
+          continue;
+        }
+        bool ready = true;
+        for (uint8_t j = 0; j < count && ready; j++) {
+          ready = j == i || placed[j] || !usesField(formulas[i], formulas[j].target);
+        }
+        if (ready) {
+          placed[i] = true;
+          addRule(formulas[i], measured && measured[formulas[i].target]);
+          progress = true;
+        }
+      }
+    }
+    uint8_t dropped = 0;
+    for (uint8_t i = 0; i < count; i++) {
+      if (!placed[i] && formulas[i].target < N) {
+        dropped++;
+      }
+    }
+    return dropped;
+  }
+
+  void evaluate(FieldStore<N>& fields, uint32_t nowMs)
+  {
+    for (uint8_t r = 0; r < m_ruleCount; r++) {
+      Rule& rule = m_rules[r];
+      bool changed = false;
+      bool ready = true;
+      for (uint8_t i = 0; i < rule.inputCount && ready; i++) {
+        ready = fields.valid(rule.inputs[i], nowMs);
+        changed |= fields.changedSince(rule.inputs[i], rule.seenSeq);
+      }
+      if (!ready) {
+        continue;
+      }
+      uint8_t target = rule.formula->target;
+      bool owned = rule.writtenMs && fields.sampleMs(target) == rule.writtenMs;
+      if (rule.measured && !owned && fields.valid(target, nowMs)) {
+        // the vehicle's own value wins while it is fresh
+        continue;
+      }
+      if (!changed) {
+        if (owned) {
+          fields.set(target, fields.value(target), nowMs);
+          rule.writtenMs = nowMs;
+        }
+        continue;
+      }
+      rule.seenSeq = fields.sequence();
+      float value = 0.0f;
+      m_evaluations++;
+      if (run(rule, fields, value)) {
+        fields.set(target, value, nowMs);
+        rule.writtenMs = nowMs;
+      }
+    }
+  }
+
+  uint8_t ruleCount() const { return m_ruleCount; }
+  uint32_t evaluations() const { return m_evaluations; }
+
+private:
+  struct RateState {
+    uint8_t op = 0;
+    float value = 0.0f;
+    uint32_t sampleMs = 0;
+    bool valid = false;
+  };
+
+  struct Rule {
+    const DeriveFormula* formula = nullptr;
+    uint8_t inputs[DERIVE_MAX_INPUTS] = {0};
+    uint8_t inputCount = 0;
+    bool measured = false;
+    uint32_t seenSeq = 0;
+    uint32_t writtenMs = 0;
+    RateState rates[DERIVE_MAX_RATES];
+    uint8_t rateCount = 0;
+  };
+
+  static bool usesField(const DeriveFormula& formula, uint8_t field)
+  {
+    for (uint8_t i = 0; i < formula.opCount; i++) {
+      const DeriveOp& op = formula.ops[i];
+      if ((op.code == DERIVE_FIELD || op.code == DERIVE_RATE) && op.field == field) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void addRule(const DeriveFormula& formula, bool measured)
+  {
+    Rule& rule = m_rules[m_ruleCount++];
+    rule = Rule();
+    rule.formula = &formula;
+    rule.measured = measured;
+    for (uint8_t i = 0; i < formula.opCount; i++) {
+      const DeriveOp& op = formula.ops[i];
+      if (op.code != DERIVE_FIELD && op.code != DERIVE_RATE) {
+        continue;
+      }
+      bool known = false;
+      for (uint8_t k = 0; k < rule.inputCount && !known; k++) {
+        known = rule.inputs[k] == op.field;
+      }
+      if (!known && rule.inputCount < DERIVE_MAX_INPUTS) {
+        rule.inputs[rule.inputCount++] = op.field;
+      }
+      if (op.code == DERIVE_RATE && rule.rateCount < DERIVE_MAX_RATES) {
+        rule.rates[rule.rateCount++].op = i;
+      }
+    }
+  }
+
+  bool rate(Rule& rule, uint8_t opIndex, const FieldStore<N>& fields, float& out)
+  {
+    for (uint8_t i = 0; i < rule.rateCount; i++) {
+      RateState& state = rule.rates[i];
+      if (state.op != opIndex) {
+        continue;
+      }
+      uint8_t field = rule.formula->ops[opIndex].field;
+      float value = fields.value(field);
+      uint32_t sampleMs = fields.sampleMs(field);
+      bool ok = state.valid && sampleMs != state.sampleMs;
+      if (ok) {
+        out = (value - state.value) * 1000.0f / static_cast<float>(sampleMs - state.sampleMs);
+      }
+      state.value = value;
+      state.sampleMs = sampleMs;
+      state.valid = true;
+      return ok;
+    }
+    return false;
+  }
+
+  bool run(Rule& rule, const FieldStore<N>& fields, float& out)
+  {
+    float stack[DERIVE_MAX_OPS];
+    uint8_t depth = 0;
+    bool ok = true;
+    const DeriveFormula& formula = *rule.formula;
+    for (uint8_t i = 0; i < formula.opCount; i++) {
+      const DeriveOp& op = formula.ops[i];
+      switch (op.code) {
+        case DERIVE_CONST:
+          stack[depth++] = op.value;
+          break;
+        case DERIVE_FIELD:
+          stack[depth++] = fields.value(op.field);
+          break;
+        case DERIVE_RATE:
+          // every rate op runs so its previous sample stays current
+          stack[depth] = 0.0f;
+          ok &= rate(rule, i, fields, stack[depth]);
+          depth++;
+          break;
+        case DERIVE_NEG:
+          stack[depth - 1] = -stack[depth - 1];
+          break;
+        default: {
+          float b = stack[--depth];
+          float& a = stack[depth - 1];
+          switch (op.code) {
+            case DERIVE_ADD: a += b; break;
+            case DERIVE_SUB: a -= b; break;
+            case DERIVE_MUL: a *= b; break;
+            case DERIVE_DIV:
+              if (b == 0.0f) {
+                ok = false;
+              } else {
+                a /= b;
+              }
+              break;
+            case DERIVE_LT: a = a < b ? 1.0f : 0.0f; break;
+            case DERIVE_GT: a = a > b ? 1.0f : 0.0f; break;
+            default: break;
+          }
+          break;
+        }
+      }
+    }
+    out = stack[0];
+    return ok && depth == 1;
+  }
+
+  Rule m_rules[DERIVE_MAX_RULES];
+  uint8_t m_ruleCount = 0;
+  uint32_t m_evaluations = 0;
+};
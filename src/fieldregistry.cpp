@@ -0,0 +1,161 @@
+#include "fieldregistry.h"
+#include <string.h>
+
+namespace {
+struct FieldInfo {
+  AbrpField field;
+  const char* name;
+  bool isInteger;
+};
+
+// one entry per AbrpField, in enum order
+constexpr FieldInfo kBuiltinFields[] = {
+  {ABRP_FIELD_UTC, "utc", true},
+  {ABRP_FIELD_SOC, "soc", false},
+  {ABRP_FIELD_POWER, "power", false},
+  {ABRP_FIELD_SPEED, "speed", false},
+  {ABRP_FIELD_LAT, "lat", false},
+  {ABRP_FIELD_LON, "lon", false},
+  {ABRP_FIELD_IS_CHARGING, "is_charging", true},
+  {ABRP_FIELD_IS_DCFC, "is_dcfc", true},
+  {ABRP_FIELD_IS_PARKED, "is_parked", true},
+  {ABRP_FIELD_CAPACITY, "capacity", false},
+  {ABRP_FIELD_KWH_CHARGED, "kwh_charged", false},
+  {ABRP_FIELD_SOH, "soh", false},
+  {ABRP_FIELD_HEADING, "heading", false},
+  {ABRP_FIELD_ELEVATION, "elevation", false},
+  {ABRP_FIELD_EXT_TEMP, "ext_temp", false},
+  {ABRP_FIELD_BATT_TEMP, "batt_temp", false},
+  {ABRP_FIELD_VOLTAGE, "voltage", false},
+  {ABRP_FIELD_CURRENT, "current", false},
+  {ABRP_FIELD_ODOMETER, "odometer", false},
+  {ABRP_FIELD_EST_BATTERY_RANGE, "est_battery_range", false},
+};
+
+static_assert(sizeof(kBuiltinFields) / sizeof(kBuiltinFields[0]) == ABRP_FIELD_COUNT,
+              "kBuiltinFields needs one entry per AbrpField");
+
+constexpr bool inEnumOrder(uint8_t i)
+{
+  return i >= ABRP_FIELD_COUNT || (kBuiltinFields[i].field == i && inEnumOrder(i + 1));
+}
+static_assert(inEnumOrder(0), "kBuiltinFields must follow the AbrpField order");
+
+// Perfect hash: FNV-1a with a seed, masked to kSlotCount slots. The compiler
+// tries seeds until no two built-in names share a slot, so a lookup is one
+// hash, one table read and one strcmp.
+constexpr uint8_t kSlotCount = 64;
+
+constexpr uint32_t fnv1a(const char* s, uint32_t hash)
+{
+  return *s ? fnv1a(s + 1, (hash ^ static_cast<uint8_t>(*s)) * 16777619u) : hash;
+}
+
+constexpr uint8_t slotOf(const char* name, uint32_t seed)
+{
+  return static_cast<uint8_t>(fnv1a(name, 2166136261u ^ seed) & (kSlotCount - 1));
+}
+
+constexpr bool distinctFrom(uint32_t seed, uint8_t i, uint8_t j)
+{
+  return j >= ABRP_FIELD_COUNT ||
+         (slotOf(kBuiltinFields[i].name, seed) != slotOf(kBuiltinFields[j].name, seed) && distinctFrom(seed, i, j + 1));
+}
+
+constexpr bool collisionFree(uint32_t seed, uint8_t i)
+{
+  return i >= ABRP_FIELD_COUNT || (distinctFrom(seed, i, i + 1) && collisionFree(seed, i + 1));
+}
+
+constexpr uint32_t findSeed(uint32_t seed)
+{
+  return collisionFree(seed, 0) ? seed : findSeed(seed + 1);
+}
+
+constexpr uint32_t kSeed = findSeed(0);
+
+constexpr uint8_t fieldInSlot(uint8_t slot, uint8_t i)
+{
+  return i >= ABRP_FIELD_COUNT ? ABRP_NO_FIELD
+         : slotOf(kBuiltinFields[i].name, kSeed) == slot ? i
+         : fieldInSlot(slot, i + 1);
+}
+
+#define FIELD_SLOTS8(n) \
+  fieldInSlot(n, 0), fieldInSlot(n + 1, 0), fieldInSlot(n + 2, 0), fieldInSlot(n + 3, 0), \
+  fieldInSlot(n + 4, 0), fieldInSlot(n + 5, 0), fieldInSlot(n + 6, 0), fieldInSlot(n + 7, 0)
+
+constexpr uint8_t kSlots[kSlotCount] = {
+  FIELD_SLOTS8(0), FIELD_SLOTS8(8), FIELD_SLOTS8(16), FIELD_SLOTS8(24),
+  FIELD_SLOTS8(32), FIELD_SLOTS8(40), FIELD_SLOTS8(48), FIELD_SLOTS8(56),
+};
+
+#undef FIELD_SLOTS8
+
+bool validCustomName(const char* name)
+{
+  size_t len = strlen(name);
+  if (len == 0 || len >= ABRP_FIELD_NAME_LENGTH) {
+    return false;
+  }
+  for (size_t i = 0; i < len; i++) {
+    char c = name[i];
+    if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_')) {
+      return false;
+    }
+  }
+  return true;
+}
+}
+
+uint8_t FieldRegistry::findBuiltin(const char* name)
+{
+  uint8_t field = kSlots[slotOf(name, kSeed)];
+  if (field != ABRP_NO_FIELD && strcmp(kBuiltinFields[field].name, name) == 0) {
+    return field;
+  }
+  return ABRP_NO_FIELD;
+}
+
+uint8_t FieldRegistry::find(const char* name) const
+{
+  uint8_t field = findBuiltin(name);
+  if (field != ABRP_NO_FIELD) {
+    return field;
+  }
+  for (uint8_t i = 0; i < m_customCount; i++) {
+    if (strcmp(m_custom[i], name) == 0) {
+      return static_cast<uint8_t>(ABRP_FIELD_COUNT + i);
+    }
+  }
+  return ABRP_NO_FIELD;
+}
+
+uint8_t FieldRegistry::add(const char* name)
+{
+  uint8_t field = find(name);
+  if (field != ABRP_NO_FIELD) {
+    return field;
+  }
+  if (m_customCount >= ABRP_MAX_CUSTOM_FIELDS || !validCustomName(name)) {
+    return ABRP_NO_FIELD;
+  }
+  strcpy(m_custom[m_customCount], name);
+  return static_cast<uint8_t>(ABRP_FIELD_COUNT + m_customCount++);
+}
+
+const char* FieldRegistry::name(uint8_t field) const
+{
+  if (field < ABRP_FIELD_COUNT) {
+    return kBuiltinFields[field].name;
+  }
+  if (field < count()) {
+    return m_custom[field - ABRP_FIELD_COUNT];
+  }
+  return "";
+}
+
+bool FieldRegistry::isInteger(uint8_t field) const
+{
+  return field < ABRP_FIELD_COUNT && kBuiltinFields[field].isInteger;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+
+enum AbrpField : uint8_t {
+  ABRP_FIELD_UTC = 0,
+  ABRP_FIELD_SOC,
+  ABRP_FIELD_POWER,
+  ABRP_FIELD_SPEED,
+  ABRP_FIELD_LAT,
+  ABRP_FIELD_LON,
+  ABRP_FIELD_IS_CHARGING,
+  ABRP_FIELD_IS_DCFC,
+  ABRP_FIELD_IS_PARKED,
+  ABRP_FIELD_CAPACITY,
+  ABRP_FIELD_KWH_CHARGED,
+  ABRP_FIELD_SOH,
+  ABRP_FIELD_HEADING,
+  ABRP_FIELD_ELEVATION,
+  ABRP_FIELD_EXT_TEMP,
+  ABRP_FIELD_BATT_TEMP,
+  ABRP_FIELD_VOLTAGE,
+  ABRP_FIELD_CURRENT,
+  ABRP_FIELD_ODOMETER,
+  ABRP_FIELD_EST_BATTERY_RANGE,
+  ABRP_FIELD_COUNT
+};
+
+// Custom fields from OBD-OPT lines follow the built-in ones, so a field index
+// is below ABRP_FIELD_COUNT + the number of registered custom fields.
+constexpr uint8_t ABRP_MAX_CUSTOM_FIELDS = 12;
+constexpr uint8_t ABRP_MAX_FIELDS = ABRP_FIELD_COUNT + ABRP_MAX_CUSTOM_FIELDS;
+constexpr uint8_t ABRP_NO_FIELD = 0xFF;
+constexpr uint8_t ABRP_FIELD_NAME_LENGTH = 24;
+
+// Names of all fields. Built-in names resolve through a perfect hash built at
+// compile time; custom names are registered while obd.cfg is parsed.
+class FieldRegistry {
+public:
+  // ABRP_NO_FIELD if the name is unknown
+  uint8_t find(const char* name) const;
+  // registers a custom field (lower case letters, digits and '_'), or returns
+  // the field that already has this name; ABRP_NO_FIELD if the name is
+  // invalid or the registry is full
+  uint8_t add(const char* name);
+  const char* name(uint8_t field) const;
+  // logged as an integer rather than with decimals (utc and the 1/0 flags)
+  bool isInteger(uint8_t field) const;
+  uint8_t count() const { return ABRP_FIELD_COUNT + m_customCount; }
+  uint8_t customCount() const { return m_customCount; }
+
+  static uint8_t findBuiltin(const char* name);
+
+private:
+  char m_custom[ABRP_MAX_CUSTOM_FIELDS][ABRP_FIELD_NAME_LENGTH] = {};
+  uint8_t m_customCount = 0;
+};
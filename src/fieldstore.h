@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+
+// Latest value of each field with the time it was sampled and the change
+// sequence number at which it last changed. The store-wide sequence only
+// moves when a value actually changes, so a consumer that remembers it can
+// ask for just the fields that changed since (changedSince). A field whose
+// sample is older than its maxAge is stale and no longer counts as valid;
+// maxAge 0 never goes stale (once-per-trip values).
+template <uint8_t N>
+class FieldStore {
+public:
+  void clear()
+  {
+    for (uint8_t i = 0; i < N; i++) {
+      m_fields[i].valid = false;
+      m_fields[i].seq = 0;
+    }
+    m_seq = 0;
+  }
+
+  void setMaxAge(uint8_t field, uint32_t maxAgeMs)
+  {
+    if (field < N) {
+      m_fields[field].maxAgeMs = maxAgeMs;
+    }
+  }
+
+  // true if the value differs from the previous sample
+  bool set(uint8_t field, float value, uint32_t nowMs)
+  {
+    if (field >= N) {
+      return false;
+    }
+    Field& f = m_fields[field];
+    bool changed = !f.valid || f.value != value;
+    f.value = value;
+    f.sampleMs = nowMs;
+    f.valid = true;
+    if (changed) {
+      f.seq = ++m_seq;
+    }
+    return changed;
+  }
+
+  // sampled and not stale
+  bool valid(uint8_t field, uint32_t nowMs) const
+  {
+    if (field >= N || !m_fields[field].valid) {
+      return false;
+    }
+    const Field& f = m_fields[field];
+    // a sample taken after nowMs was read is fresh, not 49 days old
+    return f.maxAgeMs == 0 || static_cast<int32_t>(nowMs - f.sampleMs) <= static_cast<int32_t>(f.maxAgeMs);
+  }
+
+  float value(uint8_t field) const { return field < N ? m_fields[field].value : 0.0f; }
+  uint32_t sampleMs(uint8_t field) const { return field < N ? m_fields[field].sampleMs : 0; }
+  uint32_t changeSeq(uint8_t field) const { return field < N ? m_fields[field].seq : 0; }
+  // sequence of the latest change to any field
+  uint32_t sequence() const { return m_seq; }
+  bool changedSince(uint8_t field, uint32_t seq) const { return field < N && m_fields[field].seq > seq; }
+
+private:
+  struct Field {
+    float value = 0.0f;
+    uint32_t sampleMs = 0;
+    uint32_t seq = 0;
+    uint32_t maxAgeMs = 0;
+    bool valid = false;
+  };
+
+  Field m_fields[N];
+  uint32_t m_seq = 0;
+};
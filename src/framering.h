@@ -0,0 +1,43 @@
+#pragma once
+
+#include <atomic>
+#include "isotp.h"
+
+// Lock-free single-producer/single-consumer ring of CAN frames. The CAN
+// receive task pushes, the main loop pops; neither side ever blocks.
+template <uint16_t N>
+class FrameRing {
+  static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+public:
+  bool push(const UdsFrame& frame)
+  {
+    uint16_t head = m_head.load(std::memory_order_relaxed);
+    uint16_t next = (head + 1) & (N - 1);
+    if (next == m_tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    m_frames[head] = frame;
+    m_head.store(next, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(UdsFrame& frame)
+  {
+    uint16_t tail = m_tail.load(std::memory_order_relaxed);
+    if (tail == m_head.load(std::memory_order_acquire)) {
+      return false;
+    }
+    frame = m_frames[tail];
+    m_tail.store((tail + 1) & (N - 1), std::memory_order_release);
+    return true;
+  }
+
+  // consumer side only
+  void clear() { m_tail.store(m_head.load(std::memory_order_acquire), std::memory_order_release); }
+
+private:
+  UdsFrame m_frames[N];
+  std::atomic<uint16_t> m_head{0};
+  std::atomic<uint16_t> m_tail{0};
+};
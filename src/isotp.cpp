@@ -0,0 +1,354 @@
+#include "isotp.h"
+
+namespace {
+constexpr uint8_t kIsoTpSingleFrame = 0x0;
+constexpr uint8_t kIsoTpFirstFrame = 0x1;
+constexpr uint8_t kIsoTpConsecutiveFrame = 0x2;
+constexpr uint8_t kIsoTpFlowControl = 0x3;
+
+constexpr uint8_t kFlowContinue = 0x0;
+constexpr uint8_t kFlowWait = 0x1;
+
+constexpr uint8_t kIsoTpLenMask = 0x0F;
+
+bool expired(uint32_t nowUs, uint32_t deadlineUs)
+{
+  return static_cast<int32_t>(nowUs - deadlineUs) >= 0;
+}
+}
+
+// 0x00-0x7F are milliseconds, 0xF1-0xF9 are 100-900 us; reserved values must be
+// treated as the longest valid separation (127 ms).
+uint32_t isoTpDecodeStMin(uint8_t stMin)
+{
+  if (stMin <= 0x7F) {
+    return static_cast<uint32_t>(stMin) * 1000;
+  }
+  if (stMin >= 0xF1 && stMin <= 0xF9) {
+    return static_cast<uint32_t>(stMin - 0xF0) * 100;
+  }
+  return 127000;
+}
+
+uint8_t isoTpEncodeStMin(uint32_t us)
+{
+  if (us == 0) {
+    return 0;
+  }
+  if (us < 1000) {
+    uint32_t steps = (us + 99) / 100;
+    // 901-999 us round up to 1 ms; 0xFA is reserved and read as 127 ms
+    return steps > 9 ? 0x01 : static_cast<uint8_t>(0xF0 + steps);
+  }
+  uint32_t ms = (us + 999) / 1000;
+  return static_cast<uint8_t>(ms > 0x7F ? 0x7F : ms);
+}
+
+bool IsoTpSession::start(IsoTpLink* link,
+                         uint32_t txId, bool txExtended,
+                         uint32_t rxId, bool rxExtended,
+                         const uint8_t* payload, uint16_t payloadLen,
+                         uint8_t* response, uint16_t responseCapacity,
+                         const IsoTpParams& params,
+                         uint32_t nowUs, uint32_t timeoutUs)
+{
+  if (busy() || !link || payloadLen == 0 || payloadLen > sizeof(m_tx)) {
+    return false;
+  }
+
+  setup(link, txId, txExtended, rxId, rxExtended, response, responseCapacity, params, timeoutUs);
+  memcpy(m_tx, payload, payloadLen);
+  m_txLen = payloadLen;
+
+  uint8_t frame[8] = {0};
+  if (payloadLen <= 7) {
+    frame[0] = (kIsoTpSingleFrame << 4) | (payloadLen & kIsoTpLenMask);
+    memcpy(frame + 1, m_tx, payloadLen);
+    if (!send(frame, 1 + payloadLen)) {
+      return false;
+    }
+    m_state = ISOTP_WAIT_RX;
+  } else {
+    frame[0] = (kIsoTpFirstFrame << 4) | ((payloadLen >> 8) & kIsoTpLenMask);
+    frame[1] = payloadLen & 0xFF;
+    memcpy(frame + 2, m_tx, 6);
+    if (!send(frame, 8)) {
+      return false;
+    }
+    m_txOffset = 6;
+    m_txSeq = 1;
+    m_state = ISOTP_WAIT_FC;
+  }
+  arm(nowUs);
+  return true;
+}
+
+bool IsoTpSession::listen(IsoTpLink* link,
+                          uint32_t txId, bool txExtended,
+                          uint32_t rxId, bool rxExtended,
+                          uint8_t* response, uint16_t responseCapacity,
+                          const IsoTpParams& params,
+                          uint32_t nowUs, uint32_t timeoutUs)
+{
+  if (busy() || !link) {
+    return false;
+  }
+  setup(link, txId, txExtended, rxId, rxExtended, response, responseCapacity, params, timeoutUs);
+  m_state = ISOTP_WAIT_RX;
+  arm(nowUs);
+  return true;
+}
+
+void IsoTpSession::setup(IsoTpLink* link,
+                         uint32_t txId, bool txExtended,
+                         uint32_t rxId, bool rxExtended,
+                         uint8_t* response, uint16_t responseCapacity,
+                         const IsoTpParams& params, uint32_t timeoutUs)
+{
+  reset();
+  m_link = link;
+  m_txId = txId;
+  m_txExtended = txExtended;
+  m_rxId = rxId;
+  m_rxExtended = rxExtended;
+  m_params = params;
+  m_timeoutUs = timeoutUs;
+  m_rx = response;
+  m_rxCapacity = response ? responseCapacity : 0;
+}
+
+void IsoTpSession::reset()
+{
+  m_state = ISOTP_IDLE;
+  m_txLen = 0;
+  m_txOffset = 0;
+  m_txSeq = 0;
+  m_blockSize = 0;
+  m_sentInBlock = 0;
+  m_waitFrames = 0;
+  m_stMinUs = 0;
+  m_rxLen = 0;
+  m_rxCopied = 0;
+  m_rxSeq = 0;
+  m_rxBlockCount = 0;
+}
+
+bool IsoTpSession::send(const uint8_t* data, uint8_t len)
+{
+  UdsFrame frame;
+  frame.id = m_txId;
+  frame.extended = m_txExtended;
+  frame.len = len;
+  memcpy(frame.data, data, len);
+  return m_link->sendFrame(frame);
+}
+
+bool IsoTpSession::sendFlowControl()
+{
+  uint8_t fc[3] = {static_cast<uint8_t>((kIsoTpFlowControl << 4) | kFlowContinue),
+                   m_params.blockSize, m_params.stMin};
+  return send(fc, sizeof(fc));
+}
+
+bool IsoTpSession::txDueWithin(uint32_t nowUs, uint32_t windowUs, uint32_t& waitUs) const
+{
+  if (m_state != ISOTP_SEND_CF) {
+    return false;
+  }
+  int32_t remaining = static_cast<int32_t>(m_nextCfUs - nowUs);
+  if (remaining > static_cast<int32_t>(windowUs)) {
+    return false;
+  }
+  waitUs = remaining > 0 ? static_cast<uint32_t>(remaining) : 0;
+  return true;
+}
+
+bool IsoTpSession::awaitResponse(uint32_t nowUs, uint32_t timeoutUs)
+{
+  if (m_state != ISOTP_DONE) {
+    return false;
+  }
+  m_rxLen = 0;
+  m_rxCopied = 0;
+  m_rxSeq = 0;
+  m_rxBlockCount = 0;
+  m_timeoutUs = timeoutUs;
+  m_state = ISOTP_WAIT_RX;
+  arm(nowUs);
+  return true;
+}
+
+bool IsoTpSession::onFrame(const UdsFrame& frame, uint32_t nowUs)
+{
+  if (!busy() || frame.id != m_rxId || frame.extended != m_rxExtended || frame.len == 0) {
+    return false;
+  }
+
+  switch (m_state) {
+    case ISOTP_WAIT_FC:
+    case ISOTP_SEND_CF:
+      handleFlowControl(frame, nowUs);
+      break;
+    case ISOTP_WAIT_RX:
+    case ISOTP_RECV_CF:
+      handleResponse(frame, nowUs);
+      break;
+    default:
+      break;
+  }
+  return true;
+}
+
+void IsoTpSession::poll(uint32_t nowUs)
+{
+  if (!busy()) {
+    return;
+  }
+  if (m_state == ISOTP_SEND_CF) {
+    sendConsecutiveFrames(nowUs);
+  }
+  if (busy() && expired(nowUs, m_deadlineUs)) {
+    fail();
+  }
+}
+
+void IsoTpSession::handleFlowControl(const UdsFrame& frame, uint32_t nowUs)
+{
+  if (m_state != ISOTP_WAIT_FC || frame.len < 3 || (frame.data[0] >> 4) != kIsoTpFlowControl) {
+    return;
+  }
+
+  uint8_t flowStatus = frame.data[0] & kIsoTpLenMask;
+  if (flowStatus == kFlowWait) {
+    if (++m_waitFrames > m_params.maxWaitFrames) {
+      fail();
+      return;
+    }
+    arm(nowUs);
+    return;
+  }
+  if (flowStatus != kFlowContinue) {
+    fail();
+    return;
+  }
+
+  m_blockSize = frame.data[1];
+  m_stMinUs = isoTpDecodeStMin(frame.data[2]);
+  if (m_stMinUs < m_params.minTxSeparationUs) {
+    m_stMinUs = m_params.minTxSeparationUs;
+  }
+  m_sentInBlock = 0;
+  m_waitFrames = 0;
+  m_nextCfUs = nowUs;
+  m_state = ISOTP_SEND_CF;
+  arm(nowUs);
+  sendConsecutiveFrames(nowUs);
+}
+
+void IsoTpSession::sendConsecutiveFrames(uint32_t nowUs)
+{
+  while (m_state == ISOTP_SEND_CF && expired(nowUs, m_nextCfUs)) {
+    uint8_t frame[8] = {0};
+    frame[0] = (kIsoTpConsecutiveFrame << 4) | (m_txSeq & kIsoTpLenMask);
+    uint16_t copyLen = m_txLen - m_txOffset;
+    if (copyLen > 7) {
+      copyLen = 7;
+    }
+    memcpy(frame + 1, m_tx + m_txOffset, copyLen);
+    if (!send(frame, static_cast<uint8_t>(copyLen + 1))) {
+      // TX queue full, retry on the next poll
+      return;
+    }
+    m_txOffset += copyLen;
+    m_txSeq = (m_txSeq + 1) & kIsoTpLenMask;
+    m_nextCfUs = nowUs + m_stMinUs;
+    arm(nowUs);
+
+    if (m_txOffset >= m_txLen) {
+      m_state = ISOTP_WAIT_RX;
+      return;
+    }
+    if (m_blockSize > 0 && ++m_sentInBlock >= m_blockSize) {
+      m_state = ISOTP_WAIT_FC;
+      return;
+    }
+    if (m_stMinUs) {
+      return;
+    }
+  }
+}
+
+void IsoTpSession::handleResponse(const UdsFrame& frame, uint32_t nowUs)
+{
+  uint8_t frameType = frame.data[0] >> 4;
+
+  if (m_state == ISOTP_RECV_CF) {
+    if (frameType != kIsoTpConsecutiveFrame) {
+      return;
+    }
+    if ((frame.data[0] & kIsoTpLenMask) != m_rxSeq) {
+      fail();
+      return;
+    }
+    uint16_t copyLen = frame.len - 1;
+    if (m_rxCopied + copyLen > m_rxLen) {
+      copyLen = m_rxLen - m_rxCopied;
+    }
+    memcpy(m_rx + m_rxCopied, frame.data + 1, copyLen);
+    m_rxCopied += copyLen;
+    m_rxSeq = (m_rxSeq + 1) & kIsoTpLenMask;
+    arm(nowUs);
+    if (m_rxCopied >= m_rxLen) {
+      m_state = ISOTP_DONE;
+      return;
+    }
+    if (m_params.blockSize > 0 && ++m_rxBlockCount >= m_params.blockSize) {
+      m_rxBlockCount = 0;
+      if (!sendFlowControl()) {
+        fail();
+      }
+    }
+    return;
+  }
+
+  if (frameType == kIsoTpSingleFrame) {
+    uint8_t len = frame.data[0] & kIsoTpLenMask;
+    if (len == 0 || len > 7 || len > frame.len - 1 || len > m_rxCapacity) {
+      fail();
+      return;
+    }
+    memcpy(m_rx, frame.data + 1, len);
+    m_rxLen = len;
+    m_state = ISOTP_DONE;
+    return;
+  }
+
+  if (frameType != kIsoTpFirstFrame || frame.len < 8) {
+    return;
+  }
+
+  // a 12-bit length of zero escapes to a 32-bit length in bytes 2-5
+  uint32_t totalLen = ((frame.data[0] & kIsoTpLenMask) << 8) | frame.data[1];
+  uint8_t dataStart = 2;
+  if (totalLen == 0) {
+    totalLen = (static_cast<uint32_t>(frame.data[2]) << 24) | (static_cast<uint32_t>(frame.data[3]) << 16) |
+               (static_cast<uint32_t>(frame.data[4]) << 8) | frame.data[5];
+    dataStart = 6;
+  }
+  if (totalLen <= 7 || totalLen > m_rxCapacity) {
+    fail();
+    return;
+  }
+  memcpy(m_rx, frame.data + dataStart, 8 - dataStart);
+  m_rxLen = static_cast<uint16_t>(totalLen);
+  m_rxCopied = 8 - dataStart;
+  m_rxSeq = 1;
+  m_rxBlockCount = 0;
+
+  if (!sendFlowControl()) {
+    fail();
+    return;
+  }
+  m_state = ISOTP_RECV_CF;
+  arm(nowUs);
+}
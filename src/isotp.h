@@ -0,0 +1,127 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+constexpr uint16_t ISOTP_MAX_TX_PAYLOAD = 64;
+
+struct UdsFrame {
+  uint32_t id = 0;
+  bool extended = false;
+  uint8_t len = 0;
+  uint8_t data[8] = {0};
+};
+
+// Per-ECU flow control settings. blockSize and stMin are what we advertise in
+// our own flow control frames (ISO 15765-2 encoding); minTxSeparationUs is a
+// floor applied to the ECU's STmin when we send consecutive frames to it.
+// maxWaitFrames (N_WFTmax) is how many FC.WAIT frames in a row the ECU may
+// send before the transfer is given up.
+struct IsoTpParams {
+  uint8_t blockSize = 0;
+  uint8_t stMin = 0;
+  uint32_t minTxSeparationUs = 0;
+  uint8_t maxWaitFrames = 10;
+};
+
+uint32_t isoTpDecodeStMin(uint8_t stMin);
+uint8_t isoTpEncodeStMin(uint32_t us);
+
+// Outbound side of an ISO-TP session. Implemented by UdsClient on the device
+// and by a fake frame sink when the session runs on a host.
+class IsoTpLink {
+public:
+  virtual ~IsoTpLink() {}
+  virtual bool sendFrame(const UdsFrame& frame) = 0;
+};
+
+enum IsoTpState : uint8_t {
+  ISOTP_IDLE = 0,
+  ISOTP_SEND_CF,
+  ISOTP_WAIT_FC,
+  ISOTP_WAIT_RX,
+  ISOTP_RECV_CF,
+  ISOTP_DONE,
+  ISOTP_FAILED
+};
+
+// One ISO 15765-2 request/response transaction as a sans-I/O state machine.
+// It is driven only by received frames (onFrame) and the clock (poll), and
+// never blocks or touches the CAN hardware itself. Times are microseconds.
+class IsoTpSession {
+public:
+  bool start(IsoTpLink* link,
+             uint32_t txId, bool txExtended,
+             uint32_t rxId, bool rxExtended,
+             const uint8_t* payload, uint16_t payloadLen,
+             uint8_t* response, uint16_t responseCapacity,
+             const IsoTpParams& params,
+             uint32_t nowUs, uint32_t timeoutUs);
+  // receive-only transaction: wait for a response on rxId that was requested
+  // elsewhere (functional addressing); flow control still goes to txId
+  bool listen(IsoTpLink* link,
+              uint32_t txId, bool txExtended,
+              uint32_t rxId, bool rxExtended,
+              uint8_t* response, uint16_t responseCapacity,
+              const IsoTpParams& params,
+              uint32_t nowUs, uint32_t timeoutUs);
+  bool onFrame(const UdsFrame& frame, uint32_t nowUs);
+  void poll(uint32_t nowUs);
+  void reset();
+  // true if a consecutive frame is due within windowUs; waitUs is the time left
+  bool txDueWithin(uint32_t nowUs, uint32_t windowUs, uint32_t& waitUs) const;
+  // discard a completed response and wait up to timeoutUs for the next one,
+  // e.g. after a UDS responsePending reply
+  bool awaitResponse(uint32_t nowUs, uint32_t timeoutUs);
+
+  IsoTpState state() const { return m_state; }
+  bool busy() const { return m_state != ISOTP_IDLE && m_state != ISOTP_DONE && m_state != ISOTP_FAILED; }
+  uint16_t responseLength() const { return m_state == ISOTP_DONE ? m_rxLen : 0; }
+  const uint8_t* response() const { return m_rx; }
+  // first payload byte sent (the UDS service id); 0 for a receive-only session
+  uint8_t requestSid() const { return m_txLen ? m_tx[0] : 0; }
+  uint32_t txId() const { return m_txId; }
+  uint32_t rxId() const { return m_rxId; }
+  bool rxExtended() const { return m_rxExtended; }
+
+private:
+  void setup(IsoTpLink* link,
+             uint32_t txId, bool txExtended,
+             uint32_t rxId, bool rxExtended,
+             uint8_t* response, uint16_t responseCapacity,
+             const IsoTpParams& params, uint32_t timeoutUs);
+  bool send(const uint8_t* data, uint8_t len);
+  bool sendFlowControl();
+  void sendConsecutiveFrames(uint32_t nowUs);
+  void handleFlowControl(const UdsFrame& frame, uint32_t nowUs);
+  void handleResponse(const UdsFrame& frame, uint32_t nowUs);
+  void fail() { m_state = ISOTP_FAILED; }
+  void arm(uint32_t nowUs) { m_deadlineUs = nowUs + m_timeoutUs; }
+
+  IsoTpLink* m_link = nullptr;
+  IsoTpState m_state = ISOTP_IDLE;
+  uint32_t m_txId = 0;
+  uint32_t m_rxId = 0;
+  bool m_txExtended = false;
+  bool m_rxExtended = false;
+  IsoTpParams m_params;
+  uint32_t m_timeoutUs = 0;
+  uint32_t m_deadlineUs = 0;
+
+  uint8_t m_tx[ISOTP_MAX_TX_PAYLOAD] = {0};
+  uint16_t m_txLen = 0;
+  uint16_t m_txOffset = 0;
+  uint8_t m_txSeq = 0;
+  uint8_t m_blockSize = 0;
+  uint8_t m_sentInBlock = 0;
+  uint8_t m_waitFrames = 0;
+  uint32_t m_stMinUs = 0;
+  uint32_t m_nextCfUs = 0;
+
+  uint8_t* m_rx = nullptr;
+  uint16_t m_rxCapacity = 0;
+  uint16_t m_rxLen = 0;
+  uint16_t m_rxCopied = 0;
+  uint8_t m_rxSeq = 0;
+  uint8_t m_rxBlockCount = 0;
+};
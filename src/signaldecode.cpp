@@ -0,0 +1,95 @@
+#include "signaldecode.h"
+
+namespace {
+bool finish(DecodeOp& op, uint16_t byteOffset, uint8_t byteCount, uint8_t shift, uint8_t width,
+            bool bigEndian, bool isSigned, float scale, float offset, uint8_t target)
+{
+  if (byteCount == 0 || byteCount > 8 || width == 0 || shift + width > byteCount * 8) {
+    return false;
+  }
+  op.byteOffset = byteOffset;
+  op.byteCount = byteCount;
+  op.shift = shift;
+  op.width = width;
+  op.flags = (bigEndian ? DECODE_BIG_ENDIAN : 0) | (isSigned ? DECODE_SIGNED : 0);
+  op.target = target;
+  op.scale = scale;
+  op.offset = offset;
+  return true;
+}
+}
+
+bool compileByteSignal(DecodeOp& op, uint16_t startByte, uint8_t length, uint8_t bit, uint8_t width,
+                       bool bigEndian, bool isSigned, float scale, float offset, uint8_t target)
+{
+  if (width == 0) {
+    width = static_cast<uint8_t>(length * 8 - bit);
+  }
+  return finish(op, startByte, length, bit, width, bigEndian, isSigned, scale, offset, target);
+}
+
+bool compileDbcSignal(DecodeOp& op, uint16_t startBit, uint8_t width,
+                      bool bigEndian, bool isSigned, float scale, float offset, uint8_t target)
+{
+  if (width == 0 || width > 64) {
+    return false;
+  }
+  uint16_t firstByte = startBit / 8;
+  uint8_t bitInByte = startBit % 8;
+  if (!bigEndian) {
+    // LSB at bitInByte of the first byte, higher bits in the following bytes
+    uint8_t bytes = static_cast<uint8_t>((bitInByte + width + 7) / 8);
+    return finish(op, firstByte, bytes, bitInByte, width, false, isSigned, scale, offset, target);
+  }
+  // MSB at bitInByte of the first byte, lower bits continue at bit 7 of the next
+  // bytes; read as a big-endian integer the field ends (bitInByte + 1) bits into it
+  uint8_t bytes = 1;
+  if (width > bitInByte + 1) {
+    bytes = static_cast<uint8_t>(1 + (width - bitInByte - 1 + 7) / 8);
+  }
+  if (bytes > 8) {
+    return false;
+  }
+  int lsb = (bytes - 1) * 8 + bitInByte - width + 1;
+  return finish(op, firstByte, bytes, static_cast<uint8_t>(lsb), width, true, isSigned, scale, offset, target);
+}
+
+bool decodeOne(const DecodeOp& op, const uint8_t* data, uint16_t len, float& value)
+{
+  if (op.byteOffset + op.byteCount > len) {
+    return false;
+  }
+  const uint8_t* p = data + op.byteOffset;
+  uint64_t raw = 0;
+  if (op.flags & DECODE_BIG_ENDIAN) {
+    for (uint8_t i = 0; i < op.byteCount; i++) {
+      raw = (raw << 8) | p[i];
+    }
+  } else {
+    for (uint8_t i = op.byteCount; i > 0; i--) {
+      raw = (raw << 8) | p[i - 1];
+    }
+  }
+  raw >>= op.shift;
+  uint8_t unused = static_cast<uint8_t>(64 - op.width);
+  if (op.flags & DECODE_SIGNED) {
+    // move the sign bit to bit 63 and shift back arithmetically
+    int64_t v = static_cast<int64_t>(raw << unused) >> unused;
+    value = static_cast<float>(v) * op.scale + op.offset;
+  } else {
+    raw = (raw << unused) >> unused;
+    value = static_cast<float>(raw) * op.scale + op.offset;
+  }
+  return true;
+}
+
+uint32_t decodeProgram(const DecodeOp* ops, uint8_t count, const uint8_t* data, uint16_t len, float* values)
+{
+  uint32_t decoded = 0;
+  for (uint8_t i = 0; i < count && i < 32; i++) {
+    if (decodeOne(ops[i], data, len, values[i])) {
+      decoded |= 1UL << i;
+    }
+  }
+  return decoded;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+enum DecodeFlags : uint8_t {
+  DECODE_BIG_ENDIAN = 1 << 0,
+  DECODE_SIGNED = 1 << 1
+};
+
+// One signal compiled at load time: read byteCount bytes (at most 8) at
+// byteOffset as an integer in the given byte order, shift right, keep width
+// bits, sign-extend if signed, then scale. Every layout the config can
+// describe reduces to this, so decoding is a straight-line pass with no
+// per-bit loop.
+struct DecodeOp {
+  uint16_t byteOffset = 0;
+  uint8_t byteCount = 0;
+  uint8_t shift = 0;
+  uint8_t width = 0;
+  uint8_t flags = 0;
+  uint8_t target = 0;    // caller's index, e.g. the AbrpField to set
+  float scale = 1.0f;
+  float offset = 0.0f;
+};
+
+// Whole-byte UDS layout: length bytes from startByte form one integer; bit/width
+// then select a field inside it counted from its LSB (width 0 = all of it).
+bool compileByteSignal(DecodeOp& op, uint16_t startByte, uint8_t length, uint8_t bit, uint8_t width,
+                       bool bigEndian, bool isSigned, float scale, float offset, uint8_t target);
+// DBC layout: bit n is bit n%8 of byte n/8; startBit is the LSB of Intel
+// (little-endian) signals and the MSB of Motorola (big-endian) ones.
+bool compileDbcSignal(DecodeOp& op, uint16_t startBit, uint8_t width,
+                      bool bigEndian, bool isSigned, float scale, float offset, uint8_t target);
+
+bool decodeOne(const DecodeOp& op, const uint8_t* data, uint16_t len, float& value);
+
+// Runs a program of ops over one buffer. values[i] is written for every op
+// that fits in len; returns a bit mask of those ops (programs are at most 32 long).
+uint32_t decodeProgram(const DecodeOp* ops, uint8_t count, const uint8_t* data, uint16_t len, float* values);
@@ -19,6 +19,7 @@
 #include <httpd.h>
 #include "config.h"
 #include "ABRP.h"
+#include "abrpupload.h"
 #include "SD-config.h"
 #include "telestore.h"
 #include "teleclient.h"
@@ -164,7 +165,9 @@ OLED_SH1106 oled;
 #endif
 
 State state;
+CanBusArbiter canBus;
 AbrpManager abrp;
+AbrpUploader abrpUploader;
 AbrpConfig abrpConfig;
 bool abrpConfigLoaded = false;
 
@@ -229,12 +232,23 @@ int handlerLiveData(UrlHandlerParam* param)
       n += snprintf(buf + n, bufsize - n, ",\"gps\":{\"utc\":\"%s\",\"lat\":%f,\"lng\":%f,\"alt\":%f,\"speed\":%f,\"sat\":%d,\"age\":%u}",
           isoTime, gd->lat, gd->lng, gd->alt, gd->speed, (int)gd->sat, (unsigned int)(millis() - gd->ts));
     }
+    if (n < bufsize - 2) {
+      // ?since=<seq> returns only the ABRP fields changed after that sequence
+      char *since = mwGetVarValue(param->pxVars, "since", 0);
+      buf[n++] = ',';
+      n += abrp.liveJson(buf + n, bufsize - n - 1, since ? strtoul(since, nullptr, 10) : 0);
+    }
     buf[n++] = '}';
     param->contentLength = n;
     param->contentType=HTTPFILETYPE_JSON;
     return FLAG_DATA_RAW;
 }
 
+int canStatsJson(char* buf, int bufsize)
+{
+    return abrp.uds().statsJson(buf, bufsize);
+}
+
 int handlerControl(UrlHandlerParam* param)
 {
     char *cmd = mwGetVarValue(param->pxVars, "cmd", 0);
@@ -279,8 +293,18 @@ void processOBD(CBuffer* buffer)
     }
     byte pid = obdData[i].pid;
     if (!obd.isValidPID(pid)) continue;
+    // wait for in-flight UDS transactions, which keep completing meanwhile
+    uint32_t waitStart = millis();
+    bool granted;
+    while (!(granted = canBus.request(CAN_CLIENT_OBD, OBD_BUS_PRIORITY)) && millis() - waitStart < OBD_BUS_WAIT) {
+      abrp.pollUds(millis());
+      delay(1);
+    }
+    if (!granted) break;
     int value;
-    if (obd.readPID(pid, value)) {
+    bool success = obd.readPID(pid, value);
+    canBus.release(CAN_CLIENT_OBD);
+    if (success) {
         obdData[i].ts = millis();
         obdData[i].value = value;
         buffer->add((uint16_t)pid | 0x100, ELEMENT_INT32, &value, sizeof(value));
@@ -554,8 +578,12 @@ void initialize()
 
   if (!abrpConfigLoaded) {
     loadAbrpConfig(abrpConfig);
+    abrp.setBusArbiter(&canBus);
     abrp.begin(abrpConfig);
+    abrpUploader.begin(abrpConfig.serverUrl, abrpConfig.userToken, abrpConfig.apiKey, abrpConfig.sendIntervalSec);
     abrpConfigLoaded = true;
+  } else {
+    abrp.startTrip();
   }
 #if STORAGE != STORAGE_NONE
   if (state.check(STATE_STORAGE_READY)) {
@@ -741,6 +769,8 @@ void process()
   // display file buffer stats
   if (startTime - lastStatsTime >= 3000) {
     bufman.printStats();
+    abrp.printStats();
+    abrpUploader.printStats();
     lastStatsTime = startTime;
   }
 
@@ -784,7 +814,10 @@ void process()
   dataInterval = dataIntervals[0];
 #endif
   do {
+    // keep UDS transactions and broadcast decoding moving while waiting for the next data interval
+    abrp.pollUds(millis());
     long t = dataInterval - (millis() - startTime);
+    if (abrp.needsService() && t > ABRP_SERVICE_INTERVAL) t = ABRP_SERVICE_INTERVAL;
     processBLE(t > 0 ? t : 0);
   } while (millis() - startTime < dataInterval);
 }
@@ -884,6 +917,7 @@ void telemetry(void* inst)
 
   for (;;) {
     if (state.check(STATE_STANDBY)) {
+      abrpUploader.setLink(nullptr);
       if (state.check(STATE_CELL_CONNECTED) || state.check(STATE_WIFI_CONNECTED)) {
         teleClient.shutdown();
         netop = "";
@@ -993,6 +1027,12 @@ void telemetry(void* inst)
 #endif
       }
 
+      // ABRP records go out on their own keep-alive connection over the same link
+#if ENABLE_WIFI
+      abrpUploader.setLink(state.check(STATE_WIFI_CONNECTED) ? defaultUploadLink() : nullptr);
+#endif
+      abrpUploader.poll(abrp, millis());
+
       // get data from buffer
       CBuffer* buffer = bufman.getNewest();
       if (!buffer) {
@@ -1322,6 +1362,25 @@ void processBLE(int timeout)
         n += snprintf(buf + n, bufsize - n, "N/A");
       }
     }
+  } else if (!strcmp(cmd, "CAN_LOAD")) {
+    n += snprintf(buf + n, bufsize - n, "%.1f", abrp.uds().busLoad().loadPercent);
+  } else if (!strcmp(cmd, "CAN_RATE")) {
+    n += snprintf(buf + n, bufsize - n, "%u/%u", abrp.uds().busLoad().rxPerSecond, abrp.uds().busLoad().txPerSecond);
+  } else if (!strcmp(cmd, "CAN_QHW")) {
+    n += snprintf(buf + n, bufsize - n, "%u", (unsigned int)abrp.uds().stats().rxQueueHigh);
+  } else if (!strncmp(cmd, "CAN_LAT=", 8)) {
+    // CAN_LAT=<txId>:<did>, both hex; replies p50/p90/p99 in microseconds
+    char* sep = strchr(cmd + 8, ':');
+    uint32_t txId = strtoul(cmd + 8, 0, 16);
+    uint16_t did = sep ? strtoul(sep + 1, 0, 16) : 0;
+    uint32_t p50, p90, p99;
+    if (sep && abrp.uds().latencyPercentile(txId, did, 50, p50)) {
+      abrp.uds().latencyPercentile(txId, did, 90, p90);
+      abrp.uds().latencyPercentile(txId, did, 99, p99);
+      n += snprintf(buf + n, bufsize - n, "%u/%u/%u", (unsigned int)p50, (unsigned int)p90, (unsigned int)p99);
+    } else {
+      n += snprintf(buf + n, bufsize - n, "N/A");
+    }
   } else if (!strcmp(cmd, "VIN")) {
     n += snprintf(buf + n, bufsize - n, "%s", vin[0] ? vin : "N/A");
   } else if (!strcmp(cmd, "LAT") && gd) {
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+// Where AbrpUploader gets its records from: AbrpManager on the device, a fake
+// in host tests. Both calls may come from another task than the one updating
+// the fields.
+class TlmSource {
+public:
+  virtual ~TlmSource() {}
+  // ABRP tlm object as JSON, <= 0 if there is none yet; *sequence gets the
+  // field sequence the record was built from
+  virtual int tlmJson(char* buffer, int bufferSize, uint32_t nowMs, uint32_t* sequence = nullptr) const = 0;
+  // sequence of the latest field change
+  virtual uint32_t fieldSequence() const = 0;
+};
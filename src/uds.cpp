@@ -1,235 +1,1020 @@
 #include "uds.h"
-#include "config.h"
-#include "driver/twai.h"
+#include "udsconfig.h"
+#ifdef ESP_PLATFORM
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#else
+#include <thread>
+#endif
 
 namespace {
-constexpr uint32_t kDefaultTimeoutMs = 200;
-constexpr uint8_t kIsoTpSingleFrame = 0x0;
-constexpr uint8_t kIsoTpFirstFrame = 0x1;
-constexpr uint8_t kIsoTpConsecutiveFrame = 0x2;
-constexpr uint8_t kIsoTpFlowControl = 0x3;
+constexpr uint32_t kBlockingSliceMs = 1;
+// consecutive frames due within this window are sent by spinning in process()
+// rather than waiting for the next main loop pass
+constexpr uint32_t kTxSpinWindowUs = 1000;
+constexpr uint32_t kTxSpinBudgetUs = 4000;
+constexpr uint32_t kRxTaskWaitMs = 20;
+#ifdef ESP_PLATFORM
+constexpr uint32_t kRxTaskStack = 3072;
+constexpr UBaseType_t kRxTaskPriority = configMAX_PRIORITIES - 2;
+#endif
+// room for bursts while the receive task is busy with the recorder or a ring push
+constexpr uint16_t kRxQueueLen = 64;
 
-constexpr uint8_t kIsoTpPciMask = 0xF0;
-constexpr uint8_t kIsoTpLenMask = 0x0F;
+constexpr uint8_t kNegativeResponse = 0x7F;
+constexpr uint8_t kNrcSubFunctionNotSupportedInSession = 0x7E;
+constexpr uint8_t kNrcServiceNotSupportedInSession = 0x7F;
+constexpr uint8_t kNrcResponsePending = 0x78;
+// an ECU that keeps answering responsePending is treated as failed
+constexpr uint8_t kMaxPendingReplies = 20;
+constexpr uint8_t kDiagnosticSessionControl = 0x10;
+constexpr uint8_t kTesterPresent = 0x3E;
+constexpr uint8_t kSuppressPosRsp = 0x80;
+
+// physical response ids answering a functional request
+constexpr uint32_t kFunctionalRxMatch = 0x7E8;
+constexpr uint32_t kFunctionalRxMask = 0x7F8;
+constexpr uint32_t kFunctionalRxLast = 0x7EF;
+constexpr uint32_t kNormalFixedRx = 0x18DA0000;
+constexpr uint32_t kNormalFixedMask = 0x1FFFFF00;
+constexpr uint8_t kTesterAddress = 0xF1;
+
+constexpr uint32_t kBitrates[] = {500000, 250000, 1000000};
+constexpr uint32_t kProbeWindowMs = 300;
+constexpr uint32_t kProbeFrames = 5;
+
+constexpr uint32_t kStatsWindowMs = 1000;
+constexpr uint32_t kLatencyBaseUs = 250;
+
+// Frame length on the wire: fixed fields, data, and worst-case bit stuffing
+// over the stuffed part, which is close enough for a load estimate.
+uint32_t frameBits(const UdsFrame& frame)
+{
+  uint32_t stuffed = (frame.extended ? 54 : 34) + 8 * frame.len;
+  return stuffed + stuffed / 4 + 13;
 }
 
-bool UdsClient::begin(uint32_t baud)
+// Holds UdsClient::m_statsLock for a scope: a critical section on the ESP32,
+// so only ever around a few loads and stores, and a mutex on the host.
+class StatsLock {
+public:
+#ifdef ESP_PLATFORM
+  explicit StatsLock(portMUX_TYPE& lock) : m_lock(lock) { portENTER_CRITICAL(&m_lock); }
+  ~StatsLock() { portEXIT_CRITICAL(&m_lock); }
+#else
+  explicit StatsLock(std::mutex& lock) : m_lock(lock) { m_lock.lock(); }
+  ~StatsLock() { m_lock.unlock(); }
+#endif
+  StatsLock(const StatsLock&) = delete;
+  StatsLock& operator=(const StatsLock&) = delete;
+
+private:
+#ifdef ESP_PLATFORM
+  portMUX_TYPE& m_lock;
+#else
+  std::mutex& m_lock;
+#endif
+};
+
+uint8_t statSlot(const UdsFrame& frame)
 {
-  if (m_started) {
-    return true;
+  uint32_t h = (frame.id ^ (frame.id >> 7) ^ (frame.id >> 17)) * 2654435761u;
+  return static_cast<uint8_t>(((h >> 24) ^ (frame.extended ? 1 : 0)) & (UDS_STAT_ID_SLOTS - 1));
+}
+
+// Reports the upper edge of the bucket holding the percentile.
+bool percentileOf(const UdsLatency& latency, uint8_t percentile, uint32_t& us)
+{
+  uint32_t total = 0;
+  for (uint8_t b = 0; b < UDS_LATENCY_BUCKETS; b++) {
+    total += latency.buckets[b];
+  }
+  if (total == 0) {
+    return false;
   }
+  uint32_t target = (total * percentile + 99) / 100;
+  uint32_t seen = 0;
+  for (uint8_t b = 0; b < UDS_LATENCY_BUCKETS; b++) {
+    seen += latency.buckets[b];
+    if (seen >= target) {
+      us = kLatencyBaseUs << (b + 1);
+      return true;
+    }
+  }
+  us = kLatencyBaseUs << UDS_LATENCY_BUCKETS;
+  return true;
+}
 
-  twai_general_config_t g_config = TWAI_GENERAL_CONFIG_DEFAULT(CAN_TX_PIN, CAN_RX_PIN, TWAI_MODE_NORMAL);
-  twai_timing_config_t t_config = TWAI_TIMING_CONFIG_500KBITS();
-  twai_filter_config_t f_config = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+uint16_t latencyKey(const uint8_t* payload, uint8_t payloadLen)
+{
+  if (payloadLen >= 3 && payload[0] == 0x22) {
+    return (static_cast<uint16_t>(payload[1]) << 8) | payload[2];
+  }
+  return payload[0];
+}
 
-  if (baud == 250000) {
-    t_config = TWAI_TIMING_CONFIG_250KBITS();
-  } else if (baud == 1000000) {
-    t_config = TWAI_TIMING_CONFIG_1MBITS();
+// physical request id of the ECU that answered on rxId
+uint32_t physicalTxId(uint32_t rxId, bool extended)
+{
+  if (!extended) {
+    return rxId - 8;
   }
+  // normal fixed addressing: 0x18DA<target><source>, so swap the address bytes
+  return (rxId & 0xFFFF0000) | ((rxId & 0xFF) << 8) | ((rxId >> 8) & 0xFF);
+}
+}
 
-  if (twai_driver_install(&g_config, &t_config, &f_config) != ESP_OK) {
-    return false;
+bool UdsBufferPool::init(uint8_t count, uint16_t bufferSize)
+{
+  if (m_memory) {
+    return true;
+  }
+  if (count > 32) {
+    count = 32;
+  }
+  size_t bytes = static_cast<size_t>(count) * bufferSize;
+#ifdef ESP_PLATFORM
+  // PSRAM where the board has it
+  m_memory = static_cast<uint8_t*>(heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM));
+  if (!m_memory) {
+    m_memory = static_cast<uint8_t*>(malloc(bytes));
   }
-  if (twai_start() != ESP_OK) {
-    twai_driver_uninstall();
+#else
+  m_memory = static_cast<uint8_t*>(malloc(bytes));
+#endif
+  if (!m_memory) {
+    Serial.println("[UDS] OUT OF RAM");
     return false;
   }
-
-  m_started = true;
+  m_count = count;
+  m_bufferSize = bufferSize;
+  m_inUse = 0;
   return true;
 }
 
-void UdsClient::end()
+uint8_t* UdsBufferPool::acquire()
 {
-  if (!m_started) {
+  for (uint8_t i = 0; i < m_count; i++) {
+    if (!(m_inUse & (1u << i))) {
+      m_inUse |= 1u << i;
+      return m_memory + static_cast<size_t>(i) * m_bufferSize;
+    }
+  }
+  return nullptr;
+}
+
+void UdsBufferPool::release(uint8_t* buffer)
+{
+  if (!buffer || !m_memory || buffer < m_memory) {
     return;
   }
-  twai_stop();
-  twai_driver_uninstall();
-  m_started = false;
+  size_t index = static_cast<size_t>(buffer - m_memory) / m_bufferSize;
+  if (index < m_count) {
+    m_inUse &= ~(1u << index);
+  }
 }
 
-bool UdsClient::sendFrame(uint32_t id, bool extended, const uint8_t* data, uint8_t len, uint32_t timeoutMs)
+uint8_t UdsBufferPool::available() const
 {
-  if (!m_started) {
+  uint8_t free = 0;
+  for (uint8_t i = 0; i < m_count; i++) {
+    if (!(m_inUse & (1u << i))) {
+      free++;
+    }
+  }
+  return free;
+}
+
+bool UdsClient::addRxId(uint32_t id, bool extended)
+{
+  for (uint8_t i = 0; i < m_rxIdCount.load(); i++) {
+    if (m_rxIds[i].id == id && m_rxIds[i].extended == extended) {
+      return true;
+    }
+  }
+  uint8_t count = m_rxIdCount.load();
+  if (count >= UDS_MAX_RX_IDS) {
     return false;
   }
+  m_rxIds[count].id = id;
+  m_rxIds[count].extended = extended;
+  m_rxIdCount.store(count + 1);
+  return true;
+}
 
-  twai_message_t msg = {};
-  msg.identifier = id;
-  msg.extd = extended ? 1 : 0;
-  msg.data_length_code = len;
-  if (len > 0) {
-    memcpy(msg.data, data, len);
+void UdsClient::clearRxIds()
+{
+  if (!m_started) {
+    m_rxIdCount.store(0);
   }
+}
 
-  return twai_transmit(&msg, pdMS_TO_TICKS(timeoutMs)) == ESP_OK;
+void UdsClient::setTransport(CanTransport* transport)
+{
+  if (!m_started && transport) {
+    m_can = transport;
+  }
 }
 
-bool UdsClient::readFrame(UdsFrame& frame, uint32_t timeoutMs)
+uint32_t UdsClient::detectBitrate()
 {
-  if (!m_started) {
-    return false;
+  if (m_started) {
+    return m_baud;
+  }
+
+  for (uint32_t baud : kBitrates) {
+    CanTransportConfig config;
+    config.baud = baud;
+    config.listenOnly = true;
+    if (!m_can->open(config)) {
+      continue;
+    }
+
+    uint32_t frames = 0;
+    uint32_t errors = 0;
+    uint32_t start = millis();
+    while (millis() - start < kProbeWindowMs && !(frames >= kProbeFrames && errors == 0)) {
+      UdsFrame frame;
+      if (m_can->receive(frame, 10)) {
+        frames++;
+      }
+      if (m_can->readAlerts(0) & (CAN_ALERT_BUS_ERROR | CAN_ALERT_ERROR_PASSIVE)) {
+        errors++;
+      }
+    }
+    m_can->close();
+
+    Serial.print("[CAN] ");
+    Serial.print(baud / 1000);
+    Serial.print("kbps: ");
+    Serial.print(frames);
+    Serial.print(" frames, ");
+    Serial.print(errors);
+    Serial.println(" errors");
+    if (frames >= kProbeFrames && errors == 0) {
+      return baud;
+    }
   }
+  return 0;
+}
 
-  twai_message_t msg = {};
-  if (twai_receive(&msg, pdMS_TO_TICKS(timeoutMs)) != ESP_OK) {
+bool UdsClient::addSniffId(uint32_t id, bool extended)
+{
+  m_sniffEnabled = true;
+  for (uint8_t i = 0; i < m_sniffIdCount; i++) {
+    if (m_sniffIds[i].id == id && m_sniffIds[i].extended == extended) {
+      return true;
+    }
+  }
+  if (m_sniffIdCount >= UDS_MAX_RX_IDS) {
     return false;
   }
+  m_sniffIds[m_sniffIdCount].id = id;
+  m_sniffIds[m_sniffIdCount].extended = extended;
+  m_sniffIdCount++;
+  return true;
+}
 
-  frame.id = msg.identifier;
-  frame.extended = msg.extd != 0;
-  frame.len = msg.data_length_code;
-  if (frame.len > 0) {
-    memcpy(frame.data, msg.data, frame.len);
+bool UdsClient::setIsoTpParams(uint32_t txId, const IsoTpParams& params)
+{
+  for (uint8_t i = 0; i < m_paramCount; i++) {
+    if (m_paramTxIds[i] == txId) {
+      m_params[i] = params;
+      return true;
+    }
   }
+  if (m_paramCount >= UDS_MAX_ECU_PARAMS) {
+    return false;
+  }
+  m_paramTxIds[m_paramCount] = txId;
+  m_params[m_paramCount] = params;
+  m_paramCount++;
   return true;
 }
 
-bool UdsClient::sendIsoTp(uint32_t txId, bool txExtended, uint32_t rxId, bool rxExtended,
-                          const uint8_t* payload, uint8_t payloadLen, uint32_t timeoutMs)
+bool UdsClient::setDiagnosticSession(uint32_t txId, bool txExtended,
+                                     uint32_t rxId, bool rxExtended, uint8_t type)
+{
+  UdsDiagSession* diag = diagFor(txId);
+  if (!diag) {
+    if (m_diagCount >= UDS_MAX_ECU_PARAMS) {
+      return false;
+    }
+    diag = &m_diag[m_diagCount++];
+  }
+  *diag = {};
+  diag->txId = txId;
+  diag->txExtended = txExtended;
+  diag->rxId = rxId;
+  diag->rxExtended = rxExtended;
+  diag->type = type;
+  return addRxId(rxId, rxExtended);
+}
+
+UdsDiagSession* UdsClient::diagFor(uint32_t txId)
+{
+  for (uint8_t i = 0; i < m_diagCount; i++) {
+    if (m_diag[i].txId == txId) {
+      return &m_diag[i];
+    }
+  }
+  return nullptr;
+}
+
+const IsoTpParams& UdsClient::paramsFor(uint32_t txId) const
+{
+  for (uint8_t i = 0; i < m_paramCount; i++) {
+    if (m_paramTxIds[i] == txId) {
+      return m_params[i];
+    }
+  }
+  return m_defaultParams;
+}
+
+int UdsClient::findRxId(const UdsFrame& frame) const
 {
-  if (payloadLen <= 7) {
-    uint8_t frame[8] = {0};
-    frame[0] = (kIsoTpSingleFrame << 4) | (payloadLen & kIsoTpLenMask);
-    if (payloadLen > 0) {
-      memcpy(frame + 1, payload, payloadLen);
+  uint8_t count = m_rxIdCount.load();
+  for (uint8_t i = 0; i < count; i++) {
+    if (m_rxIds[i].id == frame.id && m_rxIds[i].extended == frame.extended) {
+      return i;
     }
-    return sendFrame(txId, txExtended, frame, 1 + payloadLen, timeoutMs);
   }
+  return -1;
+}
 
-  uint8_t frame[8] = {0};
-  frame[0] = (kIsoTpFirstFrame << 4) | ((payloadLen >> 8) & kIsoTpLenMask);
-  frame[1] = payloadLen & 0xFF;
-  memcpy(frame + 2, payload, 6);
-  if (!sendFrame(txId, txExtended, frame, 8, timeoutMs)) {
+void UdsClient::rxTask(void* arg)
+{
+  static_cast<UdsClient*>(arg)->rxLoop();
+}
+
+// Counts driver alerts and runs bus-off recovery: recovery takes 128
+// occurrences of 11 recessive bits (about 3 ms at 500 kbit/s), after which
+// the controller is restarted right away.
+void UdsClient::serviceAlerts(uint32_t waitMs)
+{
+  uint32_t alerts = m_can->readAlerts(waitMs);
+  if (alerts & CAN_ALERT_ARB_LOST) {
+    m_stats.arbLost++;
+  }
+  if (alerts & CAN_ALERT_BUS_ERROR) {
+    m_stats.busErrors++;
+  }
+  if (alerts & CAN_ALERT_RX_QUEUE_FULL) {
+    m_stats.rxQueueFull++;
+  }
+  if (alerts & CAN_ALERT_ERROR_PASSIVE) {
+    m_stats.errorPassive++;
+  }
+  if (alerts & CAN_ALERT_BUS_OFF) {
+    m_stats.busOff++;
+    m_busOff = true;
+    m_can->recover();
+  }
+  if (!m_busOff) {
+    return;
+  }
+
+  // recovery leaves the controller stopped; also retry a start that failed
+  CanStatus status;
+  if (!m_can->status(status)) {
+    return;
+  }
+  if (status.state == CAN_STATE_STOPPED) {
+    if (m_can->restart()) {
+      m_stats.recoveries++;
+      m_busOff = false;
+    }
+  } else if (status.state == CAN_STATE_BUS_OFF) {
+    m_can->recover();
+  }
+}
+
+// Drains the controller's receive queue as fast as frames arrive so that nothing is
+// lost while the main loop is busy; each registered rxId gets its own ring.
+void UdsClient::rxLoop()
+{
+  UdsFrame frame;
+  uint32_t nextQueueSampleMs = millis();
+  while (m_rxRunning) {
+    // while bus-off, block on alerts so the restart follows recovery at once
+    serviceAlerts(m_busOff ? kRxTaskWaitMs : 0);
+    if (m_recorder) {
+      m_recorder->tick();
+    }
+    if (m_busOff) {
+      continue;
+    }
+    if (!readFrame(frame, kRxTaskWaitMs)) {
+      continue;
+    }
+    if (m_recorder) {
+      m_recorder->record(frame);
+    }
+    {
+      StatsLock lock(m_statsLock);
+      m_stats.rxFrames++;
+      m_rxBits += frameBits(frame);
+      countFrame(m_rxIdTable, frame);
+    }
+    // the driver is asked for its queue depth once per tick, not per frame
+    uint32_t nowMs = millis();
+    if (static_cast<int32_t>(nowMs - nextQueueSampleMs) >= 0) {
+      nextQueueSampleMs = nowMs + kRxTaskWaitMs;
+      CanStatus status;
+      if (m_can->status(status) && status.rxPending + 1 > m_stats.rxQueueHigh) {
+        // +1 for the frame just taken off the queue
+        StatsLock lock(m_statsLock);
+        m_stats.rxQueueHigh = status.rxPending + 1;
+      }
+    }
+    if (m_functionalActive.load(std::memory_order_acquire) && frame.extended == m_functionalExtended &&
+        (frame.id & m_functionalMask) == m_functionalMatch) {
+      if (m_functionalRing.push(frame)) {
+        m_stats.rxAccepted++;
+      } else {
+        m_stats.rxOverflow++;
+      }
+      continue;
+    }
+    int index = findRxId(frame);
+    if (index >= 0) {
+      if (m_rxRings[index].push(frame)) {
+        m_stats.rxAccepted++;
+      } else {
+        m_stats.rxOverflow++;
+      }
+    } else if (m_sniffEnabled) {
+      if (m_sniffRing.push(frame)) {
+        m_stats.rxSniffed++;
+      } else {
+        m_stats.rxOverflow++;
+      }
+    } else {
+      m_stats.rxDropped++;
+    }
+  }
+  m_rxTask = nullptr;
+#ifdef ESP_PLATFORM
+  vTaskDelete(nullptr);
+#endif
+}
+
+bool UdsClient::begin(uint32_t baud)
+{
+  if (m_started) {
+    return true;
+  }
+
+  CanTransportConfig config;
+  config.baud = baud;
+  config.rxQueueLen = kRxQueueLen;
+  m_baud = baud;
+#if CAN_HW_FILTER
+  UdsRxId filterIds[UDS_MAX_RX_IDS * 2 + 4];
+  uint8_t filterCount = m_rxIdCount.load();
+  memcpy(filterIds, m_rxIds, filterCount * sizeof(UdsRxId));
+  for (uint8_t i = 0; i < m_sniffIdCount; i++) {
+    filterIds[filterCount++] = m_sniffIds[i];
+  }
+  // the first and last id of each functional response range widen the mask over it
+  if (m_functionalFilter[0]) {
+    filterIds[filterCount++] = {kFunctionalRxMatch, false};
+    filterIds[filterCount++] = {kFunctionalRxLast, false};
+  }
+  if (m_functionalFilter[1]) {
+    filterIds[filterCount++] = {kNormalFixedRx | (kTesterAddress << 8), true};
+    filterIds[filterCount++] = {kNormalFixedRx | (kTesterAddress << 8) | 0xFF, true};
+  }
+  // recording needs every frame on the bus
+  if (!m_recorder) {
+    config.filterIds = filterIds;
+    config.filterCount = filterCount;
+  }
+#endif
+
+  if (!m_can->open(config)) {
     return false;
   }
 
-  UdsFrame fc = {};
-  if (!readFrame(fc, timeoutMs)) {
+  m_stats = {};
+  m_busOff = false;
+  m_rxIdTable = {};
+  m_txIdTable = {};
+  m_rxBits = m_txBits = m_txFrames = 0;
+  m_lastRxBits = m_lastTxBits = m_lastRxFrames = m_lastTxFrames = 0;
+  m_lastRollMs = millis();
+  m_started = true;
+  m_rxRunning = true;
+#ifdef ESP_PLATFORM
+  TaskHandle_t task = nullptr;
+  if (xTaskCreatePinnedToCore(rxTask, "canrx", kRxTaskStack, this, kRxTaskPriority, &task, tskNO_AFFINITY) != pdPASS) {
+    end();
     return false;
   }
-  if (fc.id != rxId || fc.extended != rxExtended || fc.len < 3) {
+  m_rxTask = task;
+#else
+  m_rxTask = this;
+  std::thread(rxTask, this).detach();
+#endif
+  return true;
+}
+
+void UdsClient::end()
+{
+  if (!m_started) {
+    return;
+  }
+  m_rxRunning = false;
+  while (m_rxTask) {
+    delay(1);
+  }
+  m_can->close();
+  for (auto& ring : m_rxRings) {
+    ring.clear();
+  }
+  m_sniffRing.clear();
+  for (auto& session : m_sessions) {
+    session.reset();
+  }
+  for (uint8_t i = 0; i < m_diagCount; i++) {
+    m_diag[i].state = UDS_DIAG_CLOSED;
+    m_diag[i].handle = -1;
+  }
+  m_started = false;
+}
+
+bool UdsClient::sendFrame(const UdsFrame& frame)
+{
+  if (!m_started || m_busOff) {
     return false;
   }
-  if ((fc.data[0] >> 4) != kIsoTpFlowControl) {
+
+  if (!m_can->send(frame)) {
     return false;
   }
+  StatsLock lock(m_statsLock);
+  m_txFrames++;
+  m_txBits += frameBits(frame);
+  countFrame(m_txIdTable, frame);
+  return true;
+}
+
+void UdsClient::countFrame(UdsIdTable& table, const UdsFrame& frame)
+{
+  uint8_t slot = statSlot(frame);
+  while (table.slots[slot]) {
+    UdsIdStats& entry = table.ids[table.slots[slot] - 1];
+    if (entry.id == frame.id && entry.extended == frame.extended) {
+      entry.frames++;
+      return;
+    }
+    slot = (slot + 1) & (UDS_STAT_ID_SLOTS - 1);
+  }
+  if (table.count >= UDS_MAX_STAT_IDS) {
+    return;
+  }
+  UdsIdStats& entry = table.ids[table.count++];
+  entry.id = frame.id;
+  entry.extended = frame.extended;
+  entry.frames = 1;
+  table.slots[slot] = table.count;
+}
 
-  uint8_t blockSize = fc.data[1];
-  uint8_t stMin = fc.data[2];
-  uint8_t seq = 1;
-  uint16_t offset = 6;
-  uint8_t sentInBlock = 0;
+// Turns the cumulative counters into per-second figures once a second.
+void UdsClient::rollStats()
+{
+  uint32_t now = millis();
+  uint32_t elapsed = now - m_lastRollMs;
+  if (elapsed < kStatsWindowMs) {
+    return;
+  }
+  m_lastRollMs = now;
 
-  while (offset < payloadLen) {
-    frame[0] = (kIsoTpConsecutiveFrame << 4) | (seq & kIsoTpLenMask);
-    uint8_t copyLen = payloadLen - offset;
-    if (copyLen > 7) {
-      copyLen = 7;
+  StatsLock lock(m_statsLock);
+  uint32_t rxFrames = m_stats.rxFrames;
+  uint32_t rxBits = m_rxBits;
+  m_load.rxPerSecond = static_cast<uint16_t>((rxFrames - m_lastRxFrames) * 1000 / elapsed);
+  m_load.txPerSecond = static_cast<uint16_t>((m_txFrames - m_lastTxFrames) * 1000 / elapsed);
+  uint32_t bits = (rxBits - m_lastRxBits) + (m_txBits - m_lastTxBits);
+  m_load.loadPercent = m_baud ? bits * 100000.0f / elapsed / m_baud : 0;
+  m_lastRxFrames = rxFrames;
+  m_lastTxFrames = m_txFrames;
+  m_lastRxBits = rxBits;
+  m_lastTxBits = m_txBits;
+
+  UdsIdTable* tables[2] = {&m_rxIdTable, &m_txIdTable};
+  for (uint8_t t = 0; t < 2; t++) {
+    for (uint8_t i = 0; i < tables[t]->count; i++) {
+      UdsIdStats& s = tables[t]->ids[i];
+      uint32_t frames = s.frames;
+      s.perSecond = static_cast<uint16_t>((frames - s.lastFrames) * 1000 / elapsed);
+      s.lastFrames = frames;
     }
-    memcpy(frame + 1, payload + offset, copyLen);
-    if (!sendFrame(txId, txExtended, frame, copyLen + 1, timeoutMs)) {
-      return false;
+  }
+}
+
+const UdsLatency* UdsClient::findLatency(uint32_t txId, uint16_t key) const
+{
+  for (uint8_t i = 0; i < m_latencyCount; i++) {
+    if (m_latency[i].txId == txId && m_latency[i].key == key) {
+      return &m_latency[i];
     }
-    offset += copyLen;
-    seq = (seq + 1) & 0x0F;
+  }
+  return nullptr;
+}
 
-    if (stMin) {
-      delay(stMin);
+void UdsClient::recordLatency(uint8_t index)
+{
+  uint32_t txId = m_sessions[index].txId();
+  uint16_t key = m_latencyKey[index];
+  uint32_t us = micros() - m_startUs[index];
+  StatsLock lock(m_statsLock);
+  UdsLatency* latency = const_cast<UdsLatency*>(findLatency(txId, key));
+  if (!latency) {
+    if (m_latencyCount >= UDS_MAX_LATENCY_KEYS) {
+      return;
     }
+    latency = &m_latency[m_latencyCount++];
+    latency->txId = txId;
+    latency->key = key;
+  }
+  uint8_t bucket = 0;
+  while (bucket < UDS_LATENCY_BUCKETS - 1 && us >= (kLatencyBaseUs << (bucket + 1))) {
+    bucket++;
+  }
+  if (latency->buckets[bucket] < UINT16_MAX) {
+    latency->buckets[bucket]++;
+  }
+  latency->count++;
+}
 
-    if (blockSize > 0) {
-      sentInBlock++;
-      if (sentInBlock >= blockSize && offset < payloadLen) {
-        if (!readFrame(fc, timeoutMs)) {
-          return false;
-        }
-        if (fc.id != rxId || fc.extended != rxExtended || (fc.data[0] >> 4) != kIsoTpFlowControl) {
-          return false;
+bool UdsClient::latencyPercentile(uint32_t txId, uint16_t did, uint8_t percentile, uint32_t& us) const
+{
+  const UdsLatency* latency = findLatency(txId, did);
+  return latency && percentileOf(*latency, percentile, us);
+}
+
+// Each figure is copied under the stats lock and formatted after it is let go.
+int UdsClient::statsJson(char* buffer, int bufferSize) const
+{
+  UdsBusLoad load;
+  uint32_t queueHigh = 0;
+  {
+    StatsLock lock(m_statsLock);
+    load = m_load;
+    queueHigh = m_stats.rxQueueHigh;
+  }
+  int n = snprintf(buffer, bufferSize, "{\"load\":%.1f,\"rx\":%u,\"tx\":%u,\"queue\":%u,\"ids\":[",
+                   load.loadPercent, load.rxPerSecond, load.txPerSecond, static_cast<unsigned int>(queueHigh));
+  const UdsIdTable* tables[2] = {&m_rxIdTable, &m_txIdTable};
+  bool first = true;
+  for (uint8_t t = 0; t < 2; t++) {
+    for (uint8_t i = 0; i < UDS_MAX_STAT_IDS && n < bufferSize; i++) {
+      UdsIdStats s;
+      {
+        StatsLock lock(m_statsLock);
+        if (i >= tables[t]->count) {
+          break;
         }
-        blockSize = fc.data[1];
-        stMin = fc.data[2];
-        sentInBlock = 0;
+        s = tables[t]->ids[i];
       }
+      n += snprintf(buffer + n, bufferSize - n, "%s{\"id\":\"%lX\",\"dir\":\"%s\",\"frames\":%u,\"fps\":%u}",
+                    first ? "" : ",", static_cast<unsigned long>(s.id), t ? "tx" : "rx",
+                    static_cast<unsigned int>(s.frames), s.perSecond);
+      first = false;
     }
   }
-
-  return true;
+  if (n < bufferSize) {
+    n += snprintf(buffer + n, bufferSize - n, "],\"latency\":[");
+  }
+  for (uint8_t i = 0; i < UDS_MAX_LATENCY_KEYS && n < bufferSize; i++) {
+    UdsLatency l;
+    {
+      StatsLock lock(m_statsLock);
+      if (i >= m_latencyCount) {
+        break;
+      }
+      l = m_latency[i];
+    }
+    uint32_t p50 = 0;
+    uint32_t p90 = 0;
+    uint32_t p99 = 0;
+    percentileOf(l, 50, p50);
+    percentileOf(l, 90, p90);
+    percentileOf(l, 99, p99);
+    n += snprintf(buffer + n, bufferSize - n, "%s{\"ecu\":\"%lX\",\"did\":\"%04X\",\"n\":%u,\"p50\":%u,\"p90\":%u,\"p99\":%u}",
+                  i ? "," : "", static_cast<unsigned long>(l.txId), l.key, static_cast<unsigned int>(l.count),
+                  static_cast<unsigned int>(p50), static_cast<unsigned int>(p90), static_cast<unsigned int>(p99));
+  }
+  if (n < bufferSize) {
+    n += snprintf(buffer + n, bufferSize - n, "]}");
+  }
+  return n < bufferSize ? n : bufferSize - 1;
 }
 
-bool UdsClient::readIsoTp(uint32_t txId, bool txExtended, uint32_t rxId, bool rxExtended,
-                          uint8_t* response, uint16_t* responseLen, uint32_t timeoutMs)
+bool UdsClient::readFrame(UdsFrame& frame, uint32_t timeoutMs)
 {
-  UdsFrame frame = {};
-  if (!readFrame(frame, timeoutMs)) {
+  if (!m_started) {
     return false;
   }
-  if (frame.id != rxId || frame.extended != rxExtended || frame.len == 0) {
-    return false;
+
+  return m_can->receive(frame, timeoutMs);
+}
+
+const UdsStats& UdsClient::stats()
+{
+  CanStatus status;
+  if (m_started && m_can->status(status)) {
+    m_stats.rxMissed = status.rxMissed;
   }
+  return m_stats;
+}
 
-  uint8_t frameType = frame.data[0] >> 4;
-  if (frameType == kIsoTpSingleFrame) {
-    uint8_t len = frame.data[0] & kIsoTpLenMask;
-    if (len > 7 || len > frame.len - 1) {
-      return false;
+void UdsClient::printStats()
+{
+  const UdsStats& s = stats();
+  Serial.print("[CAN] RX:");
+  Serial.print(s.rxFrames);
+  Serial.print(" accepted:");
+  Serial.print(s.rxAccepted);
+  Serial.print(" sniffed:");
+  Serial.print(s.rxSniffed);
+  Serial.print(" dropped:");
+  Serial.print(s.rxDropped);
+  Serial.print(" overflow:");
+  Serial.print(s.rxOverflow);
+  Serial.print(" missed:");
+  Serial.print(s.rxMissed);
+  Serial.print(" queue-high:");
+  Serial.print(s.rxQueueHigh);
+  Serial.print(" load:");
+  Serial.print(m_load.loadPercent, 1);
+  Serial.println('%');
+  if (s.busOff || s.errorPassive || s.busErrors || s.arbLost || s.rxQueueFull) {
+    Serial.print("[CAN] bus-off:");
+    Serial.print(s.busOff);
+    Serial.print(" recovered:");
+    Serial.print(s.recoveries);
+    Serial.print(" error-passive:");
+    Serial.print(s.errorPassive);
+    Serial.print(" bus-errors:");
+    Serial.print(s.busErrors);
+    Serial.print(" arb-lost:");
+    Serial.print(s.arbLost);
+    Serial.print(" queue-full:");
+    Serial.println(s.rxQueueFull);
+  }
+}
+
+int UdsClient::submit(uint32_t txId, bool txExtended,
+                      uint32_t rxId, bool rxExtended,
+                      const uint8_t* payload, uint8_t payloadLen,
+                      uint8_t* response, uint16_t responseCapacity,
+                      uint32_t timeoutMs)
+{
+  if (!m_started && !begin()) {
+    return -1;
+  }
+  // replies would be taken by a functional request in progress
+  if (m_functionalStatus == UDS_PENDING || busy(txId, rxId) || !addRxId(rxId, rxExtended)) {
+    return -1;
+  }
+  int handle = startSession(txId, txExtended, rxId, rxExtended,
+                            payload, payloadLen, response, responseCapacity, timeoutMs);
+  UdsDiagSession* diag = diagFor(txId);
+  if (handle >= 0 && diag) {
+    diag->lastTxMs = millis();
+  }
+  return handle;
+}
+
+int UdsClient::startSession(uint32_t txId, bool txExtended,
+                            uint32_t rxId, bool rxExtended,
+                            const uint8_t* payload, uint8_t payloadLen,
+                            uint8_t* response, uint16_t responseCapacity,
+                            uint32_t timeoutMs)
+{
+  for (int i = 0; i < UDS_MAX_SESSIONS; i++) {
+    IsoTpSession& session = m_sessions[i];
+    if (session.state() != ISOTP_IDLE) {
+      continue;
     }
-    if (response && responseLen && *responseLen >= len) {
-      memcpy(response, frame.data + 1, len);
-      *responseLen = len;
-      return true;
+    if (!session.start(this, txId, txExtended, rxId, rxExtended,
+                       payload, payloadLen, response, responseCapacity,
+                       paramsFor(txId), micros(), timeoutMs * 1000)) {
+      return -1;
     }
-    return false;
+    m_checked[i] = false;
+    m_pendingReplies[i] = 0;
+    m_startUs[i] = micros();
+    m_latencyKey[i] = latencyKey(payload, payloadLen);
+    return i;
   }
+  return -1;
+}
 
-  if (frameType != kIsoTpFirstFrame || frame.len < 8) {
-    return false;
+// Looks at a transaction's final reply once: responsePending to the service
+// that was sent re-arms it with the P2* timeout, "not supported in active
+// session" means the ECU has fallen back to the default session and must be
+// switched again.
+void UdsClient::checkCompleted(uint8_t index, uint32_t nowUs)
+{
+  IsoTpSession& session = m_sessions[index];
+  if (session.state() != ISOTP_DONE || m_checked[index]) {
+    return;
+  }
+  const uint8_t* response = session.response();
+  if (session.responseLength() < 3 || response[0] != kNegativeResponse) {
+    m_checked[index] = true;
+    return;
   }
 
-  uint16_t totalLen = ((frame.data[0] & kIsoTpLenMask) << 8) | frame.data[1];
-  if (totalLen == 0 || !response || !responseLen || *responseLen < totalLen) {
-    return false;
+  uint8_t nrc = response[2];
+  // a stale or foreign responsePending must not keep the transaction alive
+  if (nrc == kNrcResponsePending && response[1] == session.requestSid() &&
+      m_pendingReplies[index] < kMaxPendingReplies) {
+    m_pendingReplies[index]++;
+    session.awaitResponse(nowUs, static_cast<uint32_t>(UDS_P2STAR_TIMEOUT) * 1000);
+    return;
+  }
+  m_checked[index] = true;
+  if (nrc == kNrcServiceNotSupportedInSession || nrc == kNrcSubFunctionNotSupportedInSession) {
+    UdsDiagSession* diag = diagFor(session.txId());
+    if (diag && diag->state == UDS_DIAG_OPEN) {
+      diag->state = UDS_DIAG_CLOSED;
+      diag->retryMs = millis();
+    }
+  }
+}
+
+void UdsClient::serviceDiagSessions(uint32_t nowMs)
+{
+  // replies would be taken by a functional request in progress
+  if (m_functionalActive.load(std::memory_order_relaxed)) {
+    return;
+  }
+  for (uint8_t i = 0; i < m_diagCount; i++) {
+    UdsDiagSession& diag = m_diag[i];
+    switch (diag.state) {
+      case UDS_DIAG_CLOSED: {
+        if (static_cast<int32_t>(nowMs - diag.retryMs) < 0 || busy(diag.txId, diag.rxId)) {
+          break;
+        }
+        uint8_t request[2] = {kDiagnosticSessionControl, diag.type};
+        diag.handle = startSession(diag.txId, diag.txExtended, diag.rxId, diag.rxExtended,
+                                   request, sizeof(request), diag.response, sizeof(diag.response), 200);
+        if (diag.handle >= 0) {
+          diag.state = UDS_DIAG_OPENING;
+        }
+        break;
+      }
+      case UDS_DIAG_OPENING: {
+        uint16_t len = 0;
+        UdsStatus status = poll(diag.handle, &len);
+        if (status == UDS_PENDING) {
+          break;
+        }
+        diag.handle = -1;
+        if (status == UDS_COMPLETE && len >= 2 && diag.response[0] == kDiagnosticSessionControl + 0x40) {
+          diag.state = UDS_DIAG_OPEN;
+          diag.lastTxMs = nowMs;
+          Serial.print("[UDS] Session ");
+          Serial.print(diag.type, HEX);
+          Serial.print(" open on ");
+          Serial.println(diag.txId, HEX);
+        } else {
+          diag.state = UDS_DIAG_CLOSED;
+          diag.retryMs = nowMs + UDS_TESTER_PRESENT_INTERVAL;
+        }
+        break;
+      }
+      case UDS_DIAG_OPEN: {
+        if (nowMs - diag.lastTxMs < UDS_TESTER_PRESENT_INTERVAL || busy(diag.txId, diag.rxId)) {
+          break;
+        }
+        // suppressPosRsp: the ECU does not answer, so no session slot is used
+        UdsFrame frame;
+        frame.id = diag.txId;
+        frame.extended = diag.txExtended;
+        frame.len = 3;
+        frame.data[0] = 0x02;
+        frame.data[1] = kTesterPresent;
+        frame.data[2] = kSuppressPosRsp;
+        if (sendFrame(frame)) {
+          diag.lastTxMs = nowMs;
+        }
+        break;
+      }
+    }
   }
+}
 
-  uint16_t copied = 0;
-  memcpy(response, frame.data + 2, 6);
-  copied += 6;
+void UdsClient::process()
+{
+  if (!m_started) {
+    return;
+  }
 
-  uint8_t fc[3] = {static_cast<uint8_t>((kIsoTpFlowControl << 4) | 0x0), 0, 0};
-  if (!sendFrame(txId, txExtended, fc, sizeof(fc), timeoutMs)) {
-    return false;
+  uint32_t now = micros();
+  UdsFrame frame;
+  uint8_t count = m_rxIdCount.load();
+  for (uint8_t i = 0; i < count; i++) {
+    while (m_rxRings[i].pop(frame)) {
+      for (auto& session : m_sessions) {
+        if (session.onFrame(frame, now)) {
+          break;
+        }
+      }
+    }
   }
 
-  uint8_t seq = 1;
-  while (copied < totalLen) {
-    UdsFrame cf = {};
-    if (!readFrame(cf, timeoutMs)) {
-      return false;
+  // sub-millisecond STmin: keep pacing consecutive frames here for a bounded
+  // time instead of sending one frame per main loop pass
+  uint32_t spinStart = now;
+  for (;;) {
+    now = micros();
+    uint32_t nextWaitUs = kTxSpinWindowUs + 1;
+    for (auto& session : m_sessions) {
+      session.poll(now);
+      uint32_t waitUs = 0;
+      if (session.txDueWithin(now, kTxSpinWindowUs, waitUs) && waitUs < nextWaitUs) {
+        nextWaitUs = waitUs;
+      }
     }
-    if (cf.id != rxId || cf.extended != rxExtended || cf.len == 0) {
-      continue;
+    if (nextWaitUs > kTxSpinWindowUs || now - spinStart + nextWaitUs > kTxSpinBudgetUs) {
+      break;
     }
-    if ((cf.data[0] >> 4) != kIsoTpConsecutiveFrame) {
-      continue;
+    if (nextWaitUs) {
+      delayMicroseconds(nextWaitUs);
     }
-    if ((cf.data[0] & kIsoTpLenMask) != (seq & kIsoTpLenMask)) {
-      return false;
+  }
+
+  for (uint8_t i = 0; i < UDS_MAX_SESSIONS; i++) {
+    checkCompleted(i, now);
+  }
+  serviceFunctional(micros());
+  serviceDiagSessions(millis());
+  rollStats();
+}
+
+UdsStatus UdsClient::poll(int handle, uint16_t* responseLen, uint8_t* nrc)
+{
+  if (handle < 0 || handle >= UDS_MAX_SESSIONS) {
+    return UDS_IDLE;
+  }
+
+  IsoTpSession& session = m_sessions[handle];
+  switch (session.state()) {
+    case ISOTP_IDLE:
+      return UDS_IDLE;
+    case ISOTP_DONE: {
+      if (!m_checked[handle]) {
+        // a reply that process() has not looked at yet may be responsePending
+        return UDS_PENDING;
+      }
+      uint16_t len = session.responseLength();
+      const uint8_t* response = session.response();
+      if (responseLen) {
+        *responseLen = len;
+      }
+      recordLatency(static_cast<uint8_t>(handle));
+      if (len >= 3 && response[0] == kNegativeResponse) {
+        if (nrc) {
+          *nrc = response[2];
+        }
+        session.reset();
+        return UDS_NEGATIVE;
+      }
+      session.reset();
+      return UDS_COMPLETE;
     }
-    uint8_t copyLen = cf.len - 1;
-    if (copied + copyLen > totalLen) {
-      copyLen = totalLen - copied;
+    case ISOTP_FAILED:
+      session.reset();
+      return UDS_FAILED;
+    default:
+      return UDS_PENDING;
+  }
+}
+
+bool UdsClient::busy() const
+{
+  for (const auto& session : m_sessions) {
+    if (session.state() != ISOTP_IDLE) {
+      return true;
     }
-    memcpy(response + copied, cf.data + 1, copyLen);
-    copied += copyLen;
-    seq = (seq + 1) & 0x0F;
   }
+  return false;
+}
 
-  *responseLen = totalLen;
-  return true;
+bool UdsClient::busy(uint32_t txId, uint32_t rxId) const
+{
+  for (const auto& session : m_sessions) {
+    if (session.state() != ISOTP_IDLE && (session.txId() == txId || session.rxId() == rxId)) {
+      return true;
+    }
+  }
+  return false;
 }
 
 bool UdsClient::request(uint32_t txId, bool txExtended,
@@ -238,24 +1023,164 @@ bool UdsClient::request(uint32_t txId, bool txExtended,
                         uint8_t* response, uint16_t* responseLen,
                         uint32_t timeoutMs)
 {
-  if (!m_started && !begin()) {
+  uint16_t capacity = responseLen ? *responseLen : 0;
+  int handle = submit(txId, txExtended, rxId, rxExtended, payload, payloadLen,
+                      response, capacity, timeoutMs);
+  if (handle < 0) {
     return false;
   }
 
-  if (!sendIsoTp(txId, txExtended, rxId, rxExtended, payload, payloadLen, timeoutMs)) {
-    return false;
+  for (;;) {
+    process();
+    uint16_t len = 0;
+    UdsStatus status = poll(handle, &len);
+    if (status == UDS_PENDING) {
+      delay(kBlockingSliceMs);
+      continue;
+    }
+    if (status != UDS_COMPLETE) {
+      return false;
+    }
+    if (responseLen) {
+      *responseLen = len;
+    }
+    return true;
   }
+}
 
-  uint16_t len = responseLen ? *responseLen : 0;
-  if (!readIsoTp(txId, txExtended, rxId, rxExtended, response, &len, timeoutMs)) {
+bool UdsClient::submitFunctional(uint32_t txId, bool txExtended,
+                                 const uint8_t* payload, uint8_t payloadLen,
+                                 UdsResponse* responses, uint8_t maxResponses,
+                                 uint32_t timeoutMs)
+{
+  // functional requests are single frames only (ISO 15765-2)
+  if (!payload || payloadLen == 0 || payloadLen > 7 || !responses || maxResponses == 0) {
     return false;
   }
-  if (responseLen) {
-    *responseLen = len;
+  if (!m_started && !begin()) {
+    return false;
   }
+  // responders may share rxIds with physical transactions, so let those finish
+  if (m_functionalStatus != UDS_IDLE || busy()) {
+    return false;
+  }
+
+  if (maxResponses > UDS_MAX_RESPONDERS) {
+    maxResponses = UDS_MAX_RESPONDERS;
+  }
+  for (uint8_t i = 0; i < maxResponses; i++) {
+    responses[i].length = 0;
+    responses[i].complete = false;
+    m_responders[i].reset();
+    m_responderPending[i] = 0;
+  }
+
+  m_functionalExtended = txExtended;
+  if (txExtended) {
+    m_functionalMask = kNormalFixedMask;
+    m_functionalMatch = kNormalFixedRx | ((txId & 0xFF) << 8);
+  } else {
+    m_functionalMask = kFunctionalRxMask;
+    m_functionalMatch = kFunctionalRxMatch;
+  }
+  m_functionalRing.clear();
+  m_functionalActive.store(true, std::memory_order_release);
+
+  UdsFrame frame;
+  frame.id = txId;
+  frame.extended = txExtended;
+  frame.len = static_cast<uint8_t>(payloadLen + 1);
+  frame.data[0] = payloadLen;
+  memcpy(frame.data + 1, payload, payloadLen);
+  if (!sendFrame(frame)) {
+    m_functionalActive.store(false, std::memory_order_release);
+    return false;
+  }
+
+  m_functionalResponses = responses;
+  m_functionalSid = payload[0];
+  m_functionalMax = maxResponses;
+  m_functionalCount = 0;
+  m_functionalTimeoutUs = timeoutMs * 1000;
+  m_functionalEndUs = micros() + m_functionalTimeoutUs;
+  m_functionalStatus = UDS_PENDING;
   return true;
 }
 
+UdsStatus UdsClient::pollFunctional(uint8_t* count)
+{
+  if (m_functionalStatus != UDS_COMPLETE) {
+    return m_functionalStatus;
+  }
+  if (count) {
+    *count = m_functionalCount;
+  }
+  m_functionalStatus = UDS_IDLE;
+  return UDS_COMPLETE;
+}
+
+// Called from process(): hands each responder's frames to its own ISO-TP
+// session, started on the first frame from that ECU.
+void UdsClient::serviceFunctional(uint32_t nowUs)
+{
+  if (m_functionalStatus != UDS_PENDING) {
+    return;
+  }
+  UdsResponse* responses = m_functionalResponses;
+  UdsFrame frame;
+  while (m_functionalRing.pop(frame)) {
+    int index = -1;
+    for (uint8_t i = 0; i < m_functionalCount; i++) {
+      if (responses[i].rxId == frame.id) {
+        index = i;
+        break;
+      }
+    }
+    if (index < 0) {
+      if (m_functionalCount >= m_functionalMax) {
+        continue;
+      }
+      index = m_functionalCount++;
+      responses[index].rxId = frame.id;
+      responses[index].extended = frame.extended;
+      uint32_t physicalTx = physicalTxId(frame.id, frame.extended);
+      m_responders[index].listen(this, physicalTx, frame.extended, frame.id, frame.extended,
+                                 responses[index].data, responses[index].capacity,
+                                 paramsFor(physicalTx), nowUs, m_functionalTimeoutUs);
+    }
+    m_responders[index].onFrame(frame, nowUs);
+  }
+
+  bool pending = false;
+  for (uint8_t i = 0; i < m_functionalCount; i++) {
+    IsoTpSession& session = m_responders[i];
+    session.poll(nowUs);
+    if (session.state() == ISOTP_DONE && !responses[i].complete) {
+      const uint8_t* data = session.response();
+      uint16_t len = session.responseLength();
+      if (len >= 3 && data[0] == kNegativeResponse && data[1] == m_functionalSid &&
+          data[2] == kNrcResponsePending && m_responderPending[i] < kMaxPendingReplies) {
+        m_responderPending[i]++;
+        session.awaitResponse(nowUs, static_cast<uint32_t>(UDS_P2STAR_TIMEOUT) * 1000);
+      } else {
+        responses[i].length = len;
+        responses[i].complete = true;
+      }
+    }
+    pending = pending || session.busy();
+  }
+  if (pending || static_cast<int32_t>(nowUs - m_functionalEndUs) < 0) {
+    return;
+  }
+
+  m_functionalActive.store(false, std::memory_order_release);
+  for (uint8_t i = 0; i < m_functionalCount; i++) {
+    m_responders[i].reset();
+  }
+  m_functionalResponses = nullptr;
+  m_functionalStatus = UDS_COMPLETE;
+}
+
 bool UdsClient::writeDataByIdentifier(uint32_t txId, bool txExtended,
                                       uint32_t rxId, bool rxExtended,
                                       uint16_t did, const uint8_t* data,
@@ -264,7 +1189,7 @@ bool UdsClient::writeDataByIdentifier(uint32_t txId, bool txExtended,
                                       uint32_t timeoutMs)
 {
   uint8_t payload[32] = {0};
-  if (dataLen + 3 > sizeof(payload)) {
+  if (static_cast<size_t>(dataLen) + 3 > sizeof(payload)) {
     return false;
   }
   payload[0] = 0x2E;
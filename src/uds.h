@@ -1,18 +1,202 @@
 #pragma once
 
 #include <Arduino.h>
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#else
+#include <mutex>
+#endif
+#include "isotp.h"
+#include "framering.h"
+#include "cantransport.h"
 
-struct UdsFrame {
+constexpr uint8_t UDS_MAX_SESSIONS = 4;
+constexpr uint8_t UDS_MAX_RX_IDS = 16;
+constexpr uint16_t UDS_RX_RING_SIZE = 32;
+constexpr uint16_t UDS_SNIFF_RING_SIZE = 64;
+constexpr uint8_t UDS_MAX_ECU_PARAMS = 8;
+constexpr uint8_t UDS_MAX_RESPONDERS = 8;
+constexpr uint16_t UDS_FUNCTIONAL_RING_SIZE = 64;
+constexpr uint8_t UDS_MAX_STAT_IDS = 24;
+constexpr uint8_t UDS_STAT_ID_SLOTS = 64;  // power of two, over twice UDS_MAX_STAT_IDS
+constexpr uint8_t UDS_MAX_LATENCY_KEYS = 32;
+constexpr uint8_t UDS_LATENCY_BUCKETS = 16;
+
+using UdsRxId = CanId;
+
+struct UdsStats {
+  uint32_t rxFrames = 0;    // frames handed over by the CAN transport
+  uint32_t rxAccepted = 0;  // frames queued for a registered rxId
+  uint32_t rxSniffed = 0;   // other frames queued on the sniff channel
+  uint32_t rxDropped = 0;   // frames the hardware filter let through but nobody wants
+  uint32_t rxOverflow = 0;  // frames lost because their ring was full
+  uint32_t rxMissed = 0;    // frames lost by the driver (RX queue full / FIFO overrun)
+  // controller alerts
+  uint32_t busOff = 0;
+  uint32_t recoveries = 0;  // bus-off recoveries completed and the controller restarted
+  uint32_t errorPassive = 0;
+  uint32_t busErrors = 0;
+  uint32_t arbLost = 0;
+  uint32_t rxQueueFull = 0;
+  uint32_t rxQueueHigh = 0;  // most frames ever waiting in the driver RX queue
+};
+
+// Frames seen on one CAN id. Cumulative counts, plus the rate over the last
+// whole second.
+struct UdsIdStats {
   uint32_t id = 0;
   bool extended = false;
-  uint8_t len = 0;
-  uint8_t data[8] = {0};
+  uint32_t frames = 0;
+  uint32_t lastFrames = 0;
+  uint16_t perSecond = 0;
+};
+
+// The counters of up to UDS_MAX_STAT_IDS ids, found through an open-addressed
+// index (slot = entry + 1, 0 = free) so a frame costs one or two probes.
+struct UdsIdTable {
+  UdsIdStats ids[UDS_MAX_STAT_IDS];
+  uint8_t slots[UDS_STAT_ID_SLOTS] = {0};
+  uint8_t count = 0;
+};
+
+// Transaction latency from submit() to the final reply for one request,
+// keyed by ECU and DID (service id for other requests), as a histogram with
+// power-of-two buckets starting at 250 us.
+struct UdsLatency {
+  uint32_t txId = 0;
+  uint16_t key = 0;
+  uint32_t count = 0;
+  uint16_t buckets[UDS_LATENCY_BUCKETS] = {0};
+};
+
+// Bus figures over the last whole second. Load covers our own frames plus
+// received frames that pass the acceptance filter; with CAN_HW_FILTER off
+// that is the whole bus.
+struct UdsBusLoad {
+  uint16_t rxPerSecond = 0;
+  uint16_t txPerSecond = 0;
+  float loadPercent = 0;
+};
+
+enum UdsStatus : uint8_t {
+  UDS_IDLE = 0,
+  UDS_PENDING,
+  UDS_COMPLETE,
+  UDS_NEGATIVE,  // ECU answered 0x7F; poll() reports the NRC
+  UDS_FAILED
+};
+
+// One ECU's reply to a functionally addressed request. The caller provides
+// data/capacity; rxId, length and complete are filled in.
+struct UdsResponse {
+  uint32_t rxId = 0;
+  bool extended = false;
+  uint8_t* data = nullptr;
+  uint16_t capacity = 0;
+  uint16_t length = 0;
+  bool complete = false;
+};
+
+enum UdsDiagState : uint8_t {
+  UDS_DIAG_CLOSED = 0,
+  UDS_DIAG_OPENING,
+  UDS_DIAG_OPEN
+};
+
+// A non-default diagnostic session held open on one ECU.
+struct UdsDiagSession {
+  uint32_t txId = 0;
+  uint32_t rxId = 0;
+  bool txExtended = false;
+  bool rxExtended = false;
+  uint8_t type = 0;
+  UdsDiagState state = UDS_DIAG_CLOSED;
+  int handle = -1;
+  uint32_t lastTxMs = 0;
+  uint32_t retryMs = 0;
+  uint8_t response[8] = {0};
+};
+
+// Fixed set of response buffers allocated once at startup (in PSRAM when the
+// board has it) and lent to in-flight transactions, so large DIDs never live
+// on the stack. Used from the main loop only.
+class UdsBufferPool {
+public:
+  bool init(uint8_t count, uint16_t bufferSize);
+  uint8_t* acquire();
+  void release(uint8_t* buffer);
+  uint16_t bufferSize() const { return m_bufferSize; }
+  uint8_t available() const;
+
+private:
+  uint8_t* m_memory = nullptr;
+  uint16_t m_bufferSize = 0;
+  uint8_t m_count = 0;
+  uint32_t m_inUse = 0;
 };
 
-class UdsClient {
+class UdsClient : public IsoTpLink {
 public:
+  // rxIds registered before begin() are programmed into the acceptance
+  // filter; anything the filter cannot express exactly is dropped in software.
+  // Ids added later (submit() registers its own) only pass if the filter
+  // already happens to cover them.
+  bool addRxId(uint32_t id, bool extended);
+  // forget all registered rxIds; only while stopped
+  void clearRxIds();
+  // the controller used from the next begin(); defaults to the platform's own
+  void setTransport(CanTransport* transport);
   bool begin(uint32_t baud = 500000);
   void end();
+  // Listens (without acknowledging) at 500k, 250k and 1M until one rate
+  // receives frames cleanly. Returns that rate, or 0 if the bus stayed silent
+  // or every rate saw errors. Only while stopped.
+  uint32_t detectBitrate();
+  // frames from ids that are not registered rxIds go to the sniff channel;
+  // sniff ids registered before begin() are added to the acceptance filter
+  bool addSniffId(uint32_t id, bool extended);
+  void enableSniff(bool enabled) { m_sniffEnabled = enabled; }
+  // every received frame is also handed to the recorder; with a recorder set
+  // before begin() the acceptance filter is opened to the whole bus
+  void setRecorder(CanFrameSink* recorder) { m_recorder = recorder; }
+  bool readSniffed(UdsFrame& frame) { return m_sniffRing.pop(frame); }
+  // ISO-TP flow control settings used for every transaction sent to txId
+  bool setIsoTpParams(uint32_t txId, const IsoTpParams& params);
+  // open DiagnosticSessionControl <type> on the ECU once and keep it alive
+  // with TesterPresent; it is reopened if the ECU drops back to default
+  bool setDiagnosticSession(uint32_t txId, bool txExtended,
+                            uint32_t rxId, bool rxExtended, uint8_t type);
+  const UdsStats& stats();
+  void printStats();
+  const UdsBusLoad& busLoad() const { return m_load; }
+  // latency percentile (0-100) in microseconds for a DID on txId; false if never measured
+  bool latencyPercentile(uint32_t txId, uint16_t did, uint8_t percentile, uint32_t& us) const;
+  // bus load, rates, queue high-water mark, per-id counters and latency as JSON
+  int statsJson(char* buffer, int bufferSize) const;
+  // true between begin() and end()
+  bool started() const { return m_started; }
+  // true from a bus-off until the controller has recovered and restarted;
+  // frames cannot be sent meanwhile
+  bool busOff() const { return m_busOff; }
+  // changes with every bus-off, so a caller can tell a transaction it
+  // started was cut short by one
+  uint32_t busOffCount() const { return m_stats.busOff; }
+
+  // Asynchronous API: submit() starts a transaction and returns its handle,
+  // process() demultiplexes received frames by rxId and runs timers, poll()
+  // reports the outcome once and frees the slot. One transaction may be in
+  // flight per tx/rx address pair, up to UDS_MAX_SESSIONS in total.
+  // responsePending (0x78) replies are absorbed and the transaction keeps
+  // waiting up to UDS_P2STAR_TIMEOUT for the final answer.
+  int submit(uint32_t txId, bool txExtended,
+             uint32_t rxId, bool rxExtended,
+             const uint8_t* payload, uint8_t payloadLen,
+             uint8_t* response, uint16_t responseCapacity,
+             uint32_t timeoutMs = 200);
+  void process();
+  UdsStatus poll(int handle, uint16_t* responseLen = nullptr, uint8_t* nrc = nullptr);
+  bool busy() const;
+  bool busy(uint32_t txId, uint32_t rxId) const;
 
   bool request(uint32_t txId, bool txExtended,
                uint32_t rxId, bool rxExtended,
@@ -20,6 +204,24 @@ public:
                uint8_t* response, uint16_t* responseLen,
                uint32_t timeoutMs = 200);
 
+  // Functional addressing (0x7DF, or 0x18DB33xx with tester address xx):
+  // submitFunctional() sends one single-frame request; process() then
+  // collects every ECU's reply within timeoutMs, reassembling multi-frame
+  // replies from several ECUs in parallel. Flow control goes to each
+  // responder's physical address. pollFunctional() reports UDS_PENDING until
+  // the window has closed and no reply is still arriving, then UDS_COMPLETE
+  // once with the number of ECUs that answered in *count. The request is
+  // refused while physical transactions are in flight, and submit() is
+  // refused while it runs, as replies share the physical response ids.
+  // Call listenFunctional() before begin() so the acceptance filter passes
+  // the physical response ids (0x7E8-0x7EF or 0x18DAxxyy).
+  void listenFunctional(bool extended) { m_functionalFilter[extended ? 1 : 0] = true; }
+  bool submitFunctional(uint32_t txId, bool txExtended,
+                        const uint8_t* payload, uint8_t payloadLen,
+                        UdsResponse* responses, uint8_t maxResponses,
+                        uint32_t timeoutMs = 100);
+  UdsStatus pollFunctional(uint8_t* count = nullptr);
+
   bool writeDataByIdentifier(uint32_t txId, bool txExtended,
                              uint32_t rxId, bool rxExtended,
                              uint16_t did, const uint8_t* data,
@@ -27,14 +229,89 @@ public:
                              uint8_t* response, uint16_t* responseLen,
                              uint32_t timeoutMs = 200);
 
+  bool sendFrame(const UdsFrame& frame) override;
+
 private:
-  bool sendFrame(uint32_t id, bool extended, const uint8_t* data, uint8_t len, uint32_t timeoutMs = 50);
+  static void rxTask(void* arg);
+  void rxLoop();
+  void serviceAlerts(uint32_t waitMs);
+  static void countFrame(UdsIdTable& table, const UdsFrame& frame);
+  void rollStats();
+  void recordLatency(uint8_t index);
+  const UdsLatency* findLatency(uint32_t txId, uint16_t key) const;
   bool readFrame(UdsFrame& frame, uint32_t timeoutMs);
+  int findRxId(const UdsFrame& frame) const;
+  const IsoTpParams& paramsFor(uint32_t txId) const;
+  int startSession(uint32_t txId, bool txExtended,
+                   uint32_t rxId, bool rxExtended,
+                   const uint8_t* payload, uint8_t payloadLen,
+                   uint8_t* response, uint16_t responseCapacity,
+                   uint32_t timeoutMs);
+  void checkCompleted(uint8_t index, uint32_t nowUs);
+  void serviceFunctional(uint32_t nowUs);
+  void serviceDiagSessions(uint32_t nowMs);
+  UdsDiagSession* diagFor(uint32_t txId);
 
-  bool sendIsoTp(uint32_t txId, bool txExtended, uint32_t rxId, bool rxExtended,
-                 const uint8_t* payload, uint8_t payloadLen, uint32_t timeoutMs);
-  bool readIsoTp(uint32_t txId, bool txExtended, uint32_t rxId, bool rxExtended,
-                 uint8_t* response, uint16_t* responseLen, uint32_t timeoutMs);
-
+  CanTransport* m_can = defaultCanTransport();
   bool m_started = false;
+  volatile bool m_rxRunning = false;
+  volatile bool m_busOff = false;
+  void* volatile m_rxTask = nullptr;
+  bool m_sniffEnabled = false;
+  CanFrameSink* m_recorder = nullptr;
+  FrameRing<UDS_RX_RING_SIZE> m_rxRings[UDS_MAX_RX_IDS];
+  FrameRing<UDS_SNIFF_RING_SIZE> m_sniffRing;
+  UdsRxId m_rxIds[UDS_MAX_RX_IDS];
+  std::atomic<uint8_t> m_rxIdCount{0};
+  UdsRxId m_sniffIds[UDS_MAX_RX_IDS];
+  uint8_t m_sniffIdCount = 0;
+  UdsStats m_stats;
+  uint32_t m_baud = 500000;
+  // rx table/bits are written by the receive task, tx, load and latency by
+  // the main loop; statsJson() reads them from the web server task. Every
+  // access from more than one task holds m_statsLock.
+#ifdef ESP_PLATFORM
+  mutable portMUX_TYPE m_statsLock = portMUX_INITIALIZER_UNLOCKED;
+#else
+  mutable std::mutex m_statsLock;
+#endif
+  UdsIdTable m_rxIdTable;
+  UdsIdTable m_txIdTable;
+  uint32_t m_rxBits = 0;
+  uint32_t m_txBits = 0;
+  uint32_t m_txFrames = 0;
+  uint32_t m_lastRxBits = 0;
+  uint32_t m_lastTxBits = 0;
+  uint32_t m_lastRxFrames = 0;
+  uint32_t m_lastTxFrames = 0;
+  uint32_t m_lastRollMs = 0;
+  UdsBusLoad m_load;
+  UdsLatency m_latency[UDS_MAX_LATENCY_KEYS];
+  uint8_t m_latencyCount = 0;
+  uint32_t m_startUs[UDS_MAX_SESSIONS] = {0};
+  uint16_t m_latencyKey[UDS_MAX_SESSIONS] = {0};
+  IsoTpSession m_sessions[UDS_MAX_SESSIONS];
+  bool m_checked[UDS_MAX_SESSIONS] = {false};
+  uint8_t m_pendingReplies[UDS_MAX_SESSIONS] = {0};
+  UdsDiagSession m_diag[UDS_MAX_ECU_PARAMS];
+  uint8_t m_diagCount = 0;
+  bool m_functionalFilter[2] = {false, false};
+  std::atomic<bool> m_functionalActive{false};
+  bool m_functionalExtended = false;
+  uint32_t m_functionalMask = 0;
+  uint32_t m_functionalMatch = 0;
+  FrameRing<UDS_FUNCTIONAL_RING_SIZE> m_functionalRing;
+  IsoTpSession m_responders[UDS_MAX_RESPONDERS];
+  uint8_t m_responderPending[UDS_MAX_RESPONDERS] = {0};
+  UdsResponse* m_functionalResponses = nullptr;
+  uint8_t m_functionalSid = 0;
+  uint8_t m_functionalMax = 0;
+  uint8_t m_functionalCount = 0;
+  uint32_t m_functionalTimeoutUs = 0;
+  uint32_t m_functionalEndUs = 0;
+  UdsStatus m_functionalStatus = UDS_IDLE;
+  uint32_t m_paramTxIds[UDS_MAX_ECU_PARAMS] = {0};
+  IsoTpParams m_params[UDS_MAX_ECU_PARAMS];
+  uint8_t m_paramCount = 0;
+  IsoTpParams m_defaultParams;
 };
@@ -0,0 +1,17 @@
+#ifndef UDSCONFIG_H_INCLUDED
+#define UDSCONFIG_H_INCLUDED
+
+/**************************************
+* CAN/UDS protocol settings, shared with host builds
+* (no ESP-IDF headers here; pins stay in config.h)
+**************************************/
+// program the TWAI acceptance filter from configured rxIds (0 accepts all frames)
+#ifndef CAN_HW_FILTER
+#define CAN_HW_FILTER 1
+#endif
+// how long an ECU may take to answer after a UDS responsePending (0x78) reply
+#define UDS_P2STAR_TIMEOUT 5000 /* ms */
+// TesterPresent interval that keeps a non-default diagnostic session open
+#define UDS_TESTER_PRESENT_INTERVAL 2000 /* ms */
+
+#endif
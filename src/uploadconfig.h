@@ -0,0 +1,15 @@
+#ifndef UPLOADCONFIG_H_INCLUDED
+#define UPLOADCONFIG_H_INCLUDED
+
+/**************************************
+* ABRP upload settings, shared with host builds
+* (no ESP-IDF headers here; TLS settings stay in config.h)
+**************************************/
+// ABRP telemetry API, overridden by ABRP-server in config.cfg (http:// for a local stand-in)
+#define ABRP_SERVER_URL "https://api.iternio.com/1/tlm/send"
+// connect and reply timeout of one ABRP upload
+#define ABRP_UPLOAD_TIMEOUT 5000 /* ms */
+// longest wait between retries while ABRP uploads fail
+#define ABRP_UPLOAD_MAX_BACKOFF 60000 /* ms */
+
+#endif
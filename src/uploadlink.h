@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Byte stream to the ABRP telemetry server. AbrpUploader keeps one connection
+// open across uploads and only calls connect() again once it has dropped, so a
+// TLS handshake is paid once per connection rather than once per sample.
+class UploadLink {
+public:
+  virtual ~UploadLink() {}
+  virtual bool connect(const char* host, uint16_t port, bool tls, uint32_t timeoutMs) = 0;
+  virtual bool connected() = 0;
+  // false unless every byte was written
+  virtual bool write(const uint8_t* data, size_t len) = 0;
+  // bytes read, 0 on timeout, -1 once the peer has closed the connection
+  virtual int read(uint8_t* data, size_t len, uint32_t timeoutMs) = 0;
+  virtual void close() = 0;
+};
+
+// WiFi (plain or TLS) on the ESP32, a TCP socket on Linux
+UploadLink* defaultUploadLink();
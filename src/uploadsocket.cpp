@@ -0,0 +1,106 @@
+#include "uploadsocket.h"
+
+#if defined(__linux__) && !defined(ESP_PLATFORM)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+// non-blocking connect so a dead host gives up after timeoutMs
+bool connectWithin(int fd, const sockaddr* addr, socklen_t addrLen, uint32_t timeoutMs)
+{
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  int rc = ::connect(fd, addr, addrLen);
+  if (rc < 0 && errno == EINPROGRESS) {
+    pollfd pfd = {fd, POLLOUT, 0};
+    int error = 0;
+    socklen_t len = sizeof(error);
+    rc = ::poll(&pfd, 1, static_cast<int>(timeoutMs)) > 0 &&
+         getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0 ? 0 : -1;
+  }
+  fcntl(fd, F_SETFL, flags);
+  return rc == 0;
+}
+}
+
+bool SocketUploadLink::connect(const char* host, uint16_t port, bool tls, uint32_t timeoutMs)
+{
+  close();
+  if (tls) {
+    return false;
+  }
+  char service[8];
+  snprintf(service, sizeof(service), "%u", static_cast<unsigned int>(port));
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* result = nullptr;
+  if (getaddrinfo(host, service, &hints, &result) != 0) {
+    return false;
+  }
+  for (addrinfo* ai = result; ai && m_socket < 0; ai = ai->ai_next) {
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (connectWithin(fd, ai->ai_addr, ai->ai_addrlen, timeoutMs)) {
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      m_socket = fd;
+    } else {
+      ::close(fd);
+    }
+  }
+  freeaddrinfo(result);
+  return m_socket >= 0;
+}
+
+bool SocketUploadLink::write(const uint8_t* data, size_t len)
+{
+  while (m_socket >= 0 && len > 0) {
+    ssize_t n = ::send(m_socket, data, len, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    len -= static_cast<size_t>(n);
+  }
+  return m_socket >= 0;
+}
+
+int SocketUploadLink::read(uint8_t* data, size_t len, uint32_t timeoutMs)
+{
+  if (m_socket < 0) {
+    return -1;
+  }
+  pollfd pfd = {m_socket, POLLIN, 0};
+  if (::poll(&pfd, 1, static_cast<int>(timeoutMs)) <= 0) {
+    return 0;
+  }
+  ssize_t n = ::recv(m_socket, data, len, 0);
+  return n > 0 ? static_cast<int>(n) : -1;
+}
+
+void SocketUploadLink::close()
+{
+  if (m_socket >= 0) {
+    ::close(m_socket);
+    m_socket = -1;
+  }
+}
+
+UploadLink* defaultUploadLink()
+{
+  static SocketUploadLink socketLink;
+  return &socketLink;
+}
+
+#endif
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "uploadlink.h"
+
+#if defined(__linux__) && !defined(ESP_PLATFORM)
+
+// Plain TCP for host builds, so the uploader can run against a local HTTP
+// stand-in (tools/abrpstub.py). TLS is not available here; connect() fails
+// for https servers.
+class SocketUploadLink : public UploadLink {
+public:
+  bool connect(const char* host, uint16_t port, bool tls, uint32_t timeoutMs) override;
+  bool connected() override { return m_socket >= 0; }
+  bool write(const uint8_t* data, size_t len) override;
+  int read(uint8_t* data, size_t len, uint32_t timeoutMs) override;
+  void close() override;
+
+private:
+  int m_socket = -1;
+};
+
+#endif
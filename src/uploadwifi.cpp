@@ -0,0 +1,85 @@
+#include "uploadwifi.h"
+
+#ifdef ESP_PLATFORM
+
+#include <Arduino.h>
+#include "config.h"
+#include "abrpca.h"
+
+#ifndef ABRP_SERVER_CA
+#define ABRP_SERVER_CA ABRP_ROOT_CA_BUNDLE
+#endif
+
+bool WifiUploadLink::connect(const char* host, uint16_t port, bool tls, uint32_t timeoutMs)
+{
+  close();
+  if (!WiFi.isConnected()) {
+    return false;
+  }
+  // the 3-argument connect() is not virtual, so call it on the concrete client
+  bool ok = false;
+  if (tls) {
+#ifdef ABRP_TLS_INSECURE
+    m_secure.setInsecure();
+#else
+    m_secure.setCACert(ABRP_SERVER_CA);
+#endif
+    m_secure.setHandshakeTimeout((timeoutMs + 999) / 1000);
+    ok = m_secure.connect(host, port, static_cast<int32_t>(timeoutMs));
+    m_client = &m_secure;
+  } else {
+    ok = m_plain.connect(host, port, static_cast<int32_t>(timeoutMs));
+    m_client = &m_plain;
+  }
+  if (!ok) {
+    close();
+    return false;
+  }
+  m_client->setNoDelay(true);
+  return true;
+}
+
+bool WifiUploadLink::connected()
+{
+  return m_client && m_client->connected();
+}
+
+bool WifiUploadLink::write(const uint8_t* data, size_t len)
+{
+  return m_client && m_client->write(data, len) == len;
+}
+
+int WifiUploadLink::read(uint8_t* data, size_t len, uint32_t timeoutMs)
+{
+  if (!m_client) {
+    return -1;
+  }
+  uint32_t start = millis();
+  while (m_client->available() <= 0) {
+    if (!m_client->connected()) {
+      return -1;
+    }
+    if (millis() - start >= timeoutMs) {
+      return 0;
+    }
+    delay(5);
+  }
+  int n = m_client->read(data, len);
+  return n > 0 ? n : 0;
+}
+
+void WifiUploadLink::close()
+{
+  if (m_client) {
+    m_client->stop();
+    m_client = nullptr;
+  }
+}
+
+UploadLink* defaultUploadLink()
+{
+  static WifiUploadLink wifi;
+  return &wifi;
+}
+
+#endif
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "uploadlink.h"
+
+#ifdef ESP_PLATFORM
+
+#include <WiFi.h>
+#include <WiFiClientSecure.h>
+
+// Station WiFi brought up by the telemetry task. The server certificate is
+// checked against ABRP_SERVER_CA (the roots in abrpca.h by default) unless
+// ABRP_TLS_INSECURE is defined.
+class WifiUploadLink : public UploadLink {
+public:
+  bool connect(const char* host, uint16_t port, bool tls, uint32_t timeoutMs) override;
+  bool connected() override;
+  bool write(const uint8_t* data, size_t len) override;
+  int read(uint8_t* data, size_t len, uint32_t timeoutMs) override;
+  void close() override;
+
+private:
+  WiFiClient m_plain;
+  WiFiClientSecure m_secure;
+  WiFiClient* m_client = nullptr;
+};
+
+#endif
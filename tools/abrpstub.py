@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+"""Local stand-in for the ABRP telemetry API, for testing the uploader.
+
+    abrpstub.py --port 8080
+    ; config.cfg, [ABRP]
+    ABRP-server=http://<this host>:8080/1/tlm/send
+
+Accepts POST /1/tlm/send?token=...&api_key=... with a form body tlm=<json>,
+prints every record with the connection it arrived on, and answers like ABRP
+with {"status": "ok"}. Connections are kept alive, so a healthy uploader shows
+one connection number across many records. --close-every N closes the
+connection after every Nth reply and --status answers with another HTTP
+status, to exercise reconnects and backoff; --chunked sends chunked replies.
+"""
+
+import argparse
+import http.server
+import itertools
+import json
+import urllib.parse
+
+CONNECTIONS = itertools.count(1)
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    options = None
+    replies = 0
+
+    def setup(self):
+        super().setup()
+        self.connection_id = next(CONNECTIONS)
+
+    def do_POST(self):
+        url = urllib.parse.urlsplit(self.path)
+        query = urllib.parse.parse_qs(url.query)
+        length = int(self.headers.get("Content-Length", 0))
+        form = urllib.parse.parse_qs(self.rfile.read(length).decode())
+        Handler.replies += 1
+
+        status = self.options.status
+        if url.path != self.options.path or "token" not in query or "tlm" not in form:
+            status = 400
+            body = {"status": "error", "message": "missing token or tlm"}
+        else:
+            try:
+                record = json.loads(form["tlm"][0])
+                print(f"#{self.connection_id} token={query['token'][0]} {json.dumps(record)}", flush=True)
+                body = {"status": "ok"} if status == 200 else {"status": "error"}
+            except ValueError:
+                status = 400
+                body = {"status": "error", "message": "bad tlm"}
+
+        close = self.options.close_every and Handler.replies % self.options.close_every == 0
+        payload = json.dumps(body).encode()
+        self.send_response(status)
+        self.send_header("Content-Type", "application/json")
+        if close:
+            self.send_header("Connection", "close")
+            self.close_connection = True
+        if self.options.chunked:
+            self.send_header("Transfer-Encoding", "chunked")
+            self.end_headers()
+            self.wfile.write(b"%x\r\n%s\r\n0\r\n\r\n" % (len(payload), payload))
+        else:
+            self.send_header("Content-Length", str(len(payload)))
+            self.end_headers()
+            self.wfile.write(payload)
+
+    def log_message(self, format, *args):
+        pass
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--path", default="/1/tlm/send")
+    parser.add_argument("--status", type=int, default=200, help="HTTP status of every reply")
+    parser.add_argument("--close-every", type=int, default=0, help="close the connection after every Nth reply")
+    parser.add_argument("--chunked", action="store_true", help="chunked transfer encoding")
+    Handler.options = parser.parse_args()
+    server = http.server.ThreadingHTTPServer(("", Handler.options.port), Handler)
+    print(f"ABRP stand-in on port {Handler.options.port}", flush=True)
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
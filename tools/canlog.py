@@ -0,0 +1,75 @@
+#!/usr/bin/env python3
+"""Convert a CAN-<n>.bin recording from the SD card to candump or ASC text.
+
+Layout (see src/canrecorder.h): 4096-byte blocks, each a 16-byte header
+(magic "CANR", record count, version, base time in us) followed by up to 255
+16-byte records (offset|DLC<<28, id|extended<<31, 8 data bytes).
+
+    canlog.py CAN-12.bin                 candump -L format on stdout
+    canlog.py --asc CAN-12.bin > 12.asc  Vector ASC
+"""
+
+import argparse
+import struct
+import sys
+
+BLOCK_SIZE = 4096
+HEADER = struct.Struct("<IHHQ")
+RECORD = struct.Struct("<II8s")
+MAGIC = 0x524E4143
+VERSION = 1
+
+
+def frames(path):
+    with open(path, "rb") as f:
+        index = 0
+        while True:
+            block = f.read(BLOCK_SIZE)
+            if len(block) < BLOCK_SIZE:
+                return
+            magic, count, version, base = HEADER.unpack_from(block)
+            if magic != MAGIC or version != VERSION:
+                print("skipping bad block %d" % index, file=sys.stderr)
+            else:
+                for i in range(count):
+                    offset, ident, data = RECORD.unpack_from(block, HEADER.size + i * RECORD.size)
+                    dlc = offset >> 28
+                    yield (base + (offset & 0x0FFFFFFF), ident & 0x1FFFFFFF,
+                           bool(ident & 0x80000000), data[:dlc])
+            index += 1
+
+
+def write_candump(records, out, iface):
+    for us, ident, extended, data in records:
+        name = ("%08X" if extended else "%03X") % ident
+        out.write("(%d.%06d) %s %s#%s\n" % (us // 1000000, us % 1000000, iface, name, data.hex().upper()))
+
+
+def write_asc(records, out):
+    out.write("base hex  timestamps absolute\nno internal events logged\n")
+    start = None
+    for us, ident, extended, data in records:
+        if start is None:
+            start = us
+        t = (us - start) / 1e6
+        name = ("%Xx" if extended else "%X") % ident
+        body = " ".join("%02X" % b for b in data)
+        out.write("%11.6f 1  %-15s Rx   d %d %s\n" % (t, name, len(data), body))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("file")
+    parser.add_argument("--asc", action="store_true", help="write Vector ASC instead of candump")
+    parser.add_argument("--iface", default="can0", help="interface name for candump output")
+    args = parser.parse_args()
+
+    records = frames(args.file)
+    if args.asc:
+        write_asc(records, sys.stdout)
+    else:
+        write_candump(records, sys.stdout, args.iface)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+"""Simulated UDS ECU on a Linux SocketCAN interface, for host runs of UdsClient.
+
+    sudo ip link add dev vcan0 type vcan && sudo ip link set up vcan0
+    vecu.py --tx 7E4 --rx 7EC --did 0101:62 --did 0105:45 vcan0
+
+Answers ReadDataByIdentifier (0x22, one or more DIDs), TesterPresent and
+DiagnosticSessionControl on the physical request id, and 0x3E on the
+functional id 0x7DF. Each --did is DID:LENGTH; the data bytes are a counter
+that changes with every reply, so decoders see moving values. Unknown DIDs get
+requestOutOfRange (0x31). Multi-frame replies wait for the tester's flow
+control and honour its block size and STmin.
+"""
+
+import argparse
+import socket
+import struct
+import time
+
+CAN_EFF_FLAG = 0x80000000
+CAN_FRAME = struct.Struct("=IB3x8s")
+FUNCTIONAL_ID = 0x7DF
+
+
+class Ecu:
+    def __init__(self, sock, tx, rx, extended, dids):
+        self.sock = sock
+        self.tx = tx
+        self.rx = rx
+        self.extended = extended
+        self.dids = dids
+        self.counter = 0
+
+    def send(self, data):
+        can_id = self.rx | (CAN_EFF_FLAG if self.extended else 0)
+        self.sock.send(CAN_FRAME.pack(can_id, len(data), bytes(data).ljust(8, b"\0")))
+
+    def recv(self, timeout):
+        self.sock.settimeout(timeout)
+        try:
+            can_id, dlc, data = CAN_FRAME.unpack(self.sock.recv(16))
+        except socket.timeout:
+            return None, None
+        return can_id, data[:dlc]
+
+    def wait_flow_control(self):
+        deadline = time.monotonic() + 1.0
+        while time.monotonic() < deadline:
+            can_id, data = self.recv(deadline - time.monotonic())
+            if can_id is not None and (can_id & 0x1FFFFFFF) == self.tx and data and data[0] >> 4 == 3:
+                if data[0] & 0x0F == 1:
+                    deadline = time.monotonic() + 1.0
+                    continue
+                st = data[2]
+                stmin = st / 1000.0 if st <= 0x7F else (st - 0xF0) / 10000.0 if 0xF1 <= st <= 0xF9 else 0.127
+                return data[1], stmin
+        return None
+
+    def reply(self, payload):
+        if len(payload) <= 7:
+            self.send([len(payload)] + list(payload))
+            return
+        self.send([0x10 | (len(payload) >> 8), len(payload) & 0xFF] + list(payload[:6]))
+        offset, seq = 6, 1
+        while offset < len(payload):
+            fc = self.wait_flow_control()
+            if fc is None:
+                return
+            block_size, stmin = fc
+            sent = 0
+            while offset < len(payload) and (block_size == 0 or sent < block_size):
+                self.send([0x20 | seq] + list(payload[offset:offset + 7]))
+                offset += 7
+                seq = (seq + 1) & 0x0F
+                sent += 1
+                time.sleep(stmin)
+
+    def handle(self, request):
+        sid = request[0]
+        if sid == 0x3E:
+            if len(request) < 2 or not request[1] & 0x80:
+                self.reply([0x7E, 0x00])
+        elif sid == 0x10 and len(request) >= 2:
+            self.reply([0x50, request[1], 0x00, 0x32, 0x01, 0xF4])
+        elif sid == 0x22 and len(request) >= 3 and len(request) % 2 == 1:
+            self.counter = (self.counter + 1) & 0xFF
+            payload = [0x62]
+            for i in range(1, len(request), 2):
+                did = (request[i] << 8) | request[i + 1]
+                if did in self.dids:
+                    payload += [request[i], request[i + 1]]
+                    payload += [(self.counter + n) & 0xFF for n in range(self.dids[did])]
+            if len(payload) == 1:
+                self.reply([0x7F, sid, 0x31])
+            else:
+                self.reply(payload)
+        else:
+            self.reply([0x7F, sid, 0x11])
+
+    def run(self):
+        while True:
+            can_id, data = self.recv(None)
+            if not data:
+                continue
+            ident = can_id & 0x1FFFFFFF
+            if ident not in (self.tx, FUNCTIONAL_ID) or data[0] >> 4 != 0:
+                continue
+            length = data[0] & 0x0F
+            if 0 < length < len(data):
+                request = data[1:1 + length]
+                if ident == self.tx or request[0] == 0x3E:
+                    self.handle(request)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("interface")
+    parser.add_argument("--tx", default="7E4", help="request id the tester sends to (hex)")
+    parser.add_argument("--rx", default="7EC", help="response id this ECU answers on (hex)")
+    parser.add_argument("--extended", action="store_true", help="29-bit ids")
+    parser.add_argument("--did", action="append", default=[], help="DID:LENGTH in hex:decimal")
+    args = parser.parse_args()
+
+    dids = {}
+    for item in args.did:
+        did, length = item.split(":")
+        dids[int(did, 16)] = int(length)
+
+    sock = socket.socket(socket.PF_CAN, socket.SOCK_RAW, socket.CAN_RAW)
+    sock.bind((args.interface,))
+    Ecu(sock, int(args.tx, 16), int(args.rx, 16), args.extended, dids).run()
+
+
+if __name__ == "__main__":
+    main()